@@ -0,0 +1,111 @@
+/*
+	FmcDelay1ns4Cha (a.k.a. The Fine Delay Card)
+	User-space driver/library
+
+	Multi-card acquisition: per-card timestamp queues, passing the timestamps
+	from the thread reading out a card to the thread logging them, and the
+	time-ordered merge of the cards' streams.
+
+	(c) Copyright CERN 2012
+	Licensed under LGPL 2.1
+*/
+
+#ifndef __FDELAY_ACQ_H
+#define __FDELAY_ACQ_H
+
+#include "fdelay_lib.h"
+
+struct fdelay_acq_entry {
+  fdelay_time_t t;
+  uint64_t host_ns;		/* CLOCK_MONOTONIC time the timestamp was queued */
+  int flags;			/* FDELAY_ACQ_xxx, passed on to the merge */
+};
+
+struct fdelay_acq_stats {
+  uint64_t events;		/* timestamps taken out of the queue */
+  uint64_t full;		/* times the queue filled up (the card buffers the timestamps meanwhile) */
+  uint64_t backlog;		/* timestamps in the queue */
+  uint64_t max_backlog;		/* highest backlog found by the consumer */
+  uint64_t latency_sum_ns;	/* time the timestamps spent in the queue */
+  uint64_t latency_max_ns;
+};
+
+/* A single-producer, single-consumer queue of timestamps. It is lock-free: one thread (the card's readout)
+   calls fdelay_acq_space() and fdelay_acq_push(), another one fdelay_acq_pop(). */
+struct fdelay_acq_queue;
+
+/* Creates a queue of (size) entries (rounded up to a power of 2). Returns NULL on error. */
+struct fdelay_acq_queue *fdelay_acq_queue_create(int size);
+
+void fdelay_acq_queue_free(struct fdelay_acq_queue *q);
+
+/* (producer) Returns the number of timestamps that can be pushed without the queue overflowing. */
+int fdelay_acq_space(struct fdelay_acq_queue *q);
+
+/* (producer) Queues timestamp (t) with (flags) (FDELAY_ACQ_UNSYNCED or 0). Returns negative if the queue is full. */
+int fdelay_acq_push(struct fdelay_acq_queue *q, const fdelay_time_t *t, int flags);
+
+/* (consumer) Takes up to (n) entries out of the queue. Returns the number of entries copied to (e). */
+int fdelay_acq_pop(struct fdelay_acq_queue *q, struct fdelay_acq_entry *e, int n);
+
+/* Copies the queue statistics to (st). Can be called from any thread; the counters of the two sides
+   are sampled separately. */
+void fdelay_acq_get_stats(struct fdelay_acq_queue *q, struct fdelay_acq_stats *st);
+
+/* Event flags */
+#define FDELAY_ACQ_LATE		0x1	/* older than an event already emitted by the merge */
+#define FDELAY_ACQ_UNSYNCED	0x2	/* taken while the card had lost the WR sync: on its local oscillator */
+
+struct fdelay_acq_event {
+  fdelay_time_t t;
+  int card;			/* index of the card's queue in the merge */
+  int flags;			/* FDELAY_ACQ_xxx */
+};
+
+/* The merge emits an event once it can't be preceded by an event still to come:
+   - when every card has an event pending (each card's timestamps are in time order), or
+   - when it is older than (lateness_ps) before the newest timestamp queued by any card (the watermark), or
+   - when it was read out more than (max_delay_ms) ago, so that a card which stopped producing events
+     doesn't hold back the others (negative = no limit).
+   An event older than one already emitted (its card lagged behind the watermark) is late: it is emitted
+   right away with FDELAY_ACQ_LATE, or dropped if (drop_late) is set. With the cards producing events,
+   the output only depends on the timestamps, not on the timing of the readout.
+   FDELAY_ACQ_UNSYNCED events are emitted as they're taken out of their queue, in the card's order: their
+   time, on the card's local oscillator, isn't comparable to the others'. They don't move the watermark
+   and are never late; a card with only unsynchronized events pending counts as having none. */
+struct fdelay_acq_merge_config {
+  int64_t lateness_ps;
+  int max_delay_ms;
+  int drop_late;
+};
+
+#define FDELAY_ACQ_MERGE_DEFAULT_CONFIG { 1000000000LL, 1000, 0 }
+
+struct fdelay_acq_merge_stats {
+  uint64_t events;		/* events emitted */
+  uint64_t late;		/* late events (emitted or dropped) */
+  uint64_t dropped;
+  uint64_t forced;		/* events emitted because of (max_delay_ms) */
+  uint64_t latency_sum_ns;	/* time from the readout to the emission */
+  uint64_t latency_max_ns;
+};
+
+struct fdelay_acq_merge;
+
+/* Creates a merge of the (n) queues (queues). (cfg) = NULL selects FDELAY_ACQ_MERGE_DEFAULT_CONFIG.
+   The merge is the consumer of the queues. Returns NULL on error. */
+struct fdelay_acq_merge *fdelay_acq_merge_create(struct fdelay_acq_queue **queues, int n, const struct fdelay_acq_merge_config *cfg);
+
+void fdelay_acq_merge_free(struct fdelay_acq_merge *m);
+
+/* Takes the events out of the queues and copies up to (n) events which can be emitted, in time order,
+   to (ev). Returns their number. */
+int fdelay_acq_merge_poll(struct fdelay_acq_merge *m, struct fdelay_acq_event *ev, int n);
+
+/* Emits everything pending (the acquisition has stopped), in time order. Returns the number of events copied to (ev). */
+int fdelay_acq_merge_flush(struct fdelay_acq_merge *m, struct fdelay_acq_event *ev, int n);
+
+/* Copies the merge statistics to (st). Call from the merging thread. */
+void fdelay_acq_merge_get_stats(struct fdelay_acq_merge *m, struct fdelay_acq_merge_stats *st);
+
+#endif
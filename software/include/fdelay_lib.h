@@ -2,6 +2,7 @@
 #define __FD_LIB_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 /* Number of fractional bits in the timestamps/time definitions. Must be consistent with the HDL bitstream.  */
 #define FDELAY_FRAC_BITS 12
@@ -24,6 +25,50 @@
 /* fdelay_init() flags */
 #define FDELAY_RAW_READOUT 	0x1
 #define FDELAY_PERFORM_LONG_TESTS 0x2
+#define FDELAY_RESUME_INIT	0x4		/* continue a failed fdelay_init() from the stage that failed */
+#define FDELAY_WARM_ATTACH	0x8		/* reattach to an already running card without resetting it, if possible */
+
+/* fdelay_init_status() return values - the last completed initialization stage */
+#define FDELAY_INIT_NONE	  0
+#define FDELAY_INIT_DETECTED	  1		/* core and FMC found, calibration data loaded */
+#define FDELAY_INIT_RESET	  2		/* FMC hardware reset done */
+#define FDELAY_INIT_CLOCKS	  3		/* SPI GPIO expander and AD9516 PLL running */
+#define FDELAY_INIT_SENSORS	  4		/* temperature sensor found */
+#define FDELAY_INIT_CORE	  5		/* FD core out of reset, DDR PLL locked */
+#define FDELAY_INIT_TESTED	  6		/* ACAM bus (and optionally the DAC/VCXO) tests passed */
+#define FDELAY_INIT_CALIBRATED	  7		/* output delay lines calibrated */
+#define FDELAY_INIT_READY	  8		/* card fully operational */
+
+/* Phases of the card initialization, as reported by fdelay_get_init_profile() */
+#define FDELAY_PHASE_DETECT	  0		/* core detection, calibration EEPROM readout */
+#define FDELAY_PHASE_RESET	  1		/* FMC hardware reset */
+#define FDELAY_PHASE_PLL_LOCK	  2		/* SPI GPIO test, AD9516 configuration and lock */
+#define FDELAY_PHASE_SENSORS	  3		/* DS18x temperature sensor init */
+#define FDELAY_PHASE_CORE	  4		/* GPIO defaults, core reset, DDR PLL lock */
+#define FDELAY_PHASE_ACAM_TEST	  5		/* ACAM bus test (and the DAC test, if enabled) */
+#define FDELAY_PHASE_CALIB_CH1	  6		/* output delay line calibration, channels 1..4 */
+#define FDELAY_PHASE_CALIB_CH2	  7
+#define FDELAY_PHASE_CALIB_CH3	  8
+#define FDELAY_PHASE_CALIB_CH4	  9
+#define FDELAY_PHASE_ACAM_RMODE	  10	/* ACAM switches to R-Mode, I-Mode and G-Mode */
+#define FDELAY_PHASE_ACAM_IMODE	  11
+#define FDELAY_PHASE_ACAM_GMODE	  12
+#define FDELAY_PHASE_TOTAL	  13		/* the whole fdelay_init() call(s) */
+#define FDELAY_NUM_PHASES	  14
+
+struct fdelay_phase_stats {
+  const char *name;
+  int count;			/* how many times the phase was executed */
+  int64_t time_us;		/* total time spent in the phase, in microseconds */
+  uint64_t bus_reads;		/* number of bus read/write accesses done in the phase */
+  uint64_t bus_writes;
+};
+
+/* Initialization timing profile. Phases may nest (e.g. ACAM mode switches happen during
+   the delay line calibration), so the phase times don't add up to the total. */
+struct fdelay_init_profile {
+  struct fdelay_phase_stats phases[FDELAY_NUM_PHASES];
+};
 
 /* Hardware "handle" structure */
 typedef struct fdelay_device
@@ -68,6 +113,10 @@ PUBLIC API
 
 fdelay_device_t *fdelay_create();
 
+/* Attaches (dev) to the card at (location): "spec:<slot>,<core_base>", "svec:<slot>,<map_base>,<core_base>"
+   or "sim:[<latency>]" for the simulated card. Returns 0 on success, negative on error. */
+int fdelay_probe(fdelay_device_t *dev, const char *location);
+
 /* Creates a local instance of Fine Delay Core at address base_addr on the SPEC at bus/devfn. Returns 0 on success, negative on error. */
 int spec_fdelay_create_bd(fdelay_device_t *dev, int bus, int dev_fn, uint32_t base);
 
@@ -78,12 +127,90 @@ int spec_fdelay_create(fdelay_device_t *dev, int argc, char *argv[]);
 fdelay_time_t fdelay_from_picos(const uint64_t ps);
 int64_t fdelay_to_picos(const fdelay_time_t t);
 
+/* Array versions of the above, converting (n) values at once */
+void fdelay_from_picos_batch(const uint64_t *ps, fdelay_time_t *t, int n);
+void fdelay_to_picos_batch(const fdelay_time_t *t, int64_t *ps, int n);
+
+/* Timestamp arithmetic (fdelay_ts.c). Arguments and results are normalized timestamps
+   (0 <= coarse < 125000000, 0 <= frac < 4096), except for fdelay_ts_normalize() which
+   accepts any frac/coarse values. */
+fdelay_time_t fdelay_ts_add(fdelay_time_t a, fdelay_time_t b);
+fdelay_time_t fdelay_ts_sub(fdelay_time_t a, fdelay_time_t b);
+int fdelay_ts_cmp(fdelay_time_t a, fdelay_time_t b);
+fdelay_time_t fdelay_ts_normalize(fdelay_time_t a);
+fdelay_time_t fdelay_ts_scale(fdelay_time_t a, int64_t n);
+fdelay_time_t fdelay_ts_add_ps(fdelay_time_t a, int64_t ps);
+
 /* Enables/disables raw timestamp readout mode (debugging only) */
 int fdelay_raw_readout(fdelay_device_t *dev, int raw_moide);
 
 /* Initializes and calibrates the device. 0 = success, negative = error */
 int fdelay_init(fdelay_device_t *dev, int init_flags);
 
+/* Returns the last completed initialization stage (FDELAY_INIT_xxx). After a failed fdelay_init(),
+   calling it again with FDELAY_RESUME_INIT continues from the stage that failed. */
+int fdelay_init_status(fdelay_device_t *dev);
+
+/* Copies the timing profile of the initialization phases of the card to (prof). */
+int fdelay_get_init_profile(fdelay_device_t *dev, struct fdelay_init_profile *prof);
+
+/* Enables (enable = 1) or disables (enable = 0) the collection of per call-site bus access counters
+   and latency histograms. Disabling frees the collected statistics. */
+int fdelay_bus_stats_enable(fdelay_device_t *dev, int enable);
+
+/* Clears the collected bus access statistics. */
+void fdelay_bus_stats_reset(fdelay_device_t *dev);
+
+/* Prints the bus access statistics to (f), hottest call sites first. */
+int fdelay_bus_stats_dump(fdelay_device_t *dev, FILE *f);
+
+/* Bus access trace file: a header followed by (n_records) records, oldest first, in host byte order */
+#define FDELAY_TRACE_MAGIC "FDTRACE1"
+#define FDELAY_TRACE_WRITE 0x80000000	/* set in fdelay_trace_record.addr for writes */
+
+struct fdelay_trace_header {
+  char magic[8];		/* FDELAY_TRACE_MAGIC */
+  uint32_t base_addr;		/* base address of the core, the record addresses are relative to it */
+  uint32_t reserved;
+  uint64_t n_records;
+  uint64_t lost;		/* accesses overwritten in the ring before the trace was saved */
+};
+
+struct fdelay_trace_record {
+  uint64_t ns;			/* host monotonic time of the access */
+  uint32_t addr;		/* register offset from the core base, FDELAY_TRACE_WRITE for writes */
+  uint32_t data;		/* value written or read */
+};
+
+/* Enables recording of the last (n_entries) bus accesses (rounded up to a power of 2) in a ring buffer.
+   n_entries = 0 disables the trace and frees the buffer. If the FDELAY_BUS_TRACE environment variable is set,
+   fdelay_init() enables the trace and saves it to the file it names when the initialization fails. */
+int fdelay_bus_trace_enable(fdelay_device_t *dev, int n_entries);
+
+/* Empties the bus access trace. */
+void fdelay_bus_trace_reset(fdelay_device_t *dev);
+
+/* Saves the bus access trace to (filename). Returns the number of accesses saved, negative on error. */
+int fdelay_bus_trace_save(fdelay_device_t *dev, const char *filename);
+
+/* Prints a saved bus access trace read from (in) to (out) in text form, with register names. */
+int fdelay_bus_trace_decode(FILE *in, FILE *out);
+
+/* Log levels. Messages up to the trace level are kept in an in-memory ring buffer, messages up to
+   the console level are also printed to stderr. The defaults are INFO and WARN; the FDELAY_LOG_LEVEL
+   environment variable (a number or a level name) sets the console level at fdelay_init(). */
+#define FDELAY_LOG_NONE		-1
+#define FDELAY_LOG_ERR		0
+#define FDELAY_LOG_WARN		1
+#define FDELAY_LOG_INFO		2
+#define FDELAY_LOG_DEBUG	3
+
+/* Sets the library-wide log levels */
+void fdelay_set_log_level(int trace_level, int console_level);
+
+/* Prints the messages in the trace buffer to (f), oldest first. Returns the number of messages printed. */
+int fdelay_log_dump(FILE *f);
+
 /* Disables and releases the resources for a given FD Card */
 int fdelay_release(fdelay_device_t *dev);
 
@@ -103,6 +230,20 @@ int fdelay_set_timing_reference(fdelay_device_t *dev, int ref_source);
    FDELAY_WR_SYNCED bit. */
 int fdelay_get_timing_status(fdelay_device_t *dev, int wait_mask);
 
+/* Selects the card's time reference (FDELAY_SYNC_LOCAL or FDELAY_SYNC_WR). Disables the trigger input. */
+int fdelay_configure_sync(fdelay_device_t *dev, int mode);
+
+/* Returns 1 if the card is locked to its time reference (always the case with FDELAY_SYNC_LOCAL), 0 if not (yet). */
+int fdelay_check_sync(fdelay_device_t *dev);
+
+/* Returns 1 if the sync status has changed (lock lost or found) since the last fdelay_check_sync() that found the card locked. */
+int fdelay_dbg_sync_lost(fdelay_device_t *dev);
+
+/* Restarts the White Rabbit synchronization after the lock was lost, without reinitializing the card:
+   the timestamp buffer and the trigger input stay enabled, the timestamps being taken on the local
+   oscillator until the card has locked again. Doesn't wait for the lock: poll fdelay_check_sync(). */
+int fdelay_wr_resync(fdelay_device_t *dev);
+
 /* Configures the trigger input (TDC/Delay modes). enable enables the input,
    termination switches on/off the built-in 50 Ohm termination resistor */
    
@@ -113,6 +254,9 @@ int fdelay_configure_trigger(fdelay_device_t *dev, int enable, int termination);
 
 int fdelay_configure_capture (fdelay_device_t *dev, int enable, int channel_mask);
 
+/* Enables (enable != 0) or disables and purges the timestamp buffer */
+int fdelay_configure_readout(fdelay_device_t *dev, int enable);
+
 /* Reads how_many timestamps from the buffer. Blocking */
 /* TODO: non-blocking version? */
 int fdelay_read (fdelay_device_t *dev, fdelay_time_t *timestamps, int how_many);
@@ -127,14 +271,51 @@ int fdelay_configure_delay (fdelay_device_t *dev, int channel_mask, int enable,
 int fdelay_configure_pulse_gen(fdelay_device_t *dev, int channel_mask, int enable, fdelay_time_t start, int64_t width_ps, int64_t delta_ps, int repeat_count);
 
 
-/* (pulse mode only) Returns non-0 when all of the channels in channel mask have produced their programmed pulses */
+/* (pulse mode only) Stages a pulse generator configuration for the output(s) selected in (channel_mask)
+   (bit 0 = output 1). Nothing is written to the card until fdelay_commit_pulse_gen(). */
+int fdelay_stage_pulse_gen(fdelay_device_t *dev, int channel_mask, int enable, fdelay_time_t start, int64_t width_ps, int64_t delta_ps, int repeat_count);
+
+/* (pulse mode only) Loads the configurations staged for the outputs in (channel_mask), writing only
+   the registers that changed, then arms all of them back to back. Returns the mask of the outputs armed. */
+int fdelay_commit_pulse_gen(fdelay_device_t *dev, int channel_mask);
+
+/* (pulse mode only) Returns non-0 when all of the channels in channel mask (bit 0 = output 1) have produced
+   their programmed pulses. If (blocking) is non-zero, waits until they have. */
 int fdelay_outputs_triggered(fdelay_device_t *dev, int channel_mask, int blocking);
 
+/* One entry of a fdelay_wait_outputs() call */
+typedef struct {
+  fdelay_device_t *dev;
+  int channel_mask;		/* outputs to wait for (bit 0 = output 1) */
+  int triggered_mask;		/* outputs which have produced their pulses, set by the library */
+  uint64_t due_ns[4];		/* library internal: host time at which each output is due */
+} fdelay_wait_t;
+
+/* fdelay_wait_outputs() modes */
+#define FDELAY_WAIT_ALL		0	/* return when all the outputs of all the entries have triggered */
+#define FDELAY_WAIT_ANY		1	/* return as soon as any of the outputs has triggered */
+
+/* (pulse mode only) Waits for the outputs of (n) devices listed in (w). The wait sleeps until just before
+   the programmed start times and only then polls the outputs. Returns 1 when the wait condition is met,
+   0 after (timeout_us) microseconds (negative = no timeout). */
+int fdelay_wait_outputs(fdelay_wait_t *w, int n, int mode, int64_t timeout_us);
+
+/* (pulse mode only) Returns non-0 when (channel) has produced its programmed pulse(s) */
+int fdelay_channel_triggered(fdelay_device_t *dev, int channel);
+
 void fdelay_set_user_offset(fdelay_device_t *dev,int input, int64_t offset);
 
 int fdelay_get_time(fdelay_device_t *dev, fdelay_time_t *t);
 int fdelay_set_time(fdelay_device_t *dev, const fdelay_time_t t);
 
+/* Finds the ACAM PLL dividers (hsdiv/refdiv) giving the TDC bin size closest to (bin) picoseconds
+   for a reference clock of (clock_freq) Hz. Returns the achievable bin size, or -1 if (bin) or
+   (clock_freq) isn't positive. */
+double fdelay_acam_calc_pll(double bin, double clock_freq, int *hsdiv, int *refdiv);
+
+/* Sets the ACAM bin size (in ps) used from the next TDC reconfiguration on. */
+int fdelay_set_acam_bin(fdelay_device_t *dev, double bin_ps);
+
 int fdelay_dmtd_calibration(fdelay_device_t *dev, double *offsets);
 float fdelay_get_board_temperature(fdelay_device_t *dev);
 
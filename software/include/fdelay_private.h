@@ -15,6 +15,8 @@
 
 #include <stdint.h>
 
+#include "fdelay_lib.h"
+
 /* SPI Bus chip selects */
 
 #define CS_DAC 0   /* AD9516 PLL */
@@ -33,6 +35,13 @@
 #define ACAM_IMODE 1
 #define ACAM_GMODE 2
 
+/* ACAM PLL reference clock frequency (Hz) and the default TDC bin size (ps) */
+#define ACAM_REF_CLOCK 31.25e6
+#define ACAM_DEFAULT_BIN 80.9553
+
+/* Number of addressable ACAM registers */
+#define ACAM_NUM_REGS 16
+
 /* MCP23S17 register addresses (only ones which are used by the lib) */
 #define MCP_IODIR 0x0
 #define MCP_IPOL 0x1
@@ -72,18 +81,149 @@ struct fine_delay_calibration {
 	int64_t frr_poly[3];        /* SY89295 delay/temperature polynomial coefficients */
 } __attribute__((packed));
 
+/* Bus access statistics: number of call sites tracked and number of latency histogram buckets.
+   Bucket n counts the accesses which took [2^n, 2^(n+1)) nanoseconds. */
+#define FD_STATS_MAX_SITES 64
+#define FD_STATS_HIST_BUCKETS 32
+
+struct fd_bus_site_stats
+{
+	const char *site;			/* name of the function issuing the accesses */
+	uint64_t reads, writes;
+	uint64_t total_ns, max_ns;
+	uint64_t hist[FD_STATS_HIST_BUCKETS];
+};
+
+struct fd_bus_stats
+{
+	int n_sites;
+	uint64_t dropped;			/* accesses from call sites that didn't fit in the table */
+	struct fd_bus_site_stats sites[FD_STATS_MAX_SITES];
+};
+
+uint64_t fd_bus_stats_now();
+void fd_bus_stats_record(struct fd_bus_stats *st, const char *site, int is_write, uint64_t ns);
+
+/* Bus access trace (fdelay_trace.c). The ring records the time stamps in CPU tics, which are
+   converted to nanoseconds when the trace is saved. */
+#define FD_TRACE_DEFAULT_ENTRIES 65536
+
+struct fd_bus_trace
+{
+	uint64_t head;				/* number of accesses recorded so far */
+	uint32_t mask;				/* ring size - 1 */
+	uint64_t t0_tics, t0_ns;		/* tic counter and monotonic time when the trace was enabled */
+	struct fdelay_trace_record e[];
+};
+
+static inline uint64_t fd_trace_tics()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return fd_bus_stats_now();
+#endif
+}
+
+static inline void fd_bus_trace_record(struct fd_bus_trace *tr, uint32_t offset, uint32_t data)
+{
+	struct fdelay_trace_record *r = &tr->e[tr->head++ & tr->mask];
+
+	r->ns = fd_trace_tics();
+	r->addr = offset;
+	r->data = data;
+}
+
+/* Varints (LEB128) and zigzag encoding of signed values, for the delta-encoded timestamp log blocks
+   (fdelay_tslog.c, fdelay_tslog_reader.c) */
+static inline uint8_t *fd_put_varint(uint8_t *p, uint64_t v)
+{
+	while(v >= 0x80)
+	{
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static inline const uint8_t *fd_get_varint(const uint8_t *p, uint64_t *v)
+{
+	uint64_t r = 0;
+	int shift = 0;
+
+	while(*p & 0x80)
+	{
+		r |= (uint64_t) (*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	*v = r | ((uint64_t) *p++ << shift);
+	return p;
+}
+
+static inline uint64_t fd_zigzag(int64_t v)
+{
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t fd_unzigzag(uint64_t v)
+{
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+/* Number of registers of an output channel (FD_REG_DCR..FD_REG_RCR) */
+#define FD_CHAN_NUM_REGS 14
+
+/* Last values written to the registers of an output channel, so that reprogramming
+   the channel only writes the registers which differ */
+struct fd_chan_shadow
+{
+	uint32_t regs[FD_CHAN_NUM_REGS];
+	uint32_t valid;				/* bit mask of regs[] entries which reflect the channel registers */
+};
+
+/* Pulse generator configuration of an output, staged by fdelay_stage_pulse_gen() */
+struct fd_pg_config
+{
+	int enable;
+	fdelay_time_t start;
+	int64_t width_ps, delta_ps;
+	int rep_count;
+};
+
 /* Internal state of the fine delay card */
 struct fine_delay_hw
 {
 	uint32_t base_addr; 		/* Base address of the core */
 	uint32_t base_onewire; 		/* Base address of the core */
 	uint32_t base_i2c;			/* SPI Controller offset */
+	uint32_t i2c_shadow;		/* Last value written to I2CR (output lines only) */
+	int i2c_delay_us;			/* I2C half-period delay, derived from the SCL frequency */
 	uint32_t acam_addr;         /* Current state of ACAM's address lines */
+	int acam_addr_out;          /* Non-zero if the MCP23S17 pins driving ACAM's address lines are already outputs */
+	uint8_t sgpio_olat[2];      /* Cached MCP23S17 output latches (banks A and B) */
+	int sgpio_olat_valid;       /* Bit mask of sgpio_olat[] entries which reflect the chip contents */
+	uint32_t acam_regs[ACAM_NUM_REGS]; /* Last value written to each ACAM register */
+	uint32_t acam_regs_valid;   /* Bit mask of acam_regs[] entries which reflect the TDC contents */
+	int64_t acam_lock_time;     /* Total time spent waiting for the ACAM PLL to lock, in microseconds */
+	int acam_restarts_skipped;  /* Number of mode switches which didn't have to restart the ACAM PLL */
 	double acam_bin; 			/* bin size of the ACAM TDC - calculated for 31.25 MHz reference */
+	double acam_bin_req;		/* requested ACAM bin size (actual one is the closest achievable) */
     uint32_t frr_offset[4];     /* Offset between the FRR measured at a known temperature at startup and poly-fitted FRR */
 	uint32_t frr_cur[4];		/* Fine range register for each output, current value (after online temp. compensation) */
 	int32_t cal_temp;           /* SY89295 calibration temperature in 1/16 degC units */
 	int32_t board_temp;			/* Current temperature of the board, unit = 1/16 degC */
+	int init_stage;				/* Last completed initialization stage (FDELAY_INIT_xxx) */
+	uint64_t bus_reads, bus_writes;	/* Number of bus accesses done so far */
+	struct fdelay_init_profile profile; /* Time/bus accesses spent in each of the init phases */
+	struct fd_bus_stats *bus_stats;	/* Per call-site bus statistics, NULL when disabled */
+	struct fd_bus_trace *bus_trace;	/* Ring of the last bus accesses, NULL when disabled */
+	struct fd_chan_shadow chan_shadow[4]; /* Register shadows of the output channels */
+	struct fd_pg_config pg_staged[4];	/* Staged pulse generator configurations */
+	int pg_staged_mask;			/* Outputs with a staged configuration (bit 0 = output 1) */
+	fdelay_time_t pg_start[4];		/* Start time (card time) the pulse generators were last armed with */
+	int pg_start_valid;			/* Outputs whose pg_start[] is known */
+	uint64_t wait_oversleep_ns;	/* Average oversleep of usleep() in fdelay_wait_outputs(), 0 = no estimate yet */
 	int wr_enabled;
 	int wr_state;
 	int raw_mode;
@@ -92,9 +232,76 @@ struct fine_delay_hw
 	int64_t input_user_offset, output_user_offset;
 };
 
+/* Logging (fdelay_log.c). Messages above FDELAY_LOG_MAX_LEVEL are compiled out, the ones above the
+   runtime levels cost a single comparison - the arguments aren't even evaluated. */
+#ifndef FDELAY_LOG_MAX_LEVEL
+#define FDELAY_LOG_MAX_LEVEL FDELAY_LOG_DEBUG
+#endif
+
+extern int fd_log_level;
+void fd_log_init();
+void fd_log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define fd_log(level, ...) do { \
+		if((level) <= FDELAY_LOG_MAX_LEVEL && (level) <= fd_log_level) \
+			fd_log_write((level), __VA_ARGS__); \
+	} while(0)
+
+#define fd_err(...) fd_log(FDELAY_LOG_ERR, __VA_ARGS__)
+#define fd_warn(...) fd_log(FDELAY_LOG_WARN, __VA_ARGS__)
+#define fd_info(...) fd_log(FDELAY_LOG_INFO, __VA_ARGS__)
+#define dbg(...) fd_log(FDELAY_LOG_DEBUG, __VA_ARGS__)
+
+/* Utility functions (fdelay_lib.c) */
+int64_t get_tics();
+void udelay(uint32_t usecs);
+
+/* MCP23S17 GPIO expander access (fdelay_lib.c) */
+void sgpio_set_pin(fdelay_device_t *dev, int pin, int val);
+
+/* Timestamp post-processing (fdelay_lib.c) */
+fdelay_time_t ts_normalize(fdelay_time_t denorm);
+void ts_postprocess(fdelay_device_t *dev, fdelay_time_t *t);
+
+/* Bus access wrappers. All register accesses of the library go through these, so they can be counted.
+   When bus statistics are enabled, each access is also timed and accounted to its call site
+   (the name of the calling function). When the bus trace is enabled, it's recorded there. */
+static inline void fd_bus_writel(fdelay_device_t *dev, struct fine_delay_hw *hw, uint32_t data, uint32_t addr, const char *site)
+{
+	hw->bus_writes++;
+	if(hw->bus_trace)
+		fd_bus_trace_record(hw->bus_trace, (addr - hw->base_addr) | FDELAY_TRACE_WRITE, data);
+	if(hw->bus_stats)
+	{
+		uint64_t t = fd_bus_stats_now();
+		dev->writel(dev->priv_io, data, addr);
+		fd_bus_stats_record(hw->bus_stats, site, 1, fd_bus_stats_now() - t);
+	} else
+		dev->writel(dev->priv_io, data, addr);
+}
+
+static inline uint32_t fd_bus_readl(fdelay_device_t *dev, struct fine_delay_hw *hw, uint32_t addr, const char *site)
+{
+	uint32_t rval;
+
+	hw->bus_reads++;
+	if(hw->bus_stats)
+	{
+		uint64_t t = fd_bus_stats_now();
+		rval = dev->readl(dev->priv_io, addr);
+		fd_bus_stats_record(hw->bus_stats, site, 0, fd_bus_stats_now() - t);
+	} else
+		rval = dev->readl(dev->priv_io, addr);
+
+	if(hw->bus_trace)
+		fd_bus_trace_record(hw->bus_trace, addr - hw->base_addr, rval);
+
+	return rval;
+}
+
 /* some useful access/declaration macros */
-#define fd_writel(data, addr) dev->writel(dev->priv_io, data, (hw->base_addr + (addr)))
-#define fd_readl(addr) dev->readl(dev->priv_io, (hw->base_addr + (addr)))
+#define fd_writel(data, addr) fd_bus_writel(dev, hw, data, (hw->base_addr + (addr)), __func__)
+#define fd_readl(addr) fd_bus_readl(dev, hw, (hw->base_addr + (addr)), __func__)
 #define fd_decl_private(dev) struct fine_delay_hw *hw = (struct fine_delay_hw *) dev->priv_fd;
 
 
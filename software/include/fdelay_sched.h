@@ -0,0 +1,64 @@
+/*
+	FmcDelay1ns4Cha (a.k.a. The Fine Delay Card)
+	User-space driver/library
+
+	Pulse train scheduler: plays back time-sorted lists of pulses on the outputs,
+	re-arming each channel's pulse generator as soon as its previous pulse is out.
+
+	(c) Copyright CERN 2012
+	Licensed under LGPL 2.1
+*/
+
+#ifndef __FDELAY_SCHED_H
+#define __FDELAY_SCHED_H
+
+#include "fdelay_lib.h"
+
+/* Default minimum time between arming a pulse and its start (setup_ps = 0 in fdelay_sched_create()) */
+#define FDELAY_SCHED_DEFAULT_SETUP_PS	100000000LL	/* 100 us */
+
+typedef struct {
+  fdelay_time_t start;		/* card time of the rising edge */
+  int64_t width_ps;		/* pulse width */
+} fdelay_pulse_t;
+
+struct fdelay_sched_stats {
+  uint64_t queued;		/* pulses accepted by fdelay_sched_push() */
+  uint64_t armed;		/* pulses programmed into the channel */
+  uint64_t done;		/* pulses confirmed as generated (PG_TRIG seen) */
+  uint64_t missed;		/* pulses too close to their start time to be armed, or which never triggered */
+  int64_t min_lead_ps;		/* smallest time left between arming a pulse and its start */
+  uint64_t service_ns;		/* average host time spent per pulse: completion check + reprogramming */
+  uint64_t detect_ns;		/* average time from the start of a pulse to the scheduler seeing it generated */
+  double max_rate_hz;		/* pulse rate the channel could sustain: one pulse per arm-to-trigger cycle
+				   (setup time + detection + service), as the channel holds one armed pulse */
+  double rate_hz;		/* pulse rate achieved between the first and the last generated pulse */
+};
+
+struct fdelay_sched;
+
+/* Creates a scheduler for (dev) with a queue of (queue_size) pulses per channel. Pulses closer
+   than (setup_ps) to their start time when their turn comes are counted as missed (0 = default).
+   Returns NULL on error. */
+struct fdelay_sched *fdelay_sched_create(fdelay_device_t *dev, int queue_size, int64_t setup_ps);
+
+/* Releases the scheduler. Pulses already armed are still generated. */
+void fdelay_sched_destroy(struct fdelay_sched *s);
+
+/* Queues (n) pulses for (channel). The pulses must be sorted by their start time and follow the
+   ones already queued. Returns the number of pulses queued (less than n if the queue is full),
+   negative on error. */
+int fdelay_sched_push(struct fdelay_sched *s, int channel, const fdelay_pulse_t *p, int n);
+
+/* Does a single scheduler pass: collects the pulses already generated and arms the next pulse
+   of each idle channel. Returns the number of pulses queued or armed, still waiting to be generated. */
+int fdelay_sched_poll(struct fdelay_sched *s);
+
+/* Runs the scheduler until all queued pulses have been generated (or missed).
+   Returns the number of missed pulses. */
+int fdelay_sched_run(struct fdelay_sched *s);
+
+/* Copies the statistics of (channel) to (st). */
+int fdelay_sched_get_stats(struct fdelay_sched *s, int channel, struct fdelay_sched_stats *st);
+
+#endif
@@ -0,0 +1,49 @@
+/*
+	FmcDelay1ns4Cha (a.k.a. The Fine Delay Card)
+	User-space driver/library
+
+	Register-level simulator of the Fine Delay card, for running the library
+	without the hardware.
+
+	(c) Copyright CERN 2012
+	Licensed under LGPL 2.1
+*/
+
+#ifndef __FDELAY_SIM_H
+#define __FDELAY_SIM_H
+
+#include "fdelay_lib.h"
+
+/* Bus latency presets (per access, in nanoseconds). Reads are non-posted, so they
+   always cost a full round trip. */
+#define FDELAY_SIM_PCIE_READ_NS		1000
+#define FDELAY_SIM_PCIE_WRITE_NS	100
+#define FDELAY_SIM_VME_READ_NS		1500
+#define FDELAY_SIM_VME_WRITE_NS		1000
+#define FDELAY_SIM_EB_READ_NS		60000
+#define FDELAY_SIM_EB_WRITE_NS		60000
+
+/* Attaches a simulated card to (dev), setting up its readl/writel callbacks. (params) selects
+   the bus latency: "" (none), "pcie", "vme", "etherbone" or "<read_ns>,<write_ns>".
+   Returns 0 on success, negative on error. */
+int fdelay_sim_attach(fdelay_device_t *dev, const char *params);
+
+/* Releases the simulator attached to (dev). */
+void fdelay_sim_detach(fdelay_device_t *dev);
+
+/* Sets the busy-wait time added to each simulated register read/write. */
+void fdelay_sim_set_latency(fdelay_device_t *dev, int read_ns, int write_ns);
+
+/* Sets the board temperature reported by the DS18x sensor after its next conversion. */
+void fdelay_sim_set_temperature(fdelay_device_t *dev, double deg_c);
+
+/* Simulates a pulse on the trigger input at card time (t). If the input and the timestamp
+   buffer are enabled, the pulse is tagged and stored in the buffer. Returns 0 if the
+   timestamp was stored, negative if it was dropped (input disabled or buffer full). */
+int fdelay_sim_trigger(fdelay_device_t *dev, fdelay_time_t t);
+
+/* Simulates the White Rabbit link state: (present) = WR core present, (locked) = the
+   WR core is synchronized, so the FD core locks to it when WR sync is enabled. */
+void fdelay_sim_set_wr(fdelay_device_t *dev, int present, int locked);
+
+#endif
@@ -0,0 +1,196 @@
+/*
+	FmcDelay1ns4Cha (a.k.a. The Fine Delay Card)
+	User-space driver/library
+
+	Timestamp log: writer (a dedicated thread appending batches of timestamps,
+	so that logging doesn't cost a system call per event on the thread draining
+	the card) and reader (mmap-based, with a binary search by time).
+
+	(c) Copyright CERN 2012
+	Licensed under LGPL 2.1
+*/
+
+#ifndef __FDELAY_TSLOG_H
+#define __FDELAY_TSLOG_H
+
+#include "fdelay_lib.h"
+
+/* Record types. Each logging session is framed by a START and an END record. */
+#define FDELAY_TSLOG_START	1
+#define FDELAY_TSLOG_END	2
+#define FDELAY_TSLOG_TIMESTAMP	3
+#define FDELAY_TSLOG_UNSYNCED	4	/* timestamp taken while the card had lost the WR sync (local oscillator time) */
+
+#define FDELAY_TSLOG_IS_TIMESTAMP(type) ((type) == FDELAY_TSLOG_TIMESTAMP || (type) == FDELAY_TSLOG_UNSYNCED)
+
+/* File layout (host byte order):
+   - a header of FDELAY_TSLOG_HEADER_SIZE bytes: struct fdelay_tslog_header, with the table of the cards,
+   - blocks: struct fdelay_tslog_block followed by the block's records, either as an array of
+     struct fdelay_tslog_record (FDELAY_TSLOG_ENC_RAW) or delta-encoded (FDELAY_TSLOG_ENC_DELTA),
+   - the block index (one struct fdelay_tslog_index per block), written when the log is closed.
+   A file that wasn't closed has index_offset = 0: the reader rebuilds the index by walking the blocks. */
+#define FDELAY_TSLOG_MAGIC		"FDTSLOG2"
+#define FDELAY_TSLOG_HEADER_SIZE	8192
+#define FDELAY_TSLOG_MAX_CARDS		64
+#define FDELAY_TSLOG_BLOCK_MAGIC	0x4b424446	/* "FDBK" */
+
+struct fdelay_tslog_card {
+  int32_t card_id;		/* hash of the location, so a card keeps its ID across files */
+  char location[60];
+};
+
+struct fdelay_tslog_header {
+  char magic[8];		/* FDELAY_TSLOG_MAGIC */
+  uint32_t header_size;		/* offset of the first block */
+  uint32_t n_cards;
+  uint64_t index_offset;	/* offset of the block index, 0 if the file wasn't closed */
+  uint64_t n_blocks;
+  uint64_t n_records;
+  uint64_t reserved[4];
+  struct fdelay_tslog_card cards[FDELAY_TSLOG_MAX_CARDS];
+};
+
+/* Block encodings. ENC_DELTA: the records are coded in groups of FDELAY_TSLOG_DELTA_GROUP, so that
+   the reader doesn't have to decode the whole block to find one; the block ends with the offsets
+   (uint32_t, from the start of the block) of the groups. One entry per record, starting with a tag byte:
+   - FDELAY_TSLOG_TAG_RAW: the record follows as a struct fdelay_tslog_record. Always the case for the
+     group's first record (the base of the deltas) and for the START/END markers.
+   - otherwise: card (1 byte), type (1 byte) and channel (varint) if FDELAY_TSLOG_TAG_META is set (else
+     they're the previous record's), then the change of the time difference to the previous record
+     (in 1/4096 cycle units) and seq_id - previous seq_id - 1, as zigzag-encoded varints (LEB128). */
+#define FDELAY_TSLOG_ENC_RAW		0
+#define FDELAY_TSLOG_ENC_DELTA		1
+
+#define FDELAY_TSLOG_DELTA_GROUP	256
+
+#define FDELAY_TSLOG_TAG_RAW		0x1
+#define FDELAY_TSLOG_TAG_META		0x2
+
+/* Block flags */
+#define FDELAY_TSLOG_BLOCK_SORTED	0x1	/* only (synchronized) timestamps, in time order */
+
+struct fdelay_tslog_block {
+  uint32_t magic;		/* FDELAY_TSLOG_BLOCK_MAGIC */
+  uint32_t size;		/* size of the block in bytes, including this header */
+  uint32_t n_records;
+  uint32_t encoding;		/* FDELAY_TSLOG_ENC_xxx */
+  uint32_t flags;		/* FDELAY_TSLOG_BLOCK_xxx */
+  uint32_t reserved;
+  uint64_t first_record;	/* index of the block's first record in the file */
+  int64_t max_utc;		/* highest utc of all the records up to the end of this block, unsynchronized timestamps excluded */
+};
+
+struct fdelay_tslog_index {
+  uint64_t offset;		/* file offset of the block */
+  uint64_t first_record;
+  int64_t max_utc;
+  uint32_t n_records;
+  uint32_t size;
+};
+
+struct fdelay_tslog_record {
+  int64_t utc;
+  uint32_t coarse;
+  uint32_t frac;
+  uint16_t seq_id;
+  uint8_t card;			/* index in the header's card table */
+  uint8_t type;			/* FDELAY_TSLOG_xxx */
+  uint32_t channel;
+};
+
+/* Record of the original gs_logger log format (packed, 29 bytes), read by the converter */
+struct fdelay_tslog_v1_record {
+  int32_t card_id;
+  uint8_t type;
+  uint64_t utc;
+  uint32_t coarse;
+  uint32_t frac;
+  uint32_t seq_id;
+  uint32_t channel;
+} __attribute__((packed));
+
+/* Durability policy: the buffered records are written out when (flush_events) of them have
+   accumulated or the oldest one is (flush_ms) old, whichever comes first. The file is synced to
+   the disk at most every (fsync_ms) (0 = after every write, negative = never). Each write is split
+   in blocks of at most (block_records) records, stored with (encoding).
+
+   With (segment_bytes) or (segment_s) set, the log is split in segments: the file name passed to
+   fdelay_tslog_open() is a prefix and the records go to <prefix>.NNNNNN.tmp. When the segment has
+   reached (segment_bytes) bytes or is (segment_s) seconds old, it is completed (closed with its index
+   and renamed to <prefix>.NNNNNN) and a line "<segment> <first utc> <last utc> <timestamps>" (of the
+   synchronized timestamps) is added
+   to <prefix>.manifest, which is replaced atomically. Each segment is a complete log file, with the
+   card table; the records are numbered from 0 in each one, and the START/END markers of a logging
+   session are in its first/last segment. Only the segments listed in the manifest are complete. */
+struct fdelay_tslog_policy {
+  int buffer_events;		/* capacity of each of the two batch buffers */
+  int flush_events;
+  int flush_ms;
+  int fsync_ms;
+  int block_records;
+  int encoding;			/* FDELAY_TSLOG_ENC_xxx */
+  int64_t segment_bytes;	/* 0 = no limit */
+  int segment_s;		/* 0 = no limit */
+};
+
+#define FDELAY_TSLOG_DEFAULT_POLICY { 65536, 4096, 100, 1000, 4096, FDELAY_TSLOG_ENC_DELTA, 0, 0 }
+
+struct fdelay_tslog_stats {
+  uint64_t events;		/* timestamps logged (synchronized or not) */
+  uint64_t records;		/* records written to the file */
+  uint64_t bytes;		/* bytes written to the file */
+  uint64_t writes;		/* batches written */
+  uint64_t fsyncs;
+  uint64_t stalls;		/* times fdelay_tslog_write() had to wait for the writer (buffer full) */
+  int max_batch;		/* largest batch written, in records */
+  uint64_t encode_ns;		/* time the writer thread spent packing the records in blocks */
+  uint64_t segments;		/* segments completed */
+};
+
+struct fdelay_tslog;
+
+/* Opens the log file (filename), creating it or appending to an existing one, starts the writer thread
+   and logs a START record. (policy) = NULL selects FDELAY_TSLOG_DEFAULT_POLICY. A segmented log (see
+   fdelay_tslog_policy) continues with a new segment. Returns NULL on error. */
+struct fdelay_tslog *fdelay_tslog_open(const char *filename, const struct fdelay_tslog_policy *policy);
+
+/* Adds the card at (location) to the card table (or finds it there). Returns its index
+   for fdelay_tslog_write(), negative if the table is full. */
+int fdelay_tslog_add_card(struct fdelay_tslog *l, const char *location);
+
+/* Queues timestamp (t) taken by card (card, as returned by fdelay_tslog_add_card()). Blocks only if
+   both batch buffers are full. Returns negative if writing the log has failed. */
+int fdelay_tslog_write(struct fdelay_tslog *l, int card, const fdelay_time_t *t);
+
+/* Queues a complete record. */
+int fdelay_tslog_write_record(struct fdelay_tslog *l, const struct fdelay_tslog_record *r);
+
+/* Logs an END record, writes out and syncs everything buffered, writes the block index and closes the file. */
+int fdelay_tslog_close(struct fdelay_tslog *l);
+
+/* Copies the writer statistics to (st). */
+void fdelay_tslog_get_stats(struct fdelay_tslog *l, struct fdelay_tslog_stats *st);
+
+struct fdelay_tslog_reader;
+
+/* Maps the log file (filename) for reading. Returns NULL on error. */
+struct fdelay_tslog_reader *fdelay_tslog_map(const char *filename);
+
+/* Unmaps the log file. */
+void fdelay_tslog_unmap(struct fdelay_tslog_reader *r);
+
+/* Returns the file header (card table). */
+const struct fdelay_tslog_header *fdelay_tslog_get_header(struct fdelay_tslog_reader *r);
+
+/* Returns the number of records in the file. */
+uint64_t fdelay_tslog_count(struct fdelay_tslog_reader *r);
+
+/* Returns the index of the first record with utc >= (utc): all the records before it are older than (utc).
+   If the cards weren't logged in time order, some records after it may be older too. FDELAY_TSLOG_UNSYNCED
+   records (on a card's local oscillator) aren't taken into account. */
+uint64_t fdelay_tslog_seek(struct fdelay_tslog_reader *r, int64_t utc);
+
+/* Copies up to (n) records starting from record (index) to (rec). Returns the number of records copied. */
+int fdelay_tslog_read(struct fdelay_tslog_reader *r, uint64_t index, struct fdelay_tslog_record *rec, int n);
+
+#endif
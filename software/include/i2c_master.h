@@ -2,10 +2,15 @@
 #define __I2C_MASTER_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include "fdelay_lib.h"
 
+/* Default SCL frequency, in kHz */
+#define MI2C_DEFAULT_SPEED_KHZ 100
+
 void mi2c_init(fdelay_device_t *dev);
+void mi2c_set_speed(fdelay_device_t *dev, int speed_khz);
 int eeprom_read(fdelay_device_t *dev, uint8_t i2c_addr, uint32_t offset, uint8_t *buf, size_t size);
 int eeprom_write(fdelay_device_t *dev, uint8_t i2c_addr, uint32_t offset, uint8_t *buf, size_t size);
 
@@ -1,10 +1,14 @@
-#ifndef ONEWIRE_H_INCLUDED
-#define ONEWIRE_H_INCLUDED
+#ifndef ONEWIRE_H_INCLUDED
+#define ONEWIRE_H_INCLUDED
 
 #include "fdelay_lib.h"
-
+
+int ow_write_block(fdelay_device_t *dev, int port, const uint8_t *block, int len);
+int ow_read_block(fdelay_device_t *dev, int port, uint8_t *block, int len);
+
 int ds18x_init(fdelay_device_t *dev);
+int ds18x_attach(fdelay_device_t *dev);
 int ds18x_read_temp(fdelay_device_t *dev, int *temp_r);
-
-
-#endif // ONEWIRE_H_INCLUDED
+
+
+#endif // ONEWIRE_H_INCLUDED
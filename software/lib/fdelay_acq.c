@@ -0,0 +1,433 @@
+/*
+	FmcDelay1ns4Cha (a.k.a. The Fine Delay Card)
+	User-space driver/library
+
+	Multi-card acquisition: lock-free single-producer, single-consumer
+	timestamp queues. Each side keeps its index and its counters in its own
+	cache line and reads the other side's index only when its cached copy
+	says the queue is full (producer) or empty (consumer), or when the merge
+	looks for the newest queued event. The merge of the queues keeps the
+	cards with an event pending in a heap, ordered by the time of that
+	event. Unsynchronized events aren't ordered: they're passed through as
+	they come.
+
+	(c) Copyright CERN 2012
+	Licensed under LGPL 2.1
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fdelay_lib.h"
+#include "fdelay_private.h"
+#include "fdelay_acq.h"
+
+struct fdelay_acq_queue {
+	/* Producer side */
+	uint64_t head __attribute__((aligned(64)));	/* entries pushed */
+	uint64_t tail_cache;
+	uint64_t full;
+	int was_full;					/* the last check found the queue full */
+
+	/* Consumer side */
+	uint64_t tail __attribute__((aligned(64)));	/* entries popped */
+	uint64_t head_cache;
+	uint64_t max_backlog;
+	uint64_t latency_sum_ns, latency_max_ns;
+
+	uint64_t size __attribute__((aligned(64)));
+	struct fdelay_acq_entry *ring;
+};
+
+struct fdelay_acq_queue *fdelay_acq_queue_create(int size)
+{
+	struct fdelay_acq_queue *q;
+	uint64_t n = 1;
+
+	while(n < size)
+		n <<= 1;
+
+	if(posix_memalign((void **) &q, 64, sizeof(struct fdelay_acq_queue)))
+		return NULL;
+
+	memset(q, 0, sizeof(struct fdelay_acq_queue));
+	q->size = n;
+	q->ring = malloc(n * sizeof(struct fdelay_acq_entry));
+	if(!q->ring)
+	{
+		free(q);
+		return NULL;
+	}
+
+	return q;
+}
+
+void fdelay_acq_queue_free(struct fdelay_acq_queue *q)
+{
+	if(!q)
+		return;
+
+	free(q->ring);
+	free(q);
+}
+
+int fdelay_acq_space(struct fdelay_acq_queue *q)
+{
+	uint64_t used = q->head - q->tail_cache;
+
+	if(used == q->size)
+	{
+		q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		used = q->head - q->tail_cache;
+	}
+
+	/* count the times the queue fills up, not the polls of a full queue */
+	if(used == q->size && !q->was_full)
+		__atomic_store_n(&q->full, q->full + 1, __ATOMIC_RELAXED);
+	q->was_full = (used == q->size);
+
+	return q->size - used;
+}
+
+int fdelay_acq_push(struct fdelay_acq_queue *q, const fdelay_time_t *t, int flags)
+{
+	struct fdelay_acq_entry *e;
+
+	if(!fdelay_acq_space(q))
+		return -1;
+
+	e = &q->ring[q->head & (q->size - 1)];
+	e->t = *t;
+	e->host_ns = fd_bus_stats_now();
+	e->flags = flags;
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int fdelay_acq_pop(struct fdelay_acq_queue *q, struct fdelay_acq_entry *e, int n)
+{
+	uint64_t avail = q->head_cache - q->tail, now, sum = 0, max = q->latency_max_ns;
+	int i;
+
+	if(avail < n)
+	{
+		q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		avail = q->head_cache - q->tail;
+		if(avail > q->max_backlog)
+			__atomic_store_n(&q->max_backlog, avail, __ATOMIC_RELAXED);
+	}
+
+	if(!avail)
+		return 0;
+
+	if(n > avail)
+		n = avail;
+
+	now = fd_bus_stats_now();
+	for(i = 0; i < n; i++)
+	{
+		uint64_t lat;
+
+		e[i] = q->ring[(q->tail + i) & (q->size - 1)];
+		lat = now > e[i].host_ns ? now - e[i].host_ns : 0;
+		sum += lat;
+		if(lat > max)
+			max = lat;
+	}
+
+	__atomic_store_n(&q->latency_sum_ns, q->latency_sum_ns + sum, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->latency_max_ns, max, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->tail, q->tail + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+void fdelay_acq_get_stats(struct fdelay_acq_queue *q, struct fdelay_acq_stats *st)
+{
+	uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);	/* after the tail, so that head >= tail */
+
+	st->events = tail;
+	st->full = __atomic_load_n(&q->full, __ATOMIC_RELAXED);
+	st->backlog = head - tail;
+	st->max_backlog = __atomic_load_n(&q->max_backlog, __ATOMIC_RELAXED);
+	st->latency_sum_ns = __atomic_load_n(&q->latency_sum_ns, __ATOMIC_RELAXED);
+	st->latency_max_ns = __atomic_load_n(&q->latency_max_ns, __ATOMIC_RELAXED);
+}
+
+/* Merge: a binary min-heap of the cards having an event pending, ordered by the time of that event */
+
+#define MERGE_BATCH 256
+
+struct merge_card {
+	struct fdelay_acq_queue *q;
+	struct fdelay_acq_entry buf[MERGE_BATCH];	/* events taken out of the queue */
+	int pos, n;
+	int in_heap;
+};
+
+struct fdelay_acq_merge {
+	struct fdelay_acq_merge_config cfg;
+	int n_cards;
+	struct merge_card *cards;
+	int *heap;
+	int heap_size;
+	fdelay_time_t newest;		/* newest timestamp seen from any card (the watermark) */
+	fdelay_time_t last;		/* newest timestamp emitted */
+	int have_newest, have_last;
+	struct fdelay_acq_merge_stats stats;
+};
+
+/* a - b in picoseconds, saturated at about +-10^6 seconds */
+static int64_t ts_diff_ps(const fdelay_time_t *a, const fdelay_time_t *b)
+{
+	int64_t dutc = a->utc - b->utc;
+
+	if(dutc > 1000000)
+		return INT64_MAX / 2;
+	if(dutc < -1000000)
+		return -INT64_MAX / 2;
+
+	return dutc * 1000000000000LL + (int64_t) (a->coarse - b->coarse) * 8000LL +
+		(((int64_t) (a->frac - b->frac) * 8000LL) >> 12);
+}
+
+static const fdelay_time_t *head(struct fdelay_acq_merge *m, int c)
+{
+	return &m->cards[c].buf[m->cards[c].pos].t;
+}
+
+/* Card (a) goes before card (b): ties are broken by the card index, so the order is deterministic */
+static int heap_less(struct fdelay_acq_merge *m, int a, int b)
+{
+	int r = fdelay_ts_cmp(*head(m, a), *head(m, b));
+
+	return r < 0 || (!r && a < b);
+}
+
+static void heap_push(struct fdelay_acq_merge *m, int c)
+{
+	int i = m->heap_size++;
+
+	m->cards[c].in_heap = 1;
+	while(i && heap_less(m, c, m->heap[(i - 1) / 2]))
+	{
+		m->heap[i] = m->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	m->heap[i] = c;
+}
+
+static void heap_pop(struct fdelay_acq_merge *m)
+{
+	int c = m->heap[--m->heap_size], i = 0;
+
+	m->cards[m->heap[0]].in_heap = 0;
+	for(;;)
+	{
+		int child = 2 * i + 1;
+
+		if(child >= m->heap_size)
+			break;
+		if(child + 1 < m->heap_size && heap_less(m, m->heap[child + 1], m->heap[child]))
+			child++;
+		if(!heap_less(m, m->heap[child], c))
+			break;
+		m->heap[i] = m->heap[child];
+		i = child;
+	}
+	m->heap[i] = c;
+}
+
+/* The time of an unsynchronized card can be anywhere: it doesn't move the watermark */
+static void see(struct fdelay_acq_merge *m, const struct fdelay_acq_entry *e)
+{
+	if(!(e->flags & FDELAY_ACQ_UNSYNCED) && (!m->have_newest || fdelay_ts_cmp(e->t, m->newest) > 0))
+	{
+		m->newest = e->t;
+		m->have_newest = 1;
+	}
+}
+
+/* Takes the next events of card (c) out of its queue. Returns non-zero if it has some. */
+static int refill(struct fdelay_acq_merge *m, int c)
+{
+	struct merge_card *mc = &m->cards[c];
+	int i;
+
+	mc->pos = 0;
+	mc->n = fdelay_acq_pop(mc->q, mc->buf, MERGE_BATCH);
+
+	for(i = 0; i < mc->n; i++)
+		see(m, &mc->buf[i]);
+
+	return mc->n;
+}
+
+/* The buffers are refilled only once drained, so while the merge holds back their events the
+   watermark would stop at the end of the buffers. Before holding, it catches up with the newest
+   event in the queues: the entries between the tail and the head stay put until the merge pops them. */
+static void see_queued(struct fdelay_acq_merge *m)
+{
+	int c;
+
+	for(c = 0; c < m->n_cards; c++)
+	{
+		struct fdelay_acq_queue *q = m->cards[c].q;
+		uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+		if(head != q->tail)
+			see(m, &q->ring[(head - 1) & (q->size - 1)]);
+	}
+}
+
+/* Can an event still to come from a card with nothing pending precede (e)? */
+static int must_hold(struct fdelay_acq_merge *m, const struct fdelay_acq_entry *e, int *peeked)
+{
+	if(m->heap_size == m->n_cards || ts_diff_ps(&m->newest, &e->t) >= m->cfg.lateness_ps)
+		return 0;
+
+	if(!*peeked)
+	{
+		*peeked = 1;
+		see_queued(m);
+		return ts_diff_ps(&m->newest, &e->t) < m->cfg.lateness_ps;
+	}
+
+	return 1;
+}
+
+struct fdelay_acq_merge *fdelay_acq_merge_create(struct fdelay_acq_queue **queues, int n, const struct fdelay_acq_merge_config *cfg)
+{
+	static const struct fdelay_acq_merge_config default_cfg = FDELAY_ACQ_MERGE_DEFAULT_CONFIG;
+	struct fdelay_acq_merge *m;
+	int i;
+
+	m = (struct fdelay_acq_merge *) calloc(1, sizeof(struct fdelay_acq_merge));
+	if(!m)
+		return NULL;
+
+	m->cfg = cfg ? *cfg : default_cfg;
+	m->n_cards = n;
+	m->cards = calloc(n, sizeof(struct merge_card));
+	m->heap = calloc(n, sizeof(int));
+	if(!m->cards || !m->heap)
+	{
+		fdelay_acq_merge_free(m);
+		return NULL;
+	}
+
+	for(i = 0; i < n; i++)
+		m->cards[i].q = queues[i];
+
+	return m;
+}
+
+void fdelay_acq_merge_free(struct fdelay_acq_merge *m)
+{
+	if(!m)
+		return;
+
+	free(m->cards);
+	free(m->heap);
+	free(m);
+}
+
+static void emit(struct fdelay_acq_merge *m, int c, const struct fdelay_acq_entry *e, int late,
+	uint64_t now, struct fdelay_acq_event *ev)
+{
+	uint64_t lat = now > e->host_ns ? now - e->host_ns : 0;
+
+	ev->t = e->t;
+	ev->card = c;
+	ev->flags = e->flags | (late ? FDELAY_ACQ_LATE : 0);
+
+	m->stats.events++;
+	m->stats.latency_sum_ns += lat;
+	if(lat > m->stats.latency_max_ns)
+		m->stats.latency_max_ns = lat;
+}
+
+/* Emits the unsynchronized events at the head of card (c), refilling it as needed. Returns non-zero
+   if the card is left with a (synchronized) event pending, to be ordered in the heap. */
+static int pass_unsynced(struct fdelay_acq_merge *m, int c, uint64_t now, struct fdelay_acq_event *ev, int n, int *done)
+{
+	struct merge_card *mc = &m->cards[c];
+
+	for(;;)
+	{
+		if(mc->pos == mc->n && !refill(m, c))
+			return 0;
+		if(!(mc->buf[mc->pos].flags & FDELAY_ACQ_UNSYNCED))
+			return 1;
+		if(*done == n)
+			return 0;
+
+		emit(m, c, &mc->buf[mc->pos++], 0, now, &ev[(*done)++]);
+	}
+}
+
+static int merge(struct fdelay_acq_merge *m, struct fdelay_acq_event *ev, int n, int force)
+{
+	uint64_t now = fd_bus_stats_now(), max_delay_ns = (uint64_t) m->cfg.max_delay_ms * 1000000ULL;
+	int c, done = 0, peeked = 0;
+
+	/* The cards out of the heap may have new events, or unsynchronized ones left over */
+	for(c = 0; c < m->n_cards; c++)
+		if(!m->cards[c].in_heap && pass_unsynced(m, c, now, ev, n, &done))
+			heap_push(m, c);
+
+	while(done < n && m->heap_size)
+	{
+		struct fdelay_acq_entry *e;
+		int late;
+
+		c = m->heap[0];
+		e = &m->cards[c].buf[m->cards[c].pos];
+
+		if(!force && must_hold(m, e, &peeked))
+		{
+			if(m->cfg.max_delay_ms < 0 || now - e->host_ns < max_delay_ns)
+				break;
+			m->stats.forced++;
+		}
+
+		heap_pop(m);
+
+		late = m->have_last && fdelay_ts_cmp(e->t, m->last) < 0;
+		if(late)
+			m->stats.late++;
+
+		if(late && m->cfg.drop_late)
+			m->stats.dropped++;
+		else
+			emit(m, c, e, late, now, &ev[done++]);
+
+		if(!late)
+		{
+			m->last = e->t;
+			m->have_last = 1;
+		}
+
+		m->cards[c].pos++;
+		if(pass_unsynced(m, c, now, ev, n, &done))
+			heap_push(m, c);
+	}
+
+	return done;
+}
+
+int fdelay_acq_merge_poll(struct fdelay_acq_merge *m, struct fdelay_acq_event *ev, int n)
+{
+	return merge(m, ev, n, 0);
+}
+
+int fdelay_acq_merge_flush(struct fdelay_acq_merge *m, struct fdelay_acq_event *ev, int n)
+{
+	return merge(m, ev, n, 1);
+}
+
+void fdelay_acq_merge_get_stats(struct fdelay_acq_merge *m, struct fdelay_acq_merge_stats *st)
+{
+	*st = m->stats;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 
 #include "fdelay_lib.h"
@@ -9,6 +10,8 @@
 #include "speclib/speclib.h"
 
 #include "fdelay_lib.h"
+#include "fdelay_private.h"
+#include "fdelay_sim.h"
 
 void printk() {};
 
@@ -48,7 +51,7 @@ static int probe_svec(fdelay_device_t *dev, const char *location)
 	void *card; 
 	uint32_t core_base;
 
-	if (!strncmp(location, "svec:"), 5) {
+	if (!strncmp(location, "svec:", 5)) {
 	    sscanf(location+5, "%d,%x,%x", &slot, &map_base, &core_base);
 	} else 
 	    return -1;
@@ -66,7 +69,7 @@ static int probe_svec(fdelay_device_t *dev, const char *location)
 	dev->readl = fd_svec_readl;
 	dev->base_addr = core_base;
 
-	dbg("svec: using slot %d, A32/D32 base: 0x%x, core base 0x%x\n", slot, map_base, core_base);
+	fd_info("svec: using slot %d, A32/D32 base: 0x%x, core base 0x%x\n", slot, map_base, core_base);
 	return 0;
 }
 
@@ -78,7 +81,7 @@ static int probe_spec(fdelay_device_t *dev, const char *location)
 	uint32_t core_base;
 	int slot;
 
-	if (!strncmp(location, "spec:"), 5) {
+	if (!strncmp(location, "spec:", 5)) {
 	    sscanf(location+5, "%d,%x", &slot, &core_base);
 	} else 
 	    return -1;
@@ -95,20 +98,39 @@ static int probe_spec(fdelay_device_t *dev, const char *location)
 	dev->readl = fd_spec_readl;
 	dev->base_addr = core_base;
 
-	dbg("spec: using slot %d, core base 0x%x\n", slot, core_base);
+	fd_info("spec: using slot %d, core base 0x%x\n", slot, core_base);
 
         return 0;
 }
 
+/* Simulated card: "sim:" or "sim:<latency>", see fdelay_sim_attach() */
+static int probe_sim(fdelay_device_t *dev, const char *location)
+{
+	if (strncmp(location, "sim:", 4))
+	    return -1;
+
+	dev->base_addr = 0;
+	if(fdelay_sim_attach(dev, location + 4) < 0)
+	    return -1;
+
+	fd_info("sim: using a simulated card (latency '%s')\n", location + 4);
+	return 0;
+}
+
 int fdelay_probe(fdelay_device_t *dev, const char *location)
 {
+    dev->priv_fd = NULL;	/* not initialized yet: fdelay_init_status() and FDELAY_RESUME_INIT rely on it */
+
+    if(!probe_sim(dev, location))
+    	return 0;
     if(!probe_svec(dev, location))
     	return 0;
     if(!probe_spec(dev, location))
     	return 0;
+    return -1;
 }
 
 fdelay_device_t *fdelay_create()
 {
-	return (fdelay_device_t *) malloc(sizeof(fdelay_device_t));
+	return (fdelay_device_t *) calloc(1, sizeof(fdelay_device_t));
 }
@@ -34,7 +34,6 @@
 #include "fdelay_private.h"
 
 
-extern void dbg(const char *fmt, ...);
 extern int64_t get_tics();
 extern void udelay(uint32_t usecs);
 
@@ -81,7 +80,7 @@ static void wait_prompt(fdelay_device_t *dev, char *rv)
 		}      
 	}
 	
-	dbg("Failure: shell buffer overflow.\n");
+	fd_err("Failure: shell buffer overflow.\n");
 	exit(1);
 }
 
@@ -236,7 +235,7 @@ int fdelay_dmtd_calibration(fdelay_device_t *dev, double *offsets)
     
 	if(spec_load_lm32(dev->priv_io, "wrc.bin", 0xc0000))
 	{
-	 	dbg("Failed to load LM32 firmware\n");
+	 	fd_err("Failed to load LM32 firmware\n");
 	 	return -1;
 	}
 	
@@ -266,12 +265,12 @@ int fdelay_dmtd_calibration(fdelay_device_t *dev, double *offsets)
 
 	usleep(500000);
 
-	dbg("\n\nPerforming DDMTD delay calibration: \n");
+	fd_info("Performing DDMTD delay calibration: \n");
 
 	for(i=1;i<=4;i++)
 	{
 		calibrate_channel(dev, i, &mean_out[i-1], &std_out[i-1]);	
-		dbg("Channel %d: delay %.0f ps, std %.0f ps.\n", i, mean_out[i-1], std_out[i-1]);
+		fd_info("Channel %d: delay %.0f ps, std %.0f ps.\n", i, mean_out[i-1], std_out[i-1]);
 	}
 
 	return 0;
@@ -28,6 +28,7 @@
 
 
 #include "onewire.h"
+#include "i2c_master.h"
 
 static int acam_test_bus(fdelay_device_t *dev);
 
@@ -57,8 +58,6 @@ static void fail(int test_id, const char *fmt, ...)
 	va_end(ap);
 }
 
-static int extra_debug = 1;
-
 void fdelay_show_test_results()
 {
     if(fail_test_id >= 0)
@@ -67,15 +66,6 @@ void fdelay_show_test_results()
     }
 }
 
-void dbg(const char *fmt, ...)
-{
-	va_list ap;
-	va_start(ap, fmt);
- 	if(extra_debug)
-		vfprintf(stderr,fmt,ap);
-	va_end(ap);
-}
-
 /* Returns the numer of microsecond timer ticks */
 int64_t get_tics()
 {
@@ -93,6 +83,41 @@ void udelay(uint32_t usecs)
   while(get_tics() - ts < (int64_t)usecs);
 }
 
+/*
+---------------------------
+Init-time profiling helpers
+---------------------------
+*/
+
+static const char *phase_names[FDELAY_NUM_PHASES] = {
+    "detect", "reset", "pll-lock", "sensors", "core", "acam-test",
+    "calib-ch1", "calib-ch2", "calib-ch3", "calib-ch4",
+    "acam-rmode", "acam-imode", "acam-gmode", "total"
+};
+
+/* Snapshot of the time and bus access counters taken at the beginning of a phase */
+struct phase_mark {
+    int64_t tics;
+    uint64_t reads, writes;
+};
+
+static void phase_begin(struct fine_delay_hw *hw, struct phase_mark *m)
+{
+    m->tics = get_tics();
+    m->reads = hw->bus_reads;
+    m->writes = hw->bus_writes;
+}
+
+static void phase_end(struct fine_delay_hw *hw, int phase, const struct phase_mark *m)
+{
+    struct fdelay_phase_stats *ph = &hw->profile.phases[phase];
+
+    ph->count++;
+    ph->time_us += get_tics() - m->tics;
+    ph->bus_reads += hw->bus_reads - m->reads;
+    ph->bus_writes += hw->bus_writes - m->writes;
+}
+
 /* Card reset. When mode == RESET_HW, resets the FMC hardware by asserting the reset line in the FMC
    connector, if mode == RESET_CORE, the FPGA Fine Delay core is reset. Since HW reset operation also
    reinitializes the PLL, the HW reset must be followed by a reinitialization of the FD Core. */
@@ -109,6 +134,12 @@ static void fd_do_reset(fdelay_device_t *dev, int mode)
     udelay(10000);
     fd_writel(FD_RSTR_LOCK_W(0xdead) | FD_RSTR_RST_CORE_MASK | FD_RSTR_RST_FMC_MASK, FD_REG_RSTR);
     udelay(600000); /* Leave the TPS3307 supervisor some time to de-assert the master reset line */
+
+    /* The GPIO expander and the TDC have lost their state - forget the cached copies */
+    hw->acam_addr = 0xff;
+    hw->acam_addr_out = 0;
+    hw->acam_regs_valid = 0;
+    hw->sgpio_olat_valid = 0;
   } else if (mode == FD_RESET_CORE)
     {
     fd_writel(FD_RSTR_LOCK_W(0xdead) | FD_RSTR_RST_FMC_MASK, FD_REG_RSTR);
@@ -117,6 +148,10 @@ static void fd_do_reset(fdelay_device_t *dev, int mode)
     udelay(1000);
 
     }
+
+  /* Both resets clear the output channel registers */
+  memset(hw->chan_shadow, 0, sizeof(hw->chan_shadow));
+  hw->pg_start_valid = 0;
 }
 
 
@@ -184,14 +219,14 @@ static int ad9516_init(fdelay_device_t *dev)
   const int64_t lock_timeout = 10000000LL;
   int64_t start_tics;
 
-  dbg("%s: Initializing AD9516 PLL...\n", __FUNCTION__);
+  fd_info("%s: Initializing AD9516 PLL...\n", __FUNCTION__);
   ad9516_write_reg(dev, 0, 0x99);
   ad9516_write_reg(dev, 0x232, 1);
 
   /* Check if the chip is present by reading its ID register */
   if(ad9516_read_reg(dev, 0x3) != 0xc3)
     {
-      dbg("%s: AD9516 PLL not responding.\n", __FUNCTION__);
+      fd_err("%s: AD9516 PLL not responding.\n", __FUNCTION__);
       fail(TEST_SPI, "Broken SPI connection to AD9516 PLL");
       return -1;
     }
@@ -211,7 +246,7 @@ static int ad9516_init(fdelay_device_t *dev)
 
       if(get_tics() - start_tics > lock_timeout)
 	{
-	  dbg("%s: AD9516 PLL does not lock.\n", __FUNCTION__);
+	  fd_err("%s: AD9516 PLL does not lock.\n", __FUNCTION__);
 	  return -1;
 	}
       udelay(100);
@@ -223,7 +258,7 @@ static int ad9516_init(fdelay_device_t *dev)
   ad9516_write_reg(dev, 0x230, 0);
   ad9516_write_reg(dev, 0x232, 1);
 
-  dbg("%s: AD9516 locked.\n", __FUNCTION__);
+  fd_info("%s: AD9516 locked.\n", __FUNCTION__);
 
   return 0;
 }
@@ -236,7 +271,7 @@ static int test_pll_dac(fdelay_device_t *dev)
     double range;
     int i=0;
   
-    dbg("Testing DAC/VCXO... ");
+    fd_info("Testing DAC/VCXO... ");
 
     oc_spi_txrx(dev,  CS_DAC, 24, 0, NULL); /* Drive the DAC to 0 */
     
@@ -249,7 +284,7 @@ static int test_pll_dac(fdelay_device_t *dev)
     
     
     range = (double)abs(f_hi - f_lo) / (double)f_lo * 1e6;
-    dbg("tuning range: %.1f ppm.\n",  range);
+    fd_info("tuning range: %.1f ppm.\n",  range);
     
     if(range < 10.1)
     {
@@ -315,15 +350,28 @@ void sgpio_set_dir(fdelay_device_t *dev, int pin, int dir)
   mcp_write(dev, iodir, x);
 }
 
-/* Sets the value on a given MCP23S17 GPIO pin */
+/* Sets the value on a given MCP23S17 GPIO pin. The output latches are cached, so setting a pin
+   to the value it already has costs no SPI transfers. */
 void sgpio_set_pin(fdelay_device_t *dev, int pin, int val)
 {
-  uint8_t gpio = (MCP_OLAT) + (pin & 0x100 ? 1 : 0);
-  uint8_t x;
+  fd_decl_private(dev);
+  int bank = (pin & 0x100 ? 1 : 0);
+  uint8_t x, prev;
 
-  x = mcp_read(dev, gpio);
+  if(hw->sgpio_olat_valid & (1 << bank))
+    prev = hw->sgpio_olat[bank];
+  else
+    prev = mcp_read(dev, MCP_OLAT + bank);
+
+  x = prev;
   if(!val) x &= ~(pin); else x |= (pin);
-  mcp_write(dev, gpio, x);
+
+  if((hw->sgpio_olat_valid & (1 << bank)) && x == prev)
+    return;
+
+  mcp_write(dev, MCP_OLAT + bank, x);
+  hw->sgpio_olat[bank] = x;
+  hw->sgpio_olat_valid |= (1 << bank);
 }
 
 /*
@@ -341,9 +389,16 @@ static inline void acam_set_address(fdelay_device_t *dev, uint8_t addr)
   /* A hack to speed up calibration - avoid setting the same address several times */
   if(addr != hw->acam_addr)
   {
-      mcp_write(dev, MCP_IODIR + 1, 0);
+      /* The address pins stay outputs until the next FMC reset, so program the direction only once */
+      if(!hw->acam_addr_out)
+      {
+          mcp_write(dev, MCP_IODIR + 1, 0);
+          hw->acam_addr_out = 1;
+      }
       mcp_write(dev, MCP_OLAT + 1,  addr & 0xf);
       hw->acam_addr = addr;
+      hw->sgpio_olat[1] = addr & 0xf;
+      hw->sgpio_olat_valid |= 2;
   }
 }
 
@@ -368,39 +423,177 @@ static void acam_write_reg(fdelay_device_t *dev, uint8_t reg, uint32_t data)
   fd_writel(data & 0xfffffff, FD_REG_TDR);
   fd_writel(FD_TDCSR_WRITE, FD_REG_TDCSR);
 //  printf("reg %d value 0x%x\n", reg, data);
+
+	/* Reset/trigger bits of register 4 are self-clearing, so don't keep them in the cached copy */
+	if(reg == 4)
+		data &= ~(AR4_MasterReset | AR4_PartialReset | AR4_AluTrigSoft);
+
+	if(reg < ACAM_NUM_REGS)
+	{
+		hw->acam_regs[reg] = data & 0xfffffff;
+		hw->acam_regs_valid |= (1 << reg);
+	}
+}
+
+/* Returns the current value of an ACAM configuration register: the cached copy if we know it,
+   otherwise reads it from the TDC. */
+static uint32_t acam_get_reg(fdelay_device_t *dev, uint8_t reg)
+{
+	fd_decl_private(dev)
+
+	if(reg < ACAM_NUM_REGS && (hw->acam_regs_valid & (1 << reg)))
+		return hw->acam_regs[reg];
+
+	return acam_read_reg(dev, reg);
+}
+
+/* A set of ACAM register values making up a particular TDC configuration */
+struct acam_reg_image {
+	int n;
+	uint8_t reg[ACAM_NUM_REGS];
+	uint32_t val[ACAM_NUM_REGS];
+};
+
+static void acam_image_add(struct acam_reg_image *img, uint8_t reg, uint32_t val)
+{
+	img->reg[img->n] = reg;
+	img->val[img->n] = val & 0xfffffff;
+	img->n++;
+}
+
+/* Loads a register image into the ACAM. Registers which already contain the right value
+   (according to the cached register file) are skipped. The register currently selected by
+   the address lines goes first and register 4 goes last (it's followed by the master reset
+   write), so every remaining write costs at most one address change. Returns the number
+   of registers written. */
+static int acam_load_image(fdelay_device_t *dev, const struct acam_reg_image *img)
+{
+	fd_decl_private(dev)
+	int i, n_written = 0;
+	uint32_t pending = 0;
+
+	for(i = 0; i < img->n; i++)
+	{
+		uint8_t reg = img->reg[i];
+		if(!(hw->acam_regs_valid & (1 << reg)) || hw->acam_regs[reg] != img->val[i])
+			pending |= (1 << i);
+	}
+
+	for(i = 0; i < img->n; i++)
+		if((pending & (1 << i)) && img->reg[i] == hw->acam_addr && img->reg[i] != 4)
+		{
+			acam_write_reg(dev, img->reg[i], img->val[i]);
+			pending &= ~(1 << i);
+			n_written++;
+		}
+
+	for(i = 0; i < img->n; i++)
+		if((pending & (1 << i)) && img->reg[i] != 4)
+		{
+			acam_write_reg(dev, img->reg[i], img->val[i]);
+			n_written++;
+		}
+
+	for(i = 0; i < img->n; i++)
+		if((pending & (1 << i)) && img->reg[i] == 4)
+		{
+			acam_write_reg(dev, img->reg[i], img->val[i]);
+			n_written++;
+		}
+
+	return n_written;
+}
+
+/* ACAM PLL settings for the reference clocks and bin sizes the card normally runs with,
+   precomputed with the exhaustive search over all divider combinations. */
+static const struct {
+	double clock_freq, bin;
+	int hsdiv, refdiv;
+} acam_pll_presets[] = {
+	{ 31.25e6, ACAM_DEFAULT_BIN, 117, 6 },
+	{ 0, 0, 0, 0 }
+};
+
+/* Bin size produced by a given PLL setting */
+static inline double acam_pll_bin(int hsdiv, int refdiv, double clock_freq)
+{
+	return ((1.0/clock_freq) * 1e12) * (double)(1 << refdiv) / (216.0 * (double)hsdiv);
 }
 
 /* Calculates the parameters of the ACAM PLL (hsdiv and refdiv)
    for a given bin size and reference clock frequency. Returns the closest
-   achievable bin size. */
-static double acam_calc_pll(int *hsdiv, int *refdiv, double bin, double clock_freq)
+   achievable bin size.
+   
+   For a fixed refdiv the bin size is inversely proportional to hsdiv, so the best hsdiv is one
+   of the two integers around the exact solution. It's enough to check 16 candidates instead of
+   all 255 x 8 combinations. Ties are resolved the same way as in the exhaustive search
+   (lowest hsdiv, then lowest refdiv). Returns -1 (leaving hsdiv/refdiv untouched) if bin or
+   clock_freq isn't positive. */
+double fdelay_acam_calc_pll(double bin, double clock_freq, int *hsdiv, int *refdiv)
 {
-	int h;
-	int r;
-	double best_err = 100000;
-	double best_bin;
+	int h, r, i;
+	double best_err = -1;
+	double best_bin = 0;
+
+	if(!(bin > 0) || !(clock_freq > 0))
+		return -1;
+
+	for(i = 0; acam_pll_presets[i].bin != 0; i++)
+		if(acam_pll_presets[i].bin == bin && acam_pll_presets[i].clock_freq == clock_freq)
+		{
+			*hsdiv = acam_pll_presets[i].hsdiv;
+			*refdiv = acam_pll_presets[i].refdiv;
+			return acam_pll_bin(*hsdiv, *refdiv, clock_freq);
+		}
 
-/* Try all possible divider settings */
-	for(h=1;h<=255;h++)
 	for(r=0;r<=7;r++)
 	{
-	 	double b = ((1.0/clock_freq) * 1e12) * pow(2.0, (double) r) / (216.0 * (double)h);
+		double x = floor(((1.0/clock_freq) * 1e12) * (double)(1 << r) / (216.0 * bin));
+		/* clamp before the conversion, a tiny bin would overflow an int */
+		int h0 = x < 0 ? 0 : (x > 255 ? 255 : (int) x);
 
-		if(fabs(bin - b) < best_err)
+		for(h = h0; h <= h0 + 1; h++)
 		{
-		 	best_err=fabs(bin-b);
-		 	best_bin = b;
-		 	*hsdiv=  h;
-		 	*refdiv = r;
+			int hc = h < 1 ? 1 : (h > 255 ? 255 : h);
+		 	double b = acam_pll_bin(hc, r, clock_freq);
+		 	double err = fabs(bin - b);
+
+			if(best_err < 0 || err < best_err || (err == best_err && (hc < *hsdiv || (hc == *hsdiv && r < *refdiv))))
+			{
+			 	best_err = err;
+			 	best_bin = b;
+			 	*hsdiv = hc;
+			 	*refdiv = r;
+			}
 		}
 	}
 
-	dbg("%s: requested bin=%.02fps best=%.02fps error=%.02f%%\n", __FUNCTION__, bin, best_bin, (best_err/bin) * 100.0);
+	return best_bin;
+}
+
+static double acam_calc_pll(int *hsdiv, int *refdiv, double bin, double clock_freq)
+{
+	double best_bin = fdelay_acam_calc_pll(bin, clock_freq, hsdiv, refdiv);
+
+	dbg("%s: requested bin=%.02fps best=%.02fps error=%.02f%%\n", __FUNCTION__, bin, best_bin, (fabs(bin - best_bin)/bin) * 100.0);
 	dbg("%s: hsdiv=%d refdiv=%d\n", __FUNCTION__, *hsdiv, *refdiv);
 
 	return best_bin;
 }
 
+/* Selects the ACAM bin size used by the subsequent TDC mode switches (e.g. for I-Mode
+   calibration experiments). The new setting takes effect on the next ACAM reconfiguration. */
+int fdelay_set_acam_bin(fdelay_device_t *dev, double bin_ps)
+{
+	fd_decl_private(dev)
+
+	if(bin_ps <= 0)
+		return -1;
+
+	hw->acam_bin_req = bin_ps;
+	return 0;
+}
+
 
 /* Returns non-zero if the ACAM's internal PLL is locked */
 static inline int acam_pll_locked(fdelay_device_t *dev)
@@ -409,26 +602,50 @@ static inline int acam_pll_locked(fdelay_device_t *dev)
  	return !(r12 & AR12_NotLocked);
 }
 
+/* Waits until the ACAM PLL locks, polling AR12_NotLocked. The poll interval starts short
+   and doubles on each miss (up to 10 ms), so a fast lock is detected almost immediately
+   while a slow one doesn't flood the bus. Returns the lock time in microseconds or
+   a negative value on timeout. */
+static int64_t acam_wait_pll_lock(fdelay_device_t *dev, int64_t timeout_us)
+{
+	int64_t start_tics = get_tics(), elapsed;
+	int interval = 50;
+
+	for(;;)
+	{
+		if(acam_pll_locked(dev))
+			return get_tics() - start_tics;
+
+		elapsed = get_tics() - start_tics;
+		if(elapsed > timeout_us)
+			return -1;
+
+		usleep(interval);
+		if(interval < 10000)
+			interval *= 2;
+	}
+}
+
 static int test_addr_bit(fdelay_device_t *dev, int addr1, int addr2, int addr_bit, int data_bit)
 {
     int failed = 0;
     
-    acam_write_reg(dev, addr1, acam_read_reg(dev, addr1) & ~(1<<data_bit)); // set the data bit to 0
-    acam_write_reg(dev, addr2, acam_read_reg(dev, addr2) |  (1<<data_bit)); // set the data bit to 1
+    acam_write_reg(dev, addr1, acam_get_reg(dev, addr1) & ~(1<<data_bit)); // set the data bit to 0
+    acam_write_reg(dev, addr2, acam_get_reg(dev, addr2) |  (1<<data_bit)); // set the data bit to 1
     
     if(acam_read_reg(dev, addr1) & (1<<data_bit)  || !(acam_read_reg(dev, addr2) & (1<<data_bit)))
        failed= 1;
 
     /* the other way around */
-    acam_write_reg(dev, addr1, acam_read_reg(dev, addr1) | (1<<data_bit)); 
-    acam_write_reg(dev, addr2, acam_read_reg(dev, addr2) & ~(1<<data_bit));
+    acam_write_reg(dev, addr1, acam_get_reg(dev, addr1) | (1<<data_bit)); 
+    acam_write_reg(dev, addr2, acam_get_reg(dev, addr2) & ~(1<<data_bit));
     
     if(!(acam_read_reg(dev, addr1) & (1<<data_bit))  || acam_read_reg(dev, addr2) & (1<<data_bit))
        failed= 1;
 
     if(failed)
     {
-        dbg("Bit failure on ACAM_A[%d]\n",addr_bit);
+        fd_err("Bit failure on ACAM_A[%d]\n",addr_bit);
         fail(TEST_ACAM_IF, "Bit failure on ACAM_A[%d]", addr_bit);
         return -1;
     }
@@ -456,7 +673,7 @@ static int acam_test_bus(fdelay_device_t *dev)
         
         if(rb != (1<<i) || rb2 != (~(1<<i) & 0xfffffff))
         {
-            dbg("Bit failure on ACAM_D[%d]: %x shouldbe %x \n", i, rb, (1<<i));
+            fd_err("Bit failure on ACAM_D[%d]: %x shouldbe %x \n", i, rb, (1<<i));
             fail(TEST_ACAM_IF, "Bit failure on ACAM_D[%d]: %x shouldbe %x ", i, rb, (1<<i));
             return -1;
         }
@@ -471,41 +688,31 @@ static int acam_test_bus(fdelay_device_t *dev)
 }
 
 
-/* Configures the ACAM TDC to work in a particular mode. Currently there are two modes
-   supported: R-Mode for the normal operation (delay/timestamper) and I-Mode for the purpose
-   of calibrating the fine delay lines. */
-
-
-static int acam_configure(fdelay_device_t *dev, int mode)
+/* Builds the register image for a given ACAM operating mode. The master reset
+   write which has to follow the image is not a part of it. */
+static int acam_build_image(fdelay_device_t *dev, int mode, int hsdiv, int refdiv, struct acam_reg_image *img)
 {
 	fd_decl_private(dev)
 
-	int hsdiv, refdiv;
-	int64_t start_tics;
-	const int64_t lock_timeout = 2000000LL;
-
-	hw->acam_bin = acam_calc_pll(&hsdiv, &refdiv, 80.9553, 31.25e6);// / 2.0;
-
-	/* Disable TDC inputs prior to configuring */
-	fd_writel(FD_TDCSR_STOP_DIS | FD_TDCSR_START_DIS, FD_REG_TDCSR);
+	img->n = 0;
 
 	if(mode == ACAM_RMODE)
 	{
-	 	acam_write_reg(dev, 0, AR0_ROsc | AR0_RiseEn0 | AR0_RiseEn1 | AR0_HQSel );
-	 	acam_write_reg(dev, 1, AR1_Adj(0, 0) |
+	 	acam_image_add(img, 0, AR0_ROsc | AR0_RiseEn0 | AR0_RiseEn1 | AR0_HQSel );
+	 	acam_image_add(img, 1, AR1_Adj(0, 0) |
 	 					  AR1_Adj(1, 2) |
 	 					  AR1_Adj(2, 6) |
 	 					  AR1_Adj(3, 0) |
 	 					  AR1_Adj(4, 2) |
 	 					  AR1_Adj(5, 6) |
 	 					  AR1_Adj(6, 0));
-	   	acam_write_reg(dev, 2, AR2_RMode | AR2_Adj(7, 2) | AR2_Adj(8, 6)
+	   	acam_image_add(img, 2, AR2_RMode | AR2_Adj(7, 2) | AR2_Adj(8, 6)
 		    	   	    | AR2_DelRise1(0) 
 		    	   	    | AR2_DelFall1(0) 
 		    	   	    | AR2_DelRise2(0) 
 		    	   	    | AR2_DelFall2(0) 
 		    	   	);
-	   	acam_write_reg(dev, 3, AR3_DelTx(1,3) | 
+	   	acam_image_add(img, 3, AR3_DelTx(1,3) | 
 	   			       AR3_DelTx(2,3) |
 	   			       AR3_DelTx(3,3) |
 	   			       AR3_DelTx(4,3) |
@@ -518,7 +725,7 @@ static int acam_configure(fdelay_device_t *dev, int mode)
 	   			       AR3_RaSpeed(2,3) 
     	   			       );
 	   			       
-	   	acam_write_reg(dev, 4, AR4_EFlagHiZN
+	   	acam_image_add(img, 4, AR4_EFlagHiZN
 	   			     | AR4_RaSpeed(3,3) 
 	   			     | AR4_RaSpeed(4,3)  
 	   			     | AR4_RaSpeed(5,3)  
@@ -526,39 +733,29 @@ static int acam_configure(fdelay_device_t *dev, int mode)
 	   			     | AR4_RaSpeed(7,3)  
 	   			     | AR4_RaSpeed(8,3)  
 	   			     );
-	   	acam_write_reg(dev, 5, AR5_StartRetrig |AR5_StartOff1(hw->calib.acam_start_offset) | AR5_MasterAluTrig);
-	   	acam_write_reg(dev, 6, AR6_Fill(200) | AR6_PowerOnECL);
-	   	acam_write_reg(dev, 7, AR7_HSDiv(hsdiv) | AR7_RefClkDiv(refdiv) | AR7_ResAdj | AR7_NegPhase);
-	   	acam_write_reg(dev, 11, 0x7ff0000);
-	   	acam_write_reg(dev, 12, 0x0000000);
-	   	acam_write_reg(dev, 14, 0);
-
-		/* Reset the ACAM after the configuration */
-	   	acam_write_reg(dev, 4, AR4_EFlagHiZN | AR4_MasterReset | AR4_StartTimer(0));
+	   	acam_image_add(img, 5, AR5_StartRetrig |AR5_StartOff1(hw->calib.acam_start_offset) | AR5_MasterAluTrig);
+	   	acam_image_add(img, 6, AR6_Fill(200) | AR6_PowerOnECL);
+	   	acam_image_add(img, 7, AR7_HSDiv(hsdiv) | AR7_RefClkDiv(refdiv) | AR7_ResAdj | AR7_NegPhase);
+	   	acam_image_add(img, 11, 0x7ff0000);
+	   	acam_image_add(img, 12, 0x0000000);
+	   	acam_image_add(img, 14, 0);
 	}else if(mode == ACAM_GMODE)
 	{
-		dbg("ACAM: working in G-Mode\n");
-
-	 	acam_write_reg(dev, 0, 0);
-	 	acam_write_reg(dev, 7, 0);
-	   	
-	 	sleep(1);
-
-	 	acam_write_reg(dev, 0, AR0_ROsc | AR0_RiseEn0 | AR0_RiseEn1 | AR0_HQSel );
-	 	acam_write_reg(dev, 1, AR1_Adj(0, 0) |
+	 	acam_image_add(img, 0, AR0_ROsc | AR0_RiseEn0 | AR0_RiseEn1 | AR0_HQSel );
+	 	acam_image_add(img, 1, AR1_Adj(0, 0) |
 	 					  AR1_Adj(1, 0) |
 	 					  AR1_Adj(2, 5) |
 	 					  AR1_Adj(3, 0) |
 	 					  AR1_Adj(4, 5) |
 	 					  AR1_Adj(5, 0) |
 	 					  AR1_Adj(6, 5));
-	   	acam_write_reg(dev, 2, AR2_GMode | AR2_Adj(7, 0) | AR2_Adj(8, 5)
+	   	acam_image_add(img, 2, AR2_GMode | AR2_Adj(7, 0) | AR2_Adj(8, 5)
 		    	   	    | AR2_DelRise1(0) 
 		    	   	    | AR2_DelFall1(0) 
 		    	   	    | AR2_DelRise2(0) 
 		    	   	    | AR2_DelFall2(0) 
 		    	   	);
-	   	acam_write_reg(dev, 3, AR3_DelTx(1,3) | 
+	   	acam_image_add(img, 3, AR3_DelTx(1,3) | 
 	   			       AR3_DelTx(2,3) |
 	   			       AR3_DelTx(3,3) |
 	   			       AR3_DelTx(4,3) |
@@ -571,7 +768,7 @@ static int acam_configure(fdelay_device_t *dev, int mode)
 	   			       AR3_RaSpeed(2,3) 
     	   			       );
 	   			       
-	   	acam_write_reg(dev, 4, AR4_EFlagHiZN
+	   	acam_image_add(img, 4, AR4_EFlagHiZN
 	   			     | AR4_RaSpeed(3,3) 
 	   			     | AR4_RaSpeed(4,3)  
 	   			     | AR4_RaSpeed(5,3)  
@@ -579,63 +776,110 @@ static int acam_configure(fdelay_device_t *dev, int mode)
 	   			     | AR4_RaSpeed(7,3)  
 	   			     | AR4_RaSpeed(8,3)  
 	   			     );
-	   	acam_write_reg(dev, 5, AR5_StartRetrig |AR5_StartOff1(hw->calib.acam_start_offset) | AR5_MasterAluTrig);
-	   	acam_write_reg(dev, 6, AR6_Fill(200) | AR6_PowerOnECL | AR6_StartOff2(hw->calib.acam_start_offset));
-	   	acam_write_reg(dev, 7, AR7_HSDiv(hsdiv) | AR7_RefClkDiv(refdiv) | AR7_ResAdj | AR7_NegPhase);
-	   	acam_write_reg(dev, 11, 0x7ff0000);
-	   	acam_write_reg(dev, 12, 0x0000000);
-	   	acam_write_reg(dev, 14, 0);
-
-		/* Reset the ACAM after the configuration */
-	   	acam_write_reg(dev, 4, AR4_EFlagHiZN | AR4_MasterReset | AR4_StartTimer(0));
-
+	   	acam_image_add(img, 5, AR5_StartRetrig |AR5_StartOff1(hw->calib.acam_start_offset) | AR5_MasterAluTrig);
+	   	acam_image_add(img, 6, AR6_Fill(200) | AR6_PowerOnECL | AR6_StartOff2(hw->calib.acam_start_offset));
+	   	acam_image_add(img, 7, AR7_HSDiv(hsdiv) | AR7_RefClkDiv(refdiv) | AR7_ResAdj | AR7_NegPhase);
+	   	acam_image_add(img, 11, 0x7ff0000);
+	   	acam_image_add(img, 12, 0x0000000);
+	   	acam_image_add(img, 14, 0);
 	} else if (mode == ACAM_IMODE)
 	{
-	 	acam_write_reg(dev, 0, 0);
-	 	acam_write_reg(dev, 7, 0);
-	   	
-	 	sleep(1);
-
-		acam_write_reg(dev, 0, AR0_TRiseEn(0) | AR0_HQSel | AR0_ROsc);
-	   	acam_write_reg(dev, 2, AR2_IMode);
-	   	acam_write_reg(dev, 5, AR5_StartOff1(3000) | AR5_MasterAluTrig);
-	   	acam_write_reg(dev, 6, 0);
-	   	acam_write_reg(dev, 7, AR7_HSDiv(hsdiv) | AR7_RefClkDiv(refdiv) | AR7_ResAdj | AR7_NegPhase);
-   	   	acam_write_reg(dev, 11, 0x7ff0000);
-	   	acam_write_reg(dev, 12, 0x0000000);
-	   	acam_write_reg(dev, 14, 0);
-
-		/* Reset the ACAM after the configuration */
-		acam_write_reg(dev, 4, AR4_EFlagHiZN | AR4_MasterReset | AR4_StartTimer(0));
+		acam_image_add(img, 0, AR0_TRiseEn(0) | AR0_HQSel | AR0_ROsc);
+	   	acam_image_add(img, 2, AR2_IMode);
+	   	acam_image_add(img, 5, AR5_StartOff1(3000) | AR5_MasterAluTrig);
+	   	acam_image_add(img, 6, 0);
+	   	acam_image_add(img, 7, AR7_HSDiv(hsdiv) | AR7_RefClkDiv(refdiv) | AR7_ResAdj | AR7_NegPhase);
+   	   	acam_image_add(img, 11, 0x7ff0000);
+	   	acam_image_add(img, 12, 0x0000000);
+	   	acam_image_add(img, 14, 0);
 	} else
 		return -1;  /* Unsupported mode? */
 
-	int i;
+	return 0;
+}
+
+/* Configures the ACAM TDC to work in a particular mode. Currently there are two modes
+   supported: R-Mode for the normal operation (delay/timestamper) and I-Mode for the purpose
+   of calibrating the fine delay lines. */
 
-	dbg("%s: Waiting for ACAM ring oscillator lock...\n", __FUNCTION__);
 
-	start_tics = get_tics();
-	for(;;)
+static int acam_do_configure(fdelay_device_t *dev, int mode)
+{
+	fd_decl_private(dev)
+
+	int hsdiv, refdiv, n_written;
+	int64_t lock_time;
+	const int64_t lock_timeout = 2000000LL;
+	uint32_t ar7;
+	struct acam_reg_image img;
+
+	hw->acam_bin = acam_calc_pll(&hsdiv, &refdiv, hw->acam_bin_req, ACAM_REF_CLOCK);
+
+	if(acam_build_image(dev, mode, hsdiv, refdiv, &img) < 0)
+		return -1;
+
+	/* Disable TDC inputs prior to configuring */
+	fd_writel(FD_TDCSR_STOP_DIS | FD_TDCSR_START_DIS, FD_REG_TDCSR);
+
+	if(mode == ACAM_GMODE || mode == ACAM_IMODE)
 	{
-		if(acam_pll_locked(dev))
-			break;
+		if(mode == ACAM_GMODE)
+			fd_info("ACAM: working in G-Mode\n");
 
-		if(get_tics() - start_tics > lock_timeout)
+		/* Restarting the PLL (and waiting for it to stop) is only necessary if its
+		   settings are about to change or it's not running at all. */
+		ar7 = AR7_HSDiv(hsdiv) | AR7_RefClkDiv(refdiv) | AR7_ResAdj | AR7_NegPhase;
+
+		if(!(hw->acam_regs_valid & (1 << 7)) || hw->acam_regs[7] != ar7 || !acam_pll_locked(dev))
 		{
-			 dbg("%s: ACAM PLL does not lock.\n", __FUNCTION__);
-			 fail(TEST_ACAM_IF, "ACAM PLL does not lock.");
-			 return -1;
-		}
-		usleep(10000);
-    }
+		 	acam_write_reg(dev, 0, 0);
+		 	acam_write_reg(dev, 7, 0);
+		   	
+		 	sleep(1);
+		} else
+			hw->acam_restarts_skipped++;
+	}
+
+	n_written = acam_load_image(dev, &img);
+
+	/* Reset the ACAM after the configuration */
+	acam_write_reg(dev, 4, AR4_EFlagHiZN | AR4_MasterReset | AR4_StartTimer(0));
+
+	dbg("%s: %d of %d registers written\n", __FUNCTION__, n_written, img.n);
 
-    dbg("%s: Locking took %lld millieconds\n", __FUNCTION__, (get_tics() - start_tics) / 1000LL);
+	fd_info("%s: Waiting for ACAM ring oscillator lock...\n", __FUNCTION__);
+
+	lock_time = acam_wait_pll_lock(dev, lock_timeout);
+
+	if(lock_time < 0)
+	{
+		 fd_err("%s: ACAM PLL does not lock.\n", __FUNCTION__);
+		 fail(TEST_ACAM_IF, "ACAM PLL does not lock.");
+		 return -1;
+	}
+
+	hw->acam_lock_time += lock_time;
+    fd_info("%s: Locking took %lld.%03lld milliseconds\n", __FUNCTION__, lock_time / 1000LL, lock_time % 1000LL);
 
     acam_set_address(dev, 8); /* Permamently select FIFO1 register for readout */
 
     return 0;
 }
 
+static int acam_configure(fdelay_device_t *dev, int mode)
+{
+	fd_decl_private(dev)
+	struct phase_mark m;
+	int rv;
+
+	phase_begin(hw, &m);
+	rv = acam_do_configure(dev, mode);
+	if(mode >= ACAM_RMODE && mode <= ACAM_GMODE)
+		phase_end(hw, FDELAY_PHASE_ACAM_RMODE + mode, &m);
+
+	return rv;
+}
+
 /*
 ---------------------
 Calibration functions
@@ -646,6 +890,31 @@ Calibration functions
 #define chan_writel(data, addr) fd_writel((data),  channel * 0x100 + (addr))
 #define chan_readl(addr) fd_readl(channel * 0x100 + (addr))
 
+/* Writes a register of an output channel, unless its shadow says it already holds (data).
+   Returns non-zero if the register was written. */
+static int chan_shadow_writel(fdelay_device_t *dev, int channel, uint32_t data, uint32_t addr)
+{
+	fd_decl_private(dev)
+	struct fd_chan_shadow *sh = &hw->chan_shadow[channel-1];
+	int idx = addr >> 2;
+
+	if((sh->valid & (1 << idx)) && sh->regs[idx] == data)
+		return 0;
+
+	chan_writel(data, addr);
+	sh->regs[idx] = data;
+	sh->valid |= (1 << idx);
+	return 1;
+}
+
+/* Forgets the register shadow and the programmed start time of (channel), after the registers
+   were written directly */
+static inline void chan_shadow_invalidate(struct fine_delay_hw *hw, int channel)
+{
+	hw->chan_shadow[channel-1].valid = 0;
+	hw->pg_start_valid &= ~(1 << (channel-1));
+}
+
 /* Measures the the FPGA-generated TDC start and the output of one of the fine delay chips (channel)
    at a pre-defined number of taps (fine). Retuns the delay in picoseconds. The measurement is repeated
    and averaged (n_avgs) times. Also, the standard deviation of the result can be written to (sdev)
@@ -712,7 +981,7 @@ static double measure_output_delay(fdelay_device_t *dev, int channel, int fine,
 	if(sdev) *sdev = sqrt(std /(double) n_avgs);
 
    	chan_writel( 0, FD_REG_DCR);
-
+   	chan_shadow_invalidate(hw, channel);
 
 	return acc;
 }
@@ -765,7 +1034,7 @@ static int test_delay_transfer_function(fdelay_device_t *dev)
 
 	for(channel = 1; channel <= 4; channel++)
 	{
-		dbg("calibrating channel %d\n", channel);
+		fd_info("calibrating channel %d\n", channel);
 		bias = measure_output_delay(dev, channel, 0, FDELAY_CAL_AVG_STEPS, &sdev[0][channel-1]);
 		meas[channel-1][0] = 0.0;
 		for(i=FDELAY_NUM_TAPS-1;i>=0;i--)
@@ -776,7 +1045,7 @@ static int test_delay_transfer_function(fdelay_device_t *dev)
 		}
 
         measure_linearity(meas[channel-1], FDELAY_NUM_TAPS-1, &inl, &dnl);
-	    dbg("Linearity: INL = %.1f ps, DNL = %.1f ps\n",  inl, dnl);
+	    fd_info("Linearity: INL = %.1f ps, DNL = %.1f ps\n",  inl, dnl);
 	    
 	    if(inl > MAX_INL || dnl > MAX_DNL)
             lin_fail=1;	    
@@ -785,7 +1054,7 @@ static int test_delay_transfer_function(fdelay_device_t *dev)
 
     if(lin_fail)
     {
-        dbg("Linearity check failed.\n");
+        fd_err("Linearity check failed.\n");
         fail(TEST_DELAY_LINE, "Maximum INL/DNL exceeded, indicating a wrong connection of the delay chip and/or the TDC calibration signals");
         return -1;
     }
@@ -814,7 +1083,7 @@ static int find_8ns_tap(fdelay_device_t *dev, int channel)
 {
 	int l = 0, r=FDELAY_NUM_TAPS-1;
 
-    dbg("Calibrating: %d\n", channel);
+    fd_info("Calibrating: %d\n", channel);
 
 /* Measure the delay at zero setting, so it can be further subtracted to get only the
    delay part introduced by the delay line (ingoring the TDC, FPGA and routing delays). */
@@ -856,14 +1125,20 @@ int calibrate_outputs(fdelay_device_t *dev)
 
 	for(channel = 1; channel <= 4; channel++)
 	{   
+        struct phase_mark m;
+
+        phase_begin(hw, &m);
+
         while(ds18x_read_temp(dev, &temp) < 0)
             usleep(100000);
     
     	int cal_measd = find_8ns_tap(dev, channel);
+
+        phase_end(hw, FDELAY_PHASE_CALIB_CH1 + channel - 1, &m);
 	
     	int cal_fitted = eval_poly(hw->calib.frr_poly, temp);
             
-     	dbg("%s: CH%d: 8ns @ %d (fitted %d, offset %d, temperature %d.%1d)\n", __FUNCTION__, channel, cal_measd, cal_fitted, cal_measd-cal_fitted, temp);
+     	dbg("%s: CH%d: 8ns @ %d (fitted %d, offset %d, temperature %d.%1d)\n", __FUNCTION__, channel, cal_measd, cal_fitted, cal_measd-cal_fitted, temp / 16, (temp & 0xf) * 10 / 16);
      	hw->frr_cur[channel-1] = cal_measd;
      	hw->frr_offset[channel-1] = cal_measd - cal_fitted;
 	}
@@ -888,7 +1163,7 @@ void fdelay_update_calibration(fdelay_device_t *dev)
             
      	dbg("%s: CH%d: FRR = %d\n", __FUNCTION__, channel,  cal_fitted);
      	hw->frr_cur[channel-1] = cal_fitted;
-     	chan_writel(hw->frr_cur[channel-1],  FD_REG_FRR);
+     	chan_shadow_writel(dev, channel, hw->frr_cur[channel-1],  FD_REG_FRR);
 	}
 }
 
@@ -925,12 +1200,12 @@ static int read_calibration_eeprom(fdelay_device_t *dev, struct fine_delay_calib
 
  	if(eeprom_read(dev, EEPROM_ADDR, 0, (uint8_t *) &cal, sizeof(struct fine_delay_calibration)) != sizeof(struct fine_delay_calibration))
  	{
- 	    dbg("Can't read calibration EEPROM.\n");
+ 	    fd_err("Can't read calibration EEPROM.\n");
  		return -1;
     }
 	if(cal.magic != FDELAY_MAGIC_ID)
 	{
-	    dbg("EEPROM doesn't contain valid calibration block.\n");
+	    fd_warn("EEPROM doesn't contain valid calibration block.\n");
  	    return 0;
 	}
 
@@ -944,50 +1219,35 @@ static int read_calibration_eeprom(fdelay_device_t *dev, struct fine_delay_calib
 -------------------------------------
 */
 
-/* Initialize & self-calibrate the Fine Delay card */
-int fdelay_init(fdelay_device_t *dev, int init_flags)
-{
-  int i, rv;
-  struct fine_delay_hw *hw;
-  fdelay_time_t t_zero;
-
-  dbg("Init: dev %x\n", dev);
-  hw = (struct fine_delay_hw *) malloc(sizeof(struct fine_delay_hw));
-  if(! hw)
-    return -1;
-
-  dev->priv_fd = (void *) hw;
+/*
+-------------------------------------
+        Initialization stages
+-------------------------------------
+*/
 
-  hw->raw_mode = init_flags & FDELAY_RAW_READOUT ? 1 : 0;
-  hw->do_long_tests = init_flags & FDELAY_PERFORM_LONG_TESTS ? 1 : 0;
-  hw->base_addr = dev->base_addr;
-  hw->base_i2c = 0x100;
-  hw->base_onewire = dev->base_addr + 0x500;
-  hw->wr_enabled = 0;
-  hw->wr_state = FDELAY_FREE_RUNNING;
-  hw->acam_addr = 0xff;
-  hw->input_user_offset = 0;
-  hw->output_user_offset= 0;
-  dbg("%s: Initializing the Fine Delay Card\n", __FUNCTION__);
+/* Checks the core signature and the FMC presence, loads the calibration data */
+static int init_detect(fdelay_device_t *dev)
+{
+  fd_decl_private(dev)
+  int rv;
 
   /* Read the Identification register and check if we are talking to a proper Fine Delay HDL Core */
   if(fd_readl(FD_REG_IDR) != FDELAY_MAGIC_ID)
     {
       fail(TEST_FIRMWARE, "Core not responding. Firmware loaded incorrectly?");
-      dbg("%s: invalid core signature. Are you sure you have loaded the FPGA with the Fine Delay firmware?\n", __FUNCTION__);
+      fd_err("%s: invalid core signature. Are you sure you have loaded the FPGA with the Fine Delay firmware?\n", __FUNCTION__);
       return -1;
     }
 
   if(! (fd_readl(FD_REG_GCR) & FD_GCR_FMC_PRESENT))
   {
       fail(TEST_PRESENCE, "FMC Card not detected in the slot. Maybe a fault on PRSNT_L line?");
-      dbg("%s: FMC Presence line not active. Is the FMC correctly inserted into the carrier?\n", __FUNCTION__);
+      fd_err("%s: FMC Presence line not active. Is the FMC correctly inserted into the carrier?\n", __FUNCTION__);
       return -1;
   
   }
 
-//  rv = read_calibration_eeprom(dev, &hw->calib);
-	rv = 0;
+  rv = read_calibration_eeprom(dev, &hw->calib);
 	  
   if(rv < 0)
   {
@@ -996,7 +1256,7 @@ int fdelay_init(fdelay_device_t *dev, int init_flags)
   } else if(!rv)
   {
     int i;
-    dbg("%s: Calibration EEPROM does not contain a valid calibration block. Using default calibration values\n", __FUNCTION__);
+    fd_warn("%s: Calibration EEPROM does not contain a valid calibration block. Using default calibration values\n", __FUNCTION__);
 
     hw->calib.frr_poly[0] = -165202LL;
     hw->calib.frr_poly[1] = -29825595LL;
@@ -1010,10 +1270,19 @@ int fdelay_init(fdelay_device_t *dev, int init_flags)
       hw->calib.zero_offset[i] = 50000;
   }
 
-  /* Reset the FMC hardware. */
+  return 0;
+}
+
+/* Resets the FMC hardware. */
+static int init_reset(fdelay_device_t *dev)
+{
   fd_do_reset(dev, FD_RESET_HW);
+  return 0;
+}
 
-  /* Initialize the clock system - AD9516 PLL */
+/* Initializes the clock system - AD9516 PLL */
+static int init_clocks(fdelay_device_t *dev)
+{
   oc_spi_init(dev);
 
   if(sgpio_init(dev) < 0)
@@ -1022,18 +1291,34 @@ int fdelay_init(fdelay_device_t *dev, int init_flags)
   if(ad9516_init(dev) < 0)
     return -1;
 
+  return 0;
+}
+
+static int init_sensors(fdelay_device_t *dev)
+{
+  int temp;
+
 	if(ds18x_init(dev) < 0)
 	{
 	    fail(TEST_SPI, "DS18x sensor not detected.");
-    	    dbg("DS18x sensor not detected. Bah!\n");
+    	    fd_err("DS18x sensor not detected. Bah!\n");
     	    return -1;
 	}
 
-	int temp;
+	/* Give the sensor time to complete the first conversion */
+	sleep(1);
+
 	ds18x_read_temp(dev, &temp);
 
-	dbg("Device temperature: %d\n", temp);
-  /* Configure default states of the SPI GPIO pins */
+	fd_info("Device temperature: %d\n", temp);
+	return 0;
+}
+
+/* Configures default states of the SPI GPIO pins and brings the FD core out of reset */
+static int init_core(fdelay_device_t *dev)
+{
+  fd_decl_private(dev)
+  int i;
 
   sgpio_set_dir(dev, SGPIO_TRIG_SEL, 1);
   sgpio_set_pin(dev, SGPIO_TRIG_SEL, 1);
@@ -1059,6 +1344,12 @@ int fdelay_init(fdelay_device_t *dev, int init_flags)
      initialization and calibration */
   fd_writel( FD_GCR_BYPASS, FD_REG_GCR);
 
+  return 0;
+}
+
+static int init_selftest(fdelay_device_t *dev)
+{
+  fd_decl_private(dev)
 
   if(hw->do_long_tests && test_pll_dac(dev) < 0)
     return -1;
@@ -1067,12 +1358,24 @@ int fdelay_init(fdelay_device_t *dev, int init_flags)
   if(acam_test_bus(dev) < 0)
     return -1;
 
-	/* Calibrate the output delay lines */
-  if(calibrate_outputs(dev) < 0)
-    return -1;
+  return 0;
+}
+
+/* Calibrates the output delay lines */
+static int init_calibrate(fdelay_device_t *dev)
+{
+  return calibrate_outputs(dev);
+}
+
+/* Switches the TDC to normal operation and starts the delay core */
+static int init_start(fdelay_device_t *dev)
+{
+  fd_decl_private(dev)
+  fdelay_time_t t_zero;
 
   /* Switch to the R-MODE (more precise) */
-  acam_configure(dev, ACAM_GMODE);
+  if(acam_configure(dev, ACAM_GMODE) < 0)
+    return -1;
 
   /* Switch the ACAM to be driven by the delay core instead of the host */
   fd_writel( 0, FD_REG_GCR);
@@ -1102,10 +1405,237 @@ int fdelay_init(fdelay_device_t *dev, int init_flags)
   /* Enable output driver */
   //	sgpio_set_pin(dev, SGPIO_DRV_OEN, 1);
 
-  dbg("FD initialized\n");
   return 0;
 }
 
+/* Initialization stages, in execution order. Entry (n) brings the card from state (n) to (n + 1). */
+static const struct {
+  const char *name;
+  int (*run)(fdelay_device_t *dev);
+  int phase; /* profiling phase (FDELAY_PHASE_xxx) or -1 if the stage profiles its own sub-phases */
+} init_stages[FDELAY_INIT_READY] = {
+  { "detect",    init_detect,    FDELAY_PHASE_DETECT },
+  { "reset",     init_reset,     FDELAY_PHASE_RESET },
+  { "clocks",    init_clocks,    FDELAY_PHASE_PLL_LOCK },
+  { "sensors",   init_sensors,   FDELAY_PHASE_SENSORS },
+  { "core",      init_core,      FDELAY_PHASE_CORE },
+  { "self-test", init_selftest,  FDELAY_PHASE_ACAM_TEST },
+  { "calibrate", init_calibrate, -1 },
+  { "start",     init_start,     -1 },
+};
+
+/* Runs a single init stage, recording its timing */
+static int init_run_stage(fdelay_device_t *dev, int stage)
+{
+  fd_decl_private(dev)
+  struct phase_mark m;
+  int rv;
+
+  phase_begin(hw, &m);
+  rv = init_stages[stage].run(dev);
+  if(init_stages[stage].phase >= 0)
+    phase_end(hw, init_stages[stage].phase, &m);
+
+  return rv;
+}
+
+/* Tries to reattach to a card which has already been initialized (e.g. by a previous instance of
+   the program): the core must be running with our calibration, the PLLs must be locked and the
+   delay lines must have been calibrated. Nothing is reset - outputs keep running. The per-channel
+   delay line settings are recovered from the FRR registers. Returns 0 on success, negative if
+   a full initialization is needed. */
+static int fd_warm_attach(fdelay_device_t *dev)
+{
+  fd_decl_private(dev)
+  int64_t start_tics = get_tics();
+  uint32_t gcr;
+  int channel, temp;
+
+  gcr = fd_readl(FD_REG_GCR);
+  if(!(gcr & FD_GCR_DDR_LOCKED) || (gcr & FD_GCR_BYPASS))
+  {
+    dbg("%s: core not running (GCR = 0x%x)\n", __FUNCTION__, gcr);
+    return -1;
+  }
+
+  if(fd_readl(FD_REG_ADSFR) != hw->calib.adsfr_val)
+  {
+    dbg("%s: timestamper not configured with the card's calibration\n", __FUNCTION__);
+    return -1;
+  }
+
+  if(!(ad9516_read_reg(dev, 0x1f) & 1))
+  {
+    dbg("%s: AD9516 PLL not locked\n", __FUNCTION__);
+    return -1;
+  }
+
+  for(channel = 1; channel <= 4; channel++)
+  {
+    uint32_t frr = chan_readl(FD_REG_FRR);
+
+    if(frr == 0 || frr >= FDELAY_NUM_TAPS)
+    {
+      dbg("%s: CH%d: delay line not calibrated (FRR = %d)\n", __FUNCTION__, channel, frr);
+      return -1;
+    }
+    hw->frr_cur[channel-1] = frr;
+  }
+
+  if(ds18x_attach(dev) < 0)
+  {
+    dbg("%s: DS18x sensor not detected\n", __FUNCTION__);
+    return -1;
+  }
+
+  /* The sensor keeps the result of the last conversion done by the previous owner of the card:
+     a single scratchpad read picks it up and starts the next conversion */
+  if(ds18x_read_temp(dev, &temp) == 0)
+  {
+    hw->board_temp = temp;
+    for(channel = 1; channel <= 4; channel++)
+      hw->frr_offset[channel-1] = hw->frr_cur[channel-1] - eval_poly(hw->calib.frr_poly, temp);
+  }
+
+  /* We don't know what the previous owner did to the ACAM/GPIO expander - a mode switch has to start from scratch */
+  hw->acam_addr = 0xff;
+  hw->acam_addr_out = 0;
+  hw->acam_regs_valid = 0;
+  hw->sgpio_olat_valid = 0;
+
+  dbg("%s: reattached to a running card in %lld us\n", __FUNCTION__, (long long) (get_tics() - start_tics));
+  return 0;
+}
+
+/*
+-------------------------------------
+             Public API
+-------------------------------------
+*/
+
+/* Initialize & self-calibrate the Fine Delay card */
+int fdelay_init(fdelay_device_t *dev, int init_flags)
+{
+  struct fine_delay_hw *hw;
+  struct phase_mark m_total;
+  int i;
+
+  fd_log_init();
+  dbg("Init: dev %p\n", dev);
+
+  if((init_flags & FDELAY_RESUME_INIT) && dev->priv_fd)
+  {
+    hw = (struct fine_delay_hw *) dev->priv_fd;
+    dbg("%s: Resuming initialization after stage '%s'\n", __FUNCTION__,
+        hw->init_stage ? init_stages[hw->init_stage - 1].name : "none");
+  } else {
+    hw = (struct fine_delay_hw *) calloc(1, sizeof(struct fine_delay_hw));
+    if(! hw)
+      return -1;
+
+    dev->priv_fd = (void *) hw;
+
+    hw->raw_mode = init_flags & FDELAY_RAW_READOUT ? 1 : 0;
+    hw->do_long_tests = init_flags & FDELAY_PERFORM_LONG_TESTS ? 1 : 0;
+    hw->base_addr = dev->base_addr;
+    hw->base_i2c = 0x100;
+    hw->base_onewire = dev->base_addr + 0x500;
+    hw->wr_enabled = 0;
+    hw->wr_state = FDELAY_FREE_RUNNING;
+    hw->acam_addr = 0xff;
+    hw->acam_bin_req = ACAM_DEFAULT_BIN;
+    hw->acam_addr_out = 0;
+    hw->acam_regs_valid = 0;
+    hw->input_user_offset = 0;
+    hw->output_user_offset= 0;
+    hw->init_stage = FDELAY_INIT_NONE;
+
+    for(i = 0; i < FDELAY_NUM_PHASES; i++)
+      hw->profile.phases[i].name = phase_names[i];
+
+    if(getenv("FDELAY_BUS_STATS"))
+      fdelay_bus_stats_enable(dev, 1);
+
+    if(getenv("FDELAY_BUS_TRACE"))
+      fdelay_bus_trace_enable(dev, FD_TRACE_DEFAULT_ENTRIES);
+  }
+
+  phase_begin(hw, &m_total);
+
+  fd_info("%s: Initializing the Fine Delay Card\n", __FUNCTION__);
+
+  if((init_flags & FDELAY_WARM_ATTACH) && hw->init_stage == FDELAY_INIT_NONE)
+  {
+    if(init_run_stage(dev, 0) < 0)
+    {
+      phase_end(hw, FDELAY_PHASE_TOTAL, &m_total);
+      return -1;
+    }
+    hw->init_stage = FDELAY_INIT_DETECTED;
+
+    if(fd_warm_attach(dev) == 0)
+    {
+      hw->init_stage = FDELAY_INIT_READY;
+      phase_end(hw, FDELAY_PHASE_TOTAL, &m_total);
+      fd_info("FD initialized (warm attach)\n");
+      return 0;
+    }
+
+    fd_warn("%s: warm attach not possible, doing a full initialization\n", __FUNCTION__);
+  }
+
+  while(hw->init_stage < FDELAY_INIT_READY)
+  {
+    if(init_run_stage(dev, hw->init_stage) < 0)
+    {
+      fd_err("%s: initialization failed at stage '%s'\n", __FUNCTION__, init_stages[hw->init_stage].name);
+      if(hw->bus_trace && getenv("FDELAY_BUS_TRACE"))
+        fdelay_bus_trace_save(dev, getenv("FDELAY_BUS_TRACE"));
+      phase_end(hw, FDELAY_PHASE_TOTAL, &m_total);
+      return -1;
+    }
+    hw->init_stage++;
+  }
+
+  phase_end(hw, FDELAY_PHASE_TOTAL, &m_total);
+
+  for(i = 0; i < FDELAY_NUM_PHASES; i++)
+  {
+    struct fdelay_phase_stats *ph = &hw->profile.phases[i];
+    if(ph->count)
+      fd_info("%s: phase %-10s: %8lld us, %7llu reads, %7llu writes\n", __FUNCTION__, ph->name,
+          (long long) ph->time_us, (unsigned long long) ph->bus_reads, (unsigned long long) ph->bus_writes);
+  }
+
+  fd_info("%s: ACAM PLL lock waits took %lld ms in total, %d PLL restart(s) skipped (%d ms saved)\n", __FUNCTION__,
+      hw->acam_lock_time / 1000LL, hw->acam_restarts_skipped, hw->acam_restarts_skipped * 1000);
+
+  fd_info("FD initialized\n");
+  return 0;
+}
+
+int fdelay_get_init_profile(fdelay_device_t *dev, struct fdelay_init_profile *prof)
+{
+  fd_decl_private(dev)
+
+  if(!hw)
+    return -1;
+
+  memcpy(prof, &hw->profile, sizeof(struct fdelay_init_profile));
+  return 0;
+}
+
+/* Returns the last completed initialization stage (FDELAY_INIT_xxx) */
+int fdelay_init_status(fdelay_device_t *dev)
+{
+  fd_decl_private(dev)
+
+  if(!hw)
+    return FDELAY_INIT_NONE;
+
+  return hw->init_stage;
+}
+
 /* Configures the trigger input. Enable enables the input, termination selects the impedance
    of the trigger input (0 == 2kohm, 1 = 50 ohm) */
 int fdelay_configure_trigger(fdelay_device_t *dev, int enable, int termination)
@@ -1131,64 +1661,51 @@ int fdelay_configure_trigger(fdelay_device_t *dev, int enable, int termination)
 	return 0;
 }
 
-/* Converts a positive time interval expressed in picoseconds to the timestamp format used in the Fine Delay core */
-fdelay_time_t fdelay_from_picos(const uint64_t ps)
+/* Division-free picosecond conversion. All divisions by constants are done by multiplying
+   with a rounded-up reciprocal ("magic number") and shifting, with the parameters chosen so
+   that the result is exact over the whole input range (Granlund & Montgomery, 1994):
+
+   ps / 8000 = (ps >> 6) / 125; (ps >> 6) < 2^58, so q = ((ps >> 6) * ceil(2^65 / 125)) >> 65.
+   cycles / 125000000 = (cycles >> 6) / 1953125; (cycles >> 6) < 2^45, so
+   q = ((cycles >> 6) * ceil(2^66 / 1953125)) >> 66.
+   frac = rem * 4096 / 8000 = (rem * 64) / 125; rem * 64 < 2^19, so q = (rem * 64 * ceil(2^26 / 125)) >> 26. */
+
+#define PS_DIV8000_MAGIC	0x4189374bc6a7efaULL	/* ceil(2^65 / 125) */
+#define CYC_DIV125M_MAGIC	0x225c17d04daeULL	/* ceil(2^66 / 1953125) */
+#define FRAC_DIV125_MAGIC	536871ULL		/* ceil(2^26 / 125) */
+
+static inline fdelay_time_t from_picos_kernel(uint64_t ps)
 {
 	fdelay_time_t t;
-	uint64_t tmp = ps;
+	uint64_t cycles, utc;
+	uint32_t rem;
 
-	
-	t.frac = (tmp % 8000ULL) * (uint64_t)(1<<FDELAY_FRAC_BITS) / 8000ULL;
-	tmp -= (tmp % 8000ULL);
-	tmp /= 8000ULL;
-	t.coarse = tmp % 125000000ULL;
-	tmp -= (tmp % 125000000ULL);
-	tmp /= 125000000ULL;
-	t.utc = tmp;
+	cycles = (uint64_t) (((unsigned __int128) (ps >> 6) * PS_DIV8000_MAGIC) >> 65);
+	rem = (uint32_t) (ps - cycles * 8000ULL);
+	utc = (uint64_t) (((unsigned __int128) (cycles >> 6) * CYC_DIV125M_MAGIC) >> 66);
+
+	t.frac = (int32_t) (((uint64_t) rem * 64ULL * FRAC_DIV125_MAGIC) >> 26);
+	t.coarse = (int32_t) (cycles - utc * 125000000ULL);
+	t.utc = (int64_t) utc;
 
 	return t;
 }
 
-/* Substract two timestamps */
-static fdelay_time_t ts_sub(fdelay_time_t a, fdelay_time_t b)
+/* Converts a positive time interval expressed in picoseconds to the timestamp format used in the Fine Delay core */
+fdelay_time_t fdelay_from_picos(const uint64_t ps)
 {
- 	a.frac -= b.frac;
- 	if(a.frac < 0)
- 	{
- 	 	a.frac += 4096;
- 	 	a.coarse--;
- 	}
- 	a.coarse -= b.coarse;
- 	if(a.coarse < 0)
- 	{
- 	 	a.coarse += 125000000;
- 	 	a.utc --;
- 	}
- 	return a;
+	return from_picos_kernel(ps);
 }
 
-
-/* Add two timestamps */
-static fdelay_time_t ts_add(fdelay_time_t a, fdelay_time_t b)
+/* Batch version of fdelay_from_picos(): converts (n) values from (ps) into (t) */
+void fdelay_from_picos_batch(const uint64_t *ps, fdelay_time_t *t, int n)
 {
+	int i;
 
- 	a.frac += b.frac;
- 	if(a.frac >= (1<<FDELAY_FRAC_BITS))
- 	{
- 	 	a.frac -= (1<<FDELAY_FRAC_BITS);
- 	 	a.coarse++;
- 	}
- 	a.coarse += b.coarse;
- 	if(a.coarse >= 125000000)
- 	{
- 	 	a.coarse -= 125000000;
- 	 	a.utc ++;
- 	}
- 	return a;
+	for(i = 0; i < n; i++)
+		t[i] = from_picos_kernel(ps[i]);
 }
 
-
-
 /* Converts a Fine Delay time stamp to plain picoseconds */
 int64_t fdelay_to_picos(const fdelay_time_t t)
 {
@@ -1196,12 +1713,13 @@ int64_t fdelay_to_picos(const fdelay_time_t t)
 	return tp;
 }
 
-static fdelay_time_t ts_add_ps(fdelay_time_t a, int64_t b)
+/* Batch version of fdelay_to_picos(): converts (n) timestamps from (t) into (ps) */
+void fdelay_to_picos_batch(const fdelay_time_t *t, int64_t *ps, int n)
 {
-	if(b < 0)
-		return ts_sub(a, fdelay_from_picos(-b));
-	else
-		return ts_add(a, fdelay_from_picos(b));
+	int i;
+
+	for(i = 0; i < n; i++)
+		ps[i] = (((int64_t)t[i].frac * 8000LL) >> FDELAY_FRAC_BITS) + ((int64_t) t[i].coarse * 8000LL) + ((int64_t)t[i].utc * 1000000000000LL);
 }
 
 static int poll_rbuf(fdelay_device_t *dev, uint32_t *o_tsbcr)
@@ -1351,7 +1869,7 @@ int fdelay_read(fdelay_device_t *dev, fdelay_time_t *timestamps, int how_many)
 //		ts.channel = FD_TSBR_FID_CHANNEL_R(seq_frac);
     	}
     	
-		*timestamps++ = ts_add_ps(ts_normalize(ts), hw->input_user_offset);
+		*timestamps++ = fdelay_ts_add_ps(ts_normalize(ts), hw->input_user_offset);
 
 		how_many--;
 		n_read++;
@@ -1380,26 +1898,26 @@ int fdelay_configure_output(fdelay_device_t *dev, int channel, int enable, int64
  
 
 
- 	printf("Start: %lld: %d:%d rep %d\n", start.utc, start.coarse, start.frac, rep_count);
- 	printf("DelayPs: %lld\n", delay_ps);
+ 	dbg("Start: %lld: %d:%d rep %d\n", (long long) start.utc, start.coarse, start.frac, rep_count);
+ 	dbg("DelayPs: %lld\n", (long long) delay_ps);
 
 
- 	chan_writel(hw->frr_cur[channel-1],  FD_REG_FRR);
- 	chan_writel(start.utc >> 32, FD_REG_U_STARTH);
- 	chan_writel(start.utc & 0xffffffff, FD_REG_U_STARTL);
- 	chan_writel(start.coarse, FD_REG_C_START);
- 	chan_writel(start.frac, FD_REG_F_START);
- 	chan_writel(end.utc >> 32,  FD_REG_U_ENDH);
- 	chan_writel(end.utc & 0xffffffff,  FD_REG_U_ENDL);
- 	chan_writel(end.coarse, FD_REG_C_END);
- 	chan_writel(end.frac, FD_REG_F_END);
+ 	chan_shadow_writel(dev, channel, hw->frr_cur[channel-1],  FD_REG_FRR);
+ 	chan_shadow_writel(dev, channel, start.utc >> 32, FD_REG_U_STARTH);
+ 	chan_shadow_writel(dev, channel, start.utc & 0xffffffff, FD_REG_U_STARTL);
+ 	chan_shadow_writel(dev, channel, start.coarse, FD_REG_C_START);
+ 	chan_shadow_writel(dev, channel, start.frac, FD_REG_F_START);
+ 	chan_shadow_writel(dev, channel, end.utc >> 32,  FD_REG_U_ENDH);
+ 	chan_shadow_writel(dev, channel, end.utc & 0xffffffff,  FD_REG_U_ENDL);
+ 	chan_shadow_writel(dev, channel, end.coarse, FD_REG_C_END);
+ 	chan_shadow_writel(dev, channel, end.frac, FD_REG_F_END);
 
- 	chan_writel(delta.utc & 0xf,  FD_REG_U_DELTA);
- 	chan_writel(delta.coarse, FD_REG_C_DELTA);
- 	chan_writel(delta.frac, FD_REG_F_DELTA);
+ 	chan_shadow_writel(dev, channel, delta.utc & 0xf,  FD_REG_U_DELTA);
+ 	chan_shadow_writel(dev, channel, delta.coarse, FD_REG_C_DELTA);
+ 	chan_shadow_writel(dev, channel, delta.frac, FD_REG_F_DELTA);
 
-// 	chan_writel(0, FD_REG_RCR);
- 	chan_writel(FD_RCR_REP_CNT_W(rep_count-1) | (rep_count < 0 ? FD_RCR_CONT : 0), FD_REG_RCR);
+// 	chan_shadow_writel(dev, channel, 0, FD_REG_RCR);
+ 	chan_shadow_writel(dev, channel, FD_RCR_REP_CNT_W(rep_count-1) | (rep_count < 0 ? FD_RCR_CONT : 0), FD_REG_RCR);
 
         dcr = 0;
         
@@ -1410,6 +1928,9 @@ int fdelay_configure_output(fdelay_device_t *dev, int channel, int enable, int64
 
  	chan_writel(dcr | FD_DCR_UPDATE, FD_REG_DCR);
  	chan_writel(dcr | FD_DCR_ENABLE, FD_REG_DCR);
+ 	hw->chan_shadow[channel-1].regs[0] = dcr | FD_DCR_ENABLE;
+ 	hw->chan_shadow[channel-1].valid |= 1;
+ 	hw->pg_start_valid &= ~(1 << (channel-1));
 
  	sgpio_set_pin(dev, SGPIO_OUTPUT_EN(channel), enable ? 1 : 0);
 
@@ -1418,47 +1939,39 @@ int fdelay_configure_output(fdelay_device_t *dev, int channel, int enable, int64
 
 
 
-/* Configures the output channel (channel) to produce pulses delayed from the trigger by (delay_ps).
-   The output pulse width is proviced in (width_ps) parameter. */
-int fdelay_configure_pulse_gen(fdelay_device_t *dev, int channel, int enable, fdelay_time_t t_start, int64_t width_ps, int64_t delta_ps, int rep_count)
+/* Loads the pulse generator of (channel) with a new configuration. The channel registers are
+   written through their shadow, so when only the start time changes, only the start/end registers
+   that differ are written, followed by the DCR update sequence. Returns the DCR value arming the channel. */
+static uint32_t pg_load(fdelay_device_t *dev, int channel, fdelay_time_t t_start, int64_t width_ps, int64_t delta_ps, int rep_count)
 {
 	fd_decl_private(dev)
+	struct fd_chan_shadow *sh = &hw->chan_shadow[channel-1];
  	uint32_t dcr;
  	fdelay_time_t start, end, delta;
+ 	int changed = 0;
 
- 	if(channel < 1 || channel > 4)
- 		return -1;
-
- 	start = ts_add_ps(t_start, hw->output_user_offset);
- 	end = ts_add_ps(t_start, hw->output_user_offset + width_ps - 4000);
+ 	start = fdelay_ts_add_ps(t_start, hw->output_user_offset);
+ 	end = fdelay_ts_add_ps(t_start, hw->output_user_offset + width_ps - 4000);
     delta = fdelay_from_picos(delta_ps);
 
+ 	hw->pg_start[channel-1] = start;
+ 	hw->pg_start_valid |= (1 << (channel-1));
 
-#if 0
- 	printf("Channel: %d\n",channel);
- 	printf("TStart: %d: %d:%d rep %d\n", t_start.utc, t_start.coarse, t_start.frac, rep_count);
- 	printf("Start: %d: %d:%d rep %d\n", start.utc, start.coarse, start.frac, rep_count);
- 	printf("End: %d: %d:%d rep %d\n", end.utc, end.coarse, end.frac, rep_count);
- 	printf("Delta: %d: %d:%d rep %d\n", delta.utc, delta.coarse, delta.frac, rep_count);
-#endif
-	
+ 	changed += chan_shadow_writel(dev, channel, hw->frr_cur[channel-1],  FD_REG_FRR);
+ 	changed += chan_shadow_writel(dev, channel, 0, FD_REG_U_STARTH);
+ 	changed += chan_shadow_writel(dev, channel, start.utc & 0xffffffff, FD_REG_U_STARTL);
+ 	changed += chan_shadow_writel(dev, channel, start.coarse, FD_REG_C_START);
+ 	changed += chan_shadow_writel(dev, channel, start.frac, FD_REG_F_START);
+ 	changed += chan_shadow_writel(dev, channel, 0,  FD_REG_U_ENDH);
+ 	changed += chan_shadow_writel(dev, channel, end.utc & 0xffffffff,  FD_REG_U_ENDL);
+ 	changed += chan_shadow_writel(dev, channel, end.coarse, FD_REG_C_END);
+ 	changed += chan_shadow_writel(dev, channel, end.frac, FD_REG_F_END);
 
- 	chan_writel(hw->frr_cur[channel-1],  FD_REG_FRR);
- 	chan_writel(0, FD_REG_U_STARTH);
- 	chan_writel(start.utc & 0xffffffff, FD_REG_U_STARTL);
- 	chan_writel(start.coarse, FD_REG_C_START);
- 	chan_writel(start.frac, FD_REG_F_START);
- 	chan_writel(0,  FD_REG_U_ENDH);
- 	chan_writel(end.utc & 0xffffffff,  FD_REG_U_ENDL);
- 	chan_writel(end.coarse, FD_REG_C_END);
- 	chan_writel(end.frac, FD_REG_F_END);
+ 	changed += chan_shadow_writel(dev, channel, delta.utc & 0xf,  FD_REG_U_DELTA);
+ 	changed += chan_shadow_writel(dev, channel, delta.coarse, FD_REG_C_DELTA);
+ 	changed += chan_shadow_writel(dev, channel, delta.frac, FD_REG_F_DELTA);
 
- 	chan_writel(delta.utc & 0xf,  FD_REG_U_DELTA);
- 	chan_writel(delta.coarse, FD_REG_C_DELTA);
- 	chan_writel(delta.frac, FD_REG_F_DELTA);
-
-// 	chan_writel(0, FD_REG_RCR);
- 	chan_writel(FD_RCR_REP_CNT_W(rep_count < 0 ? 0 :rep_count-1) | (rep_count < 0 ? FD_RCR_CONT : 0), FD_REG_RCR);
+ 	changed += chan_shadow_writel(dev, channel, FD_RCR_REP_CNT_W(rep_count < 0 ? 0 :rep_count-1) | (rep_count < 0 ? FD_RCR_CONT : 0), FD_REG_RCR);
 
     dcr = FD_DCR_MODE;
         
@@ -1467,15 +1980,100 @@ int fdelay_configure_pulse_gen(fdelay_device_t *dev, int channel, int enable, fd
     if((delta_ps - width_ps) < 200000 || (width_ps < 200000))
         dcr |= FD_DCR_NO_FINE;
 
- 	chan_writel(dcr | FD_DCR_UPDATE, FD_REG_DCR);
- 	chan_writel(dcr | FD_DCR_ENABLE, FD_REG_DCR);
- 	chan_writel(dcr | FD_DCR_ENABLE | FD_DCR_PG_ARM, FD_REG_DCR);
+	/* The UPDATE strobe transfers the new timing to the pulse generator. With nothing changed,
+	   re-arming the enabled channel is enough. */
+	if(changed || !(sh->valid & 1) || sh->regs[0] != (dcr | FD_DCR_ENABLE))
+	{
+ 		chan_writel(dcr | FD_DCR_UPDATE, FD_REG_DCR);
+ 		chan_writel(dcr | FD_DCR_ENABLE, FD_REG_DCR);
+ 		sh->regs[0] = dcr | FD_DCR_ENABLE;
+ 		sh->valid |= 1;
+ 	}
+
+ 	return dcr | FD_DCR_ENABLE | FD_DCR_PG_ARM;
+}
+
+/* Configures the output channel (channel) to produce pulses delayed from the trigger by (delay_ps).
+   The output pulse width is proviced in (width_ps) parameter. */
+int fdelay_configure_pulse_gen(fdelay_device_t *dev, int channel, int enable, fdelay_time_t t_start, int64_t width_ps, int64_t delta_ps, int rep_count)
+{
+	fd_decl_private(dev)
+ 	uint32_t arm;
+
+ 	if(channel < 1 || channel > 4)
+ 		return -1;
+
+ 	arm = pg_load(dev, channel, t_start, width_ps, delta_ps, rep_count);
+ 	chan_writel(arm, FD_REG_DCR);
 
  	sgpio_set_pin(dev, SGPIO_OUTPUT_EN(channel), enable ? 1 : 0);
 
  	return 0;
 }
 
+int fdelay_stage_pulse_gen(fdelay_device_t *dev, int channel_mask, int enable, fdelay_time_t t_start, int64_t width_ps, int64_t delta_ps, int rep_count)
+{
+	fd_decl_private(dev)
+	int channel;
+
+	if(!channel_mask || (channel_mask & ~0xf))
+		return -1;
+
+	for(channel = 1; channel <= 4; channel++)
+	{
+		struct fd_pg_config *cfg = &hw->pg_staged[channel-1];
+
+		if(!(channel_mask & (1 << (channel-1))))
+			continue;
+
+		cfg->enable = enable;
+		cfg->start = t_start;
+		cfg->width_ps = width_ps;
+		cfg->delta_ps = delta_ps;
+		cfg->rep_count = rep_count;
+	}
+
+	hw->pg_staged_mask |= channel_mask;
+	return 0;
+}
+
+int fdelay_commit_pulse_gen(fdelay_device_t *dev, int channel_mask)
+{
+	fd_decl_private(dev)
+	uint32_t arm[4];
+	int channel, en_mask = 0, dis_mask = 0;
+
+	channel_mask &= hw->pg_staged_mask;
+
+	/* Load all the channels first and arm them afterwards, back to back */
+	for(channel = 1; channel <= 4; channel++)
+	{
+		struct fd_pg_config *cfg = &hw->pg_staged[channel-1];
+
+		if(!(channel_mask & (1 << (channel-1))))
+			continue;
+
+		arm[channel-1] = pg_load(dev, channel, cfg->start, cfg->width_ps, cfg->delta_ps, cfg->rep_count);
+		if(cfg->enable)
+			en_mask |= SGPIO_OUTPUT_EN(channel);
+		else
+			dis_mask |= SGPIO_OUTPUT_EN(channel);
+	}
+
+	for(channel = 1; channel <= 4; channel++)
+		if(channel_mask & (1 << (channel-1)))
+			chan_writel(arm[channel-1], FD_REG_DCR);
+
+	/* The output enables share a GPIO expander port - one SPI write for all of them */
+	if(en_mask)
+		sgpio_set_pin(dev, en_mask, 1);
+	if(dis_mask)
+		sgpio_set_pin(dev, dis_mask, 0);
+
+	hw->pg_staged_mask &= ~channel_mask;
+	return channel_mask;
+}
+
 int fdelay_channel_triggered(fdelay_device_t *dev, int channel)
 {
 	fd_decl_private(dev)
@@ -1484,6 +2082,161 @@ int fdelay_channel_triggered(fdelay_device_t *dev, int channel)
     return dcr & FD_DCR_PG_TRIG ? 1: 0;
 }
 
+int fdelay_outputs_triggered(fdelay_device_t *dev, int channel_mask, int blocking)
+{
+	fdelay_wait_t w;
+	int channel;
+
+	if(!channel_mask || (channel_mask & ~0xf))
+		return -1;
+
+	if(blocking)
+	{
+		w.dev = dev;
+		w.channel_mask = channel_mask;
+		return fdelay_wait_outputs(&w, 1, FDELAY_WAIT_ALL, -1);
+	}
+
+	for(channel = 1; channel <= 4; channel++)
+		if((channel_mask & (1 << (channel-1))) && !fdelay_channel_triggered(dev, channel))
+			return 0;
+
+	return 1;
+}
+
+/* The wait sleeps until shortly before the earliest pulse is due and spins (without touching
+   the bus) for the rest, to absorb the wakeup latency of the host. The margin is twice the average
+   oversleep of usleep() seen so far by the waits on the (first) device, within these bounds. */
+#define WAIT_GUARD_MIN_NS	20000ULL
+#define WAIT_GUARD_MAX_NS	2000000ULL
+
+/* Oversleep assumed before the first measurement */
+#define WAIT_OVERSLEEP_INIT_NS	50000ULL
+
+/* Poll interval for outputs which are due but haven't triggered yet (grows exponentially) */
+#define WAIT_POLL_MIN_NS	2000ULL
+#define WAIT_POLL_MAX_NS	1000000ULL
+
+/* Computes the host time at which each output of (w) is due, from the programmed start
+   times and a single readout of the card time */
+static void wait_compute_deadlines(fdelay_wait_t *w)
+{
+	struct fine_delay_hw *hw = (struct fine_delay_hw *) w->dev->priv_fd;
+	fdelay_time_t now;
+	uint64_t host;
+	int channel;
+
+	host = fd_bus_stats_now();
+	fdelay_get_time(w->dev, &now);
+	host = (host + fd_bus_stats_now()) / 2;
+
+	for(channel = 1; channel <= 4; channel++)
+	{
+		int64_t lead_ps;
+
+		w->due_ns[channel-1] = host;
+		if(!(hw->pg_start_valid & (1 << (channel-1))))
+			continue;
+
+		lead_ps = fdelay_to_picos(fdelay_ts_sub(hw->pg_start[channel-1], now));
+		if(lead_ps > 0)
+			w->due_ns[channel-1] = host + lead_ps / 1000;
+	}
+}
+
+int fdelay_wait_outputs(fdelay_wait_t *w, int n, int mode, int64_t timeout_us)
+{
+	struct fine_delay_hw *hw;
+	uint64_t start = fd_bus_stats_now(), now, next, guard;
+	uint64_t poll_ns = WAIT_POLL_MIN_NS;
+	int i, channel;
+
+	if(n <= 0)
+		return 1;
+
+	hw = (struct fine_delay_hw *) w[0].dev->priv_fd;
+	if(!hw->wait_oversleep_ns)
+		hw->wait_oversleep_ns = WAIT_OVERSLEEP_INIT_NS;
+
+	for(i = 0; i < n; i++)
+	{
+		w[i].triggered_mask = 0;
+		wait_compute_deadlines(&w[i]);
+	}
+
+	for(;;)
+	{
+		int polled = 0, all = 1, any = 0;
+
+		now = fd_bus_stats_now();
+		next = UINT64_MAX;
+
+		for(i = 0; i < n; i++)
+		{
+			for(channel = 1; channel <= 4; channel++)
+			{
+				int bit = 1 << (channel-1);
+
+				if(!(w[i].channel_mask & bit) || (w[i].triggered_mask & bit))
+					continue;
+
+				/* Don't touch the bus before the pulse is due */
+				if(now >= w[i].due_ns[channel-1])
+				{
+					if(fdelay_channel_triggered(w[i].dev, channel))
+					{
+						w[i].triggered_mask |= bit;
+						continue;
+					}
+					w[i].due_ns[channel-1] = now + poll_ns;
+					polled = 1;
+				}
+
+				if(w[i].due_ns[channel-1] < next)
+					next = w[i].due_ns[channel-1];
+			}
+
+			if(w[i].triggered_mask)
+				any = 1;
+			if(w[i].triggered_mask != w[i].channel_mask)
+				all = 0;
+		}
+
+		if(all || (mode == FDELAY_WAIT_ANY && any))
+			return 1;
+
+		now = fd_bus_stats_now();
+		if(timeout_us >= 0 && now - start >= (uint64_t) timeout_us * 1000ULL)
+			return 0;
+
+		if(polled && poll_ns < WAIT_POLL_MAX_NS)
+			poll_ns *= 2;
+
+		if(timeout_us >= 0 && next > start + (uint64_t) timeout_us * 1000ULL)
+			next = start + (uint64_t) timeout_us * 1000ULL;
+
+		guard = 2 * hw->wait_oversleep_ns;
+		if(guard < WAIT_GUARD_MIN_NS)
+			guard = WAIT_GUARD_MIN_NS;
+		if(guard > WAIT_GUARD_MAX_NS)
+			guard = WAIT_GUARD_MAX_NS;
+
+		if(next > now + guard + 1000)
+		{
+			uint64_t req = (next - now - guard) / 1000 * 1000, elapsed;
+
+			usleep(req / 1000);
+			elapsed = fd_bus_stats_now() - now;
+
+			/* A sleep cut short by a signal says nothing about the oversleep */
+			if(elapsed >= req)
+				hw->wait_oversleep_ns = (7 * hw->wait_oversleep_ns + (elapsed - req)) / 8;
+		}
+
+		while(fd_bus_stats_now() < next);
+	}
+}
+
 /* Todo: write get_time() */
 int fdelay_set_time(fdelay_device_t *dev, const fdelay_time_t t)
 {
@@ -1514,6 +2267,7 @@ int fdelay_get_time(fdelay_device_t *dev, fdelay_time_t *t)
     fd_writel(tcr | FD_TCR_CAP_TIME, FD_REG_TCR);
     t->utc = fd_readl(FD_REG_TM_SECL);
     t->coarse = fd_readl(FD_REG_TM_CYCLES);
+    t->frac = 0;
 //    printf("GetTime: %d %d\n", t->utc, t->coarse);
     return 0;
 }
@@ -1523,12 +2277,12 @@ void fdelay_set_user_offset(fdelay_device_t *dev,int input, int64_t offset)
 	fd_decl_private(dev)
  	if(input)
  	{
- 		dbg("SetUserInputOffset %lld ps \n", offset);
+ 		dbg("SetUserInputOffset %lld ps \n", (long long) offset);
  		hw->input_user_offset=  offset;
  	}
  	else
  	{
- 		dbg("SetUserOutputOffset %lld ps \n", offset);
+ 		dbg("SetUserOutputOffset %lld ps \n", (long long) offset);
  		hw->output_user_offset=  offset;
 	}
 }
@@ -1550,6 +2304,23 @@ int fdelay_configure_sync(fdelay_device_t *dev, int mode)
 	 	fd_writel(FD_TCR_WR_ENABLE, FD_REG_TCR);
 	 	hw->wr_enabled = 1;
 	}
+
+	return 0;
+}
+
+/* Unlike fdelay_configure_sync(), leaves GCR (the trigger input) alone, so that the card keeps
+   time tagging on its local oscillator while it relocks */
+int fdelay_wr_resync(fdelay_device_t *dev)
+{
+	fd_decl_private(dev)
+
+	fd_writel(FD_EIC_ISR_SYNC_STATUS, FD_REG_EIC_ISR);
+	fd_writel(0, FD_REG_TCR);
+	fd_writel(FD_TCR_WR_ENABLE, FD_REG_TCR);
+	hw->wr_enabled = 1;
+	fd_info("%s: WR sync lost, relocking\n", __FUNCTION__);
+
+	return 0;
 }
 
 int fdelay_check_sync(fdelay_device_t *dev)
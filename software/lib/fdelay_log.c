@@ -0,0 +1,135 @@
+/*
+	FmcDelay1ns4Cha (a.k.a. The Fine Delay Card)
+	User-space driver/library
+
+	Logging: messages go to an in-memory trace ring (lock-free, so it can be
+	written from the control path and from several threads) and, above a
+	separate level, to stderr.
+
+	(c) Copyright CERN 2012
+	Licensed under LGPL 2.1
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "fdelay_lib.h"
+#include "fdelay_private.h"
+
+/* Number of entries of the trace ring (power of 2) and the maximum message length */
+#define LOG_RING_SIZE	1024
+#define LOG_MSG_LEN	120
+
+struct log_entry {
+	uint64_t seq;			/* index of the message + 1, 0 while being written */
+	uint64_t ns;
+	int level;
+	char msg[LOG_MSG_LEN];
+};
+
+static struct log_entry log_ring[LOG_RING_SIZE];
+static uint64_t log_head;
+
+static int log_trace_level = FDELAY_LOG_INFO;
+static int log_console_level = FDELAY_LOG_WARN;
+
+/* The higher of the two levels above - the only thing the fd_log() macro checks */
+int fd_log_level = FDELAY_LOG_INFO;
+
+static const char *level_names[] = { "err", "warn", "info", "debug" };
+
+void fdelay_set_log_level(int trace_level, int console_level)
+{
+	log_trace_level = trace_level;
+	log_console_level = console_level;
+	fd_log_level = trace_level > console_level ? trace_level : console_level;
+}
+
+/* Sets the console level from FDELAY_LOG_LEVEL (a number or a level name), if it's defined.
+   Only the first call does anything, so that fdelay_set_log_level() isn't overridden by
+   initializing another card. */
+void fd_log_init()
+{
+	static int done = 0;
+	const char *env = getenv("FDELAY_LOG_LEVEL");
+	int i;
+
+	if(done || !env)
+		return;
+	done = 1;
+
+	for(i = 0; i <= FDELAY_LOG_DEBUG; i++)
+		if(!strcmp(env, level_names[i]))
+			break;
+
+	if(i > FDELAY_LOG_DEBUG)
+		i = atoi(env);
+
+	fdelay_set_log_level(i > log_trace_level ? i : log_trace_level, i);
+}
+
+void fd_log_write(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	if(level <= log_trace_level)
+	{
+		uint64_t idx = __atomic_fetch_add(&log_head, 1, __ATOMIC_RELAXED);
+		struct log_entry *e = &log_ring[idx & (LOG_RING_SIZE - 1)];
+		int len;
+
+		__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		e->ns = fd_bus_stats_now();
+		e->level = level;
+		va_start(ap, fmt);
+		len = vsnprintf(e->msg, LOG_MSG_LEN, fmt, ap);
+		va_end(ap);
+
+		/* Messages are stored without the trailing newline */
+		if(len > LOG_MSG_LEN - 1)
+			len = LOG_MSG_LEN - 1;
+		if(len > 0 && e->msg[len - 1] == '\n')
+			e->msg[len - 1] = 0;
+
+		__atomic_store_n(&e->seq, idx + 1, __ATOMIC_RELEASE);
+	}
+
+	if(level <= log_console_level)
+	{
+		va_start(ap, fmt);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+	}
+}
+
+int fdelay_log_dump(FILE *f)
+{
+	uint64_t head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+	uint64_t idx = head > LOG_RING_SIZE ? head - LOG_RING_SIZE : 0;
+	struct log_entry e;
+	int n = 0;
+
+	for(; idx < head; idx++)
+	{
+		struct log_entry *src = &log_ring[idx & (LOG_RING_SIZE - 1)];
+
+		/* Skip the entries being written or already overwritten by newer messages */
+		if(__atomic_load_n(&src->seq, __ATOMIC_ACQUIRE) != idx + 1)
+			continue;
+		memcpy(&e, src, sizeof(e));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&src->seq, __ATOMIC_RELAXED) != idx + 1)
+			continue;
+
+		e.msg[LOG_MSG_LEN - 1] = 0;
+		fprintf(f, "%llu.%09llu %-5s %s\n", (unsigned long long) (e.ns / 1000000000ULL),
+			(unsigned long long) (e.ns % 1000000000ULL), level_names[e.level], e.msg);
+		n++;
+	}
+
+	return n;
+}
@@ -0,0 +1,270 @@
+/*
+	FmcDelay1ns4Cha (a.k.a. The Fine Delay Card)
+	User-space driver/library
+
+	Pulse train scheduler. Each output has a queue of pulses; the pulse generator
+	holds one of them at a time, so the next one is armed as soon as the previous
+	is out. fdelay_configure_pulse_gen() reprograms the channel by difference,
+	so re-arming with a new start time costs a handful of register writes.
+
+	(c) Copyright CERN 2012
+	Licensed under LGPL 2.1
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "fdelay_lib.h"
+#include "fdelay_private.h"
+#include "fdelay_sched.h"
+
+/* How often the card time is read back. In between, it's extrapolated with the host clock. */
+#define SCHED_RESYNC_NS		1000000ULL
+
+/* An armed pulse that didn't trigger this long after its start time is given up */
+#define SCHED_TRIG_TIMEOUT_PS	10000000000LL
+
+/* Longest sleep of fdelay_sched_run() between two scheduler passes */
+#define SCHED_WAIT_TIMEOUT_US	10000
+
+struct sched_channel {
+	fdelay_pulse_t *q;
+	int head, count;
+	int armed;			/* a pulse is programmed and waits to be generated */
+	fdelay_time_t armed_start;
+	fdelay_time_t last_queued;
+	fdelay_time_t first_done, last_done;
+	uint64_t service_ns;		/* total host time spent on this channel */
+	uint64_t detect_ps;		/* total time from the start of the pulses to their detection */
+	struct fdelay_sched_stats stats;
+};
+
+struct fdelay_sched {
+	fdelay_device_t *dev;
+	int queue_size;
+	int64_t setup_ps;
+	fdelay_time_t card_time;	/* last card time read back */
+	uint64_t card_time_host;	/* host time (ns) at which it was read */
+	int card_time_valid;
+	struct sched_channel ch[4];
+};
+
+struct fdelay_sched *fdelay_sched_create(fdelay_device_t *dev, int queue_size, int64_t setup_ps)
+{
+	struct fdelay_sched *s;
+	int i;
+
+	if(queue_size <= 0)
+		return NULL;
+
+	s = (struct fdelay_sched *) calloc(1, sizeof(struct fdelay_sched));
+	if(!s)
+		return NULL;
+
+	s->dev = dev;
+	s->queue_size = queue_size;
+	s->setup_ps = setup_ps ? setup_ps : FDELAY_SCHED_DEFAULT_SETUP_PS;
+
+	for(i = 0; i < 4; i++)
+	{
+		s->ch[i].q = (fdelay_pulse_t *) malloc(queue_size * sizeof(fdelay_pulse_t));
+		if(!s->ch[i].q)
+		{
+			fdelay_sched_destroy(s);
+			return NULL;
+		}
+		s->ch[i].stats.min_lead_ps = INT64_MAX;
+	}
+
+	return s;
+}
+
+void fdelay_sched_destroy(struct fdelay_sched *s)
+{
+	int i;
+
+	if(!s)
+		return;
+
+	for(i = 0; i < 4; i++)
+		free(s->ch[i].q);
+	free(s);
+}
+
+int fdelay_sched_push(struct fdelay_sched *s, int channel, const fdelay_pulse_t *p, int n)
+{
+	struct sched_channel *c;
+	int i;
+
+	if(channel < 1 || channel > 4 || n < 0)
+		return -1;
+
+	c = &s->ch[channel-1];
+
+	for(i = 0; i < n && c->count < s->queue_size; i++)
+	{
+		if((c->count || c->stats.queued) && fdelay_ts_cmp(p[i].start, c->last_queued) <= 0)
+		{
+			fd_warn("%s: CH%d: pulses not sorted by start time\n", __FUNCTION__, channel);
+			return i ? i : -1;
+		}
+
+		c->q[(c->head + c->count) % s->queue_size] = p[i];
+		c->count++;
+		c->last_queued = p[i].start;
+		c->stats.queued++;
+	}
+
+	return i;
+}
+
+/* Returns the current card time: read from the card every SCHED_RESYNC_NS, extrapolated
+   with the host clock in between */
+static fdelay_time_t sched_card_time(struct fdelay_sched *s)
+{
+	uint64_t now = fd_bus_stats_now();
+
+	if(!s->card_time_valid || now - s->card_time_host >= SCHED_RESYNC_NS)
+	{
+		fdelay_get_time(s->dev, &s->card_time);
+		s->card_time_host = (now + fd_bus_stats_now()) / 2;
+		s->card_time_valid = 1;
+		return s->card_time;
+	}
+
+	return fdelay_ts_add_ps(s->card_time, (int64_t) (now - s->card_time_host) * 1000LL);
+}
+
+/* Collects the pulse armed on (channel), if it has been generated. */
+static void sched_check_done(struct fdelay_sched *s, int channel, fdelay_time_t now)
+{
+	struct sched_channel *c = &s->ch[channel-1];
+	uint64_t t;
+
+	/* Don't touch the bus before the pulse is due */
+	if(fdelay_ts_cmp(now, c->armed_start) < 0)
+		return;
+
+	t = fd_bus_stats_now();
+	if(fdelay_channel_triggered(s->dev, channel))
+	{
+		if(!c->stats.done)
+			c->first_done = c->armed_start;
+		c->last_done = c->armed_start;
+		c->detect_ps += fdelay_to_picos(fdelay_ts_sub(now, c->armed_start));
+		c->stats.done++;
+		c->armed = 0;
+	} else if(fdelay_to_picos(fdelay_ts_sub(now, c->armed_start)) > SCHED_TRIG_TIMEOUT_PS) {
+		fd_warn("%s: CH%d: pulse at %lld:%d never triggered\n", __FUNCTION__, channel,
+			(long long) c->armed_start.utc, c->armed_start.coarse);
+		c->stats.missed++;
+		c->armed = 0;
+	}
+	c->service_ns += fd_bus_stats_now() - t;
+}
+
+/* Arms the next pulse of an idle (channel), dropping the ones which are too late. */
+static void sched_arm_next(struct fdelay_sched *s, int channel, fdelay_time_t now)
+{
+	struct sched_channel *c = &s->ch[channel-1];
+	uint64_t t;
+
+	while(c->count)
+	{
+		fdelay_pulse_t *p = &c->q[c->head];
+		int64_t lead = fdelay_to_picos(fdelay_ts_sub(p->start, now));
+
+		c->head = (c->head + 1) % s->queue_size;
+		c->count--;
+
+		if(lead < s->setup_ps)
+		{
+			c->stats.missed++;
+			continue;
+		}
+
+		t = fd_bus_stats_now();
+		fdelay_configure_pulse_gen(s->dev, channel, 1, p->start, p->width_ps, 0, 1);
+		c->service_ns += fd_bus_stats_now() - t;
+
+		c->armed = 1;
+		c->armed_start = p->start;
+		c->stats.armed++;
+		if(lead < c->stats.min_lead_ps)
+			c->stats.min_lead_ps = lead;
+		return;
+	}
+}
+
+int fdelay_sched_poll(struct fdelay_sched *s)
+{
+	fdelay_time_t now;
+	int channel, pending = 0;
+
+	now = sched_card_time(s);
+
+	for(channel = 1; channel <= 4; channel++)
+	{
+		struct sched_channel *c = &s->ch[channel-1];
+
+		if(c->armed)
+			sched_check_done(s, channel, now);
+
+		if(!c->armed)
+			sched_arm_next(s, channel, now);
+
+		pending += c->count + c->armed;
+	}
+
+	return pending;
+}
+
+int fdelay_sched_run(struct fdelay_sched *s)
+{
+	fdelay_wait_t w;
+	int channel, missed = 0;
+
+	w.dev = s->dev;
+
+	while(fdelay_sched_poll(s) > 0)
+	{
+		/* Sleep until one of the armed pulses is out */
+		w.channel_mask = 0;
+		for(channel = 1; channel <= 4; channel++)
+			if(s->ch[channel-1].armed)
+				w.channel_mask |= (1 << (channel-1));
+
+		if(w.channel_mask)
+			fdelay_wait_outputs(&w, 1, FDELAY_WAIT_ANY, SCHED_WAIT_TIMEOUT_US);
+	}
+
+	for(channel = 0; channel < 4; channel++)
+		missed += s->ch[channel].stats.missed;
+
+	return missed;
+}
+
+int fdelay_sched_get_stats(struct fdelay_sched *s, int channel, struct fdelay_sched_stats *st)
+{
+	struct sched_channel *c;
+	int64_t span_ps;
+
+	if(channel < 1 || channel > 4)
+		return -1;
+
+	c = &s->ch[channel-1];
+	*st = c->stats;
+
+	if(!st->armed)
+		st->min_lead_ps = 0;
+
+	st->service_ns = st->armed ? c->service_ns / st->armed : 0;
+	st->detect_ns = st->done ? c->detect_ps / st->done / 1000 : 0;
+	st->max_rate_hz = st->done ? 1e12 / (double) (s->setup_ps + (st->detect_ns + st->service_ns) * 1000) : 0.0;
+
+	span_ps = fdelay_to_picos(fdelay_ts_sub(c->last_done, c->first_done));
+	st->rate_hz = (st->done > 1 && span_ps > 0) ? (double) (st->done - 1) * 1e12 / (double) span_ps : 0.0;
+
+	return 0;
+}
@@ -0,0 +1,914 @@
+/*
+	FmcDelay1ns4Cha (a.k.a. The Fine Delay Card)
+	User-space driver/library
+
+	Register-level simulator of the Fine Delay card. Sits behind the readl/writel
+	callbacks of fdelay_device_t and models the main and channel register maps,
+	the SPI peripherals (AD9516 PLL, MCP23S17 GPIO expander, VCXO DAC), the ACAM
+	TDC, the DS18x sensor on the 1-wire bus, the I2C calibration EEPROM and the
+	timestamp buffer - enough to run fdelay_init(), the output calibration,
+	output configuration and timestamp readout without the hardware.
+
+	(c) Copyright CERN 2012
+	Licensed under LGPL 2.1
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fdelay_lib.h"
+#include "fdelay_private.h"
+#include "fdelay_sim.h"
+#include "fd_main_regs.h"
+#include "fd_channel_regs.h"
+#include "acam_gpx.h"
+
+/* Sub-blocks of the simulated core's address space (relative to the core base) */
+#define SIM_CHAN_BASE		0x100
+#define SIM_CHAN_SIZE		0x100
+#define SIM_ONEWIRE_BASE	0x500
+
+/* 1-wire master registers/bits (see onewire.c) */
+#define OW_CSR_DAT	(1<<0)
+#define OW_CSR_RST	(1<<1)
+#define OW_CSR_CYC	(1<<3)
+
+#define OW_ROM_READ	0x33
+#define OW_ROM_MATCH	0x55
+#define OW_ROM_SKIP	0xCC
+#define OW_CONVERT_TEMP	0x44
+#define OW_READ_SCRATCHPAD 0xBE
+
+/* Timestamp buffer depth */
+#define SIM_TSB_SIZE	1024
+
+/* Simulated hardware: delay line tap size and fixed TDC start->stop delay of the calibration path */
+#define SIM_CAL_BASE_PS	20000.0
+static const double sim_tap_ps[4] = { 9.31, 9.27, 9.34, 9.24 };
+
+/* VCXO: nominal frequency and tuning range over the full DAC scale */
+#define SIM_VCXO_HZ	125000000.0
+#define SIM_VCXO_PPM	20.0
+
+enum { OW_IDLE, OW_ROM, OW_MATCH, OW_FUNC, OW_TX };
+enum { I2C_IDLE, I2C_RX, I2C_TX };
+
+struct sim_ts {
+	uint32_t sech, secl, cycles, fid;
+};
+
+struct fdelay_sim {
+	uint32_t base;
+	int read_ns, write_ns;
+
+	/* main register map */
+	uint32_t regs[0x100 / 4];
+
+	/* card time: value loaded with TCR.SET_TIME and the host time (ns) it was loaded at */
+	int64_t tm_utc, tm_coarse;
+	uint64_t tm_ref_ns;
+
+	/* SPI devices */
+	uint8_t pll_regs[0x300];
+	int pll_locked;
+	uint8_t mcp_regs[0x16];
+	uint16_t dac;
+
+	/* ACAM */
+	uint32_t acam_regs[16];
+	uint32_t tdr_in, tdr_out;
+	uint32_t acam_fifo1;
+
+	/* output channels */
+	struct {
+		uint32_t regs[SIM_CHAN_SIZE / 4];
+		int armed, triggered;
+	} ch[4];
+
+	/* timestamp buffer */
+	struct sim_ts tsb[SIM_TSB_SIZE];
+	int tsb_head, tsb_count;
+	uint16_t tsb_seq;
+	struct sim_ts tsb_out;
+
+	/* DS18x on the 1-wire bus */
+	uint32_t ow_csr, ow_cdr;
+	int ow_state, ow_bits, ow_nbytes;
+	uint8_t ow_byte, ow_rx[8];
+	uint8_t ow_id[8], ow_scratch[9];
+	const uint8_t *ow_tx;
+	int ow_tx_len, ow_tx_pos;
+	int temp;				/* temperature at the next conversion, 1/16 degC */
+
+	/* I2C EEPROM */
+	int i2c_scl, i2c_sda, i2c_sda_slave;
+	int i2c_state, i2c_slot, i2c_nbytes, i2c_acked, i2c_read;
+	uint8_t i2c_shreg;
+	uint16_t ee_ptr;
+	uint8_t eeprom[8192];
+
+	/* White Rabbit */
+	int wr_present, wr_locked;
+};
+
+static uint64_t sim_now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Busy-waits for (ns) nanoseconds to mimic the bus round trip */
+static void sim_delay(int ns)
+{
+	uint64_t t;
+
+	if(ns <= 0)
+		return;
+
+	t = sim_now_ns();
+	while(sim_now_ns() - t < (uint64_t) ns);
+}
+
+/* Dallas/Maxim CRC8 */
+static uint8_t ow_crc8(const uint8_t *d, int len)
+{
+	uint8_t crc = 0;
+	int i, b;
+
+	for(i = 0; i < len; i++)
+	{
+		uint8_t x = d[i];
+		for(b = 0; b < 8; b++, x >>= 1)
+			crc = ((crc ^ x) & 1) ? (crc >> 1) ^ 0x8c : crc >> 1;
+	}
+	return crc;
+}
+
+/* Current card time, in 8 ns cycles since epoch */
+static int64_t sim_card_cycles(struct fdelay_sim *s)
+{
+	return s->tm_utc * 125000000LL + s->tm_coarse + (int64_t) ((sim_now_ns() - s->tm_ref_ns) / 8);
+}
+
+/*
+---------------
+Reset handling
+---------------
+*/
+
+static void sim_reset_fmc(struct fdelay_sim *s)
+{
+	memset(s->pll_regs, 0, sizeof(s->pll_regs));
+	s->pll_regs[0x3] = 0xc3;		/* AD9516-4 part ID */
+	s->pll_locked = 0;
+
+	memset(s->mcp_regs, 0, sizeof(s->mcp_regs));
+	s->mcp_regs[0x00] = s->mcp_regs[0x01] = 0xff;	/* IODIRA/B: all inputs */
+
+	memset(s->acam_regs, 0, sizeof(s->acam_regs));
+	s->acam_regs[12] = AR12_NotLocked;
+	s->dac = 0x8000;
+}
+
+static void sim_reset_core(struct fdelay_sim *s)
+{
+	int i;
+
+	for(i = 0; i < 4; i++)
+	{
+		memset(s->ch[i].regs, 0, sizeof(s->ch[i].regs));
+		s->ch[i].armed = s->ch[i].triggered = 0;
+	}
+
+	s->regs[FD_REG_GCR >> 2] = 0;
+	s->regs[FD_REG_TCR >> 2] = 0;
+	s->regs[FD_REG_TSBCR >> 2] = 0;
+	s->tsb_head = s->tsb_count = 0;
+	s->tsb_seq = 0;
+}
+
+/*
+-----------------------------
+SPI: AD9516, MCP23S17, DAC
+-----------------------------
+*/
+
+static uint32_t sim_spi_txrx(struct fdelay_sim *s, uint32_t scr)
+{
+	uint32_t d = FD_SCR_DATA_R(scr);
+
+	if(scr & FD_SCR_SEL_PLL)
+	{
+		int reg = (d >> 8) & 0xfff;
+
+		if(reg >= sizeof(s->pll_regs))
+			return 0;
+
+		if(d & (1<<23))
+		{
+			if(reg == 0x1f)
+				return s->pll_locked ? 1 : 0;
+			return s->pll_regs[reg];
+		}
+
+		if(reg != 0x3) /* the part ID is read-only */
+			s->pll_regs[reg] = d & 0xff;
+		/* The PLL locks as soon as the register set is transferred (the library loads the
+		   configuration before issuing the first update) */
+		if(reg == 0x232 && s->pll_regs[0x10] != 0)
+			s->pll_locked = 1;
+		return 0;
+	}
+
+	if(scr & FD_SCR_SEL_GPIO)
+	{
+		int reg = (d >> 8) & 0xff;
+
+		if(reg >= sizeof(s->mcp_regs))
+			return 0;
+		if(((d >> 16) & 0xff) == 0x4f)
+			return s->mcp_regs[reg];
+		if(((d >> 16) & 0xff) == 0x4e)
+			s->mcp_regs[reg] = d & 0xff;
+		return 0;
+	}
+
+	if(scr & FD_SCR_SEL_DAC)
+		s->dac = d & 0xffff;
+
+	return 0;
+}
+
+/*
+---------
+ACAM TDC
+---------
+*/
+
+static double sim_acam_bin(struct fdelay_sim *s)
+{
+	int hsdiv = s->acam_regs[7] & 0xff;
+	int refdiv = (s->acam_regs[7] >> 8) & 0x7;
+
+	if(!hsdiv)
+		return ACAM_DEFAULT_BIN;
+
+	return (1e12 / ACAM_REF_CLOCK) * (double)(1 << refdiv) / (216.0 * (double) hsdiv);
+}
+
+/* ACAM address lines are driven by the MCP23S17 port B */
+static int sim_acam_addr(struct fdelay_sim *s)
+{
+	return s->mcp_regs[0x15] & 0xf;
+}
+
+static void sim_acam_write(struct fdelay_sim *s, int reg, uint32_t val)
+{
+	if(reg == 4 && (val & AR4_MasterReset))
+		s->acam_fifo1 = 0;
+
+	if(reg == 7)
+		s->acam_regs[12] &= ~AR12_NotLocked;	/* PLL reprogrammed - lock immediately */
+
+	if(reg == 4)
+		val &= ~(AR4_MasterReset | AR4_PartialReset | AR4_AluTrigSoft);
+
+	if(reg != 8 && reg != 9 && reg != 12)
+		s->acam_regs[reg] = val & 0xfffffff;
+	else if(reg == 12)
+		s->acam_regs[12] = (s->acam_regs[12] & AR12_NotLocked) | (val & 0xfffffff & ~AR12_NotLocked);
+}
+
+static uint32_t sim_acam_read(struct fdelay_sim *s, int reg)
+{
+	if(reg == 8)
+		return s->acam_fifo1;
+	if(reg == 9)
+		return 0;
+	return s->acam_regs[reg];
+}
+
+/* A calibration pulse: the TDC start is driven by the FPGA, the stop comes from the output
+   of the channel's delay line (forced to the FRR tap setting) */
+static void sim_cal_pulse(struct fdelay_sim *s, uint32_t calr)
+{
+	int i;
+	int psel = FD_CALR_PSEL_R(calr);
+
+	if(!(s->regs[FD_REG_GCR >> 2] & FD_GCR_BYPASS))
+		return;
+
+	for(i = 0; i < 4; i++)
+	{
+		uint32_t dcr = s->ch[i].regs[FD_REG_DCR >> 2];
+
+		if((psel & (1 << i)) && (dcr & FD_DCR_FORCE_DLY) && (s->acam_regs[0] & AR0_TRiseEn(i + 1)))
+		{
+			double dly = SIM_CAL_BASE_PS + (double) (s->ch[i].regs[FD_REG_FRR >> 2] & 0x3ff) * sim_tap_ps[i];
+			s->acam_fifo1 = ((uint32_t) (dly / sim_acam_bin(s) + 0.5)) & 0x1ffff;
+		}
+	}
+}
+
+/*
+-------------------
+Timestamp buffer
+-------------------
+*/
+
+static uint32_t sim_tsbcr_read(struct fdelay_sim *s)
+{
+	uint32_t r = s->regs[FD_REG_TSBCR >> 2] & (FD_TSBCR_CHAN_MASK_MASK | FD_TSBCR_ENABLE | FD_TSBCR_RAW);
+
+	r |= FD_TSBCR_COUNT_W(s->tsb_count);
+	if(!s->tsb_count)
+		r |= FD_TSBCR_EMPTY;
+	if(s->tsb_count == SIM_TSB_SIZE)
+		r |= FD_TSBCR_FULL;
+	return r;
+}
+
+static void sim_tsbcr_write(struct fdelay_sim *s, uint32_t val)
+{
+	if(val & FD_TSBCR_PURGE)
+		s->tsb_head = s->tsb_count = 0;
+	if(val & FD_TSBCR_RST_SEQ)
+		s->tsb_seq = 0;
+	s->regs[FD_REG_TSBCR >> 2] = val & (FD_TSBCR_CHAN_MASK_MASK | FD_TSBCR_ENABLE | FD_TSBCR_RAW);
+}
+
+static void sim_tsb_advance(struct fdelay_sim *s)
+{
+	if(!s->tsb_count)
+		return;
+
+	s->tsb_out = s->tsb[s->tsb_head];
+	s->tsb_head = (s->tsb_head + 1) % SIM_TSB_SIZE;
+	s->tsb_count--;
+}
+
+/*
+---------------
+Output channels
+---------------
+*/
+
+static void sim_chan_write(struct fdelay_sim *s, int ch, uint32_t reg, uint32_t val)
+{
+	if(reg == FD_REG_DCR)
+	{
+		if(val & FD_DCR_PG_ARM)
+		{
+			s->ch[ch].armed = 1;
+			s->ch[ch].triggered = 0;
+		}
+		if(!(val & FD_DCR_ENABLE))
+			s->ch[ch].armed = 0;
+		val &= ~(FD_DCR_PG_ARM | FD_DCR_UPDATE);
+	}
+
+	s->ch[ch].regs[reg >> 2] = val;
+}
+
+static uint32_t sim_chan_read(struct fdelay_sim *s, int ch, uint32_t reg)
+{
+	uint32_t *r = s->ch[ch].regs;
+
+	if(reg == FD_REG_DCR)
+	{
+		/* An armed pulse generator fires once the card time reaches the start time */
+		if(s->ch[ch].armed && (r[FD_REG_DCR >> 2] & FD_DCR_MODE))
+		{
+			int64_t start = (int64_t) r[FD_REG_U_STARTL >> 2] * 125000000LL + r[FD_REG_C_START >> 2];
+			if(sim_card_cycles(s) >= start)
+			{
+				s->ch[ch].armed = 0;
+				s->ch[ch].triggered = 1;
+			}
+		}
+		return r[FD_REG_DCR >> 2] | FD_DCR_UPD_DONE | (s->ch[ch].triggered ? FD_DCR_PG_TRIG : 0);
+	}
+
+	return r[reg >> 2];
+}
+
+/*
+------------------
+DS18x (1-wire)
+------------------
+*/
+
+static void ow_start_tx(struct fdelay_sim *s, const uint8_t *buf, int len)
+{
+	s->ow_tx = buf;
+	s->ow_tx_len = len;
+	s->ow_tx_pos = 0;
+	s->ow_state = OW_TX;
+}
+
+static void ow_function(struct fdelay_sim *s, uint8_t cmd)
+{
+	if(cmd == OW_CONVERT_TEMP)
+	{
+		s->ow_scratch[0] = s->temp & 0xff;
+		s->ow_scratch[1] = (s->temp >> 8) & 0xff;
+		s->ow_scratch[8] = ow_crc8(s->ow_scratch, 8);
+		s->ow_state = OW_IDLE;
+	} else if(cmd == OW_READ_SCRATCHPAD)
+		ow_start_tx(s, s->ow_scratch, 9);
+	else
+		s->ow_state = OW_IDLE;
+}
+
+static void ow_rx_byte(struct fdelay_sim *s, uint8_t b)
+{
+	switch(s->ow_state)
+	{
+	case OW_ROM:
+		if(b == OW_ROM_READ)
+			ow_start_tx(s, s->ow_id, 8);
+		else if(b == OW_ROM_MATCH)
+		{
+			s->ow_state = OW_MATCH;
+			s->ow_nbytes = 0;
+		} else if(b == OW_ROM_SKIP)
+			s->ow_state = OW_FUNC;
+		else
+			s->ow_state = OW_IDLE;
+		break;
+
+	case OW_MATCH:
+		s->ow_rx[s->ow_nbytes++] = b;
+		if(s->ow_nbytes == 8)
+			s->ow_state = memcmp(s->ow_rx, s->ow_id, 8) ? OW_IDLE : OW_FUNC;
+		break;
+
+	case OW_FUNC:
+		ow_function(s, b);
+		break;
+	}
+}
+
+/* A single 1-wire cycle: reset/presence or a time slot. Returns the sampled line state. */
+static int ow_cycle(struct fdelay_sim *s, uint32_t csr)
+{
+	int bit = csr & OW_CSR_DAT;
+
+	if(csr & OW_CSR_RST)
+	{
+		s->ow_state = OW_ROM;
+		s->ow_bits = 0;
+		s->ow_byte = 0;
+		return 0; /* presence pulse */
+	}
+
+	if(s->ow_state == OW_TX)
+	{
+		int tx = (s->ow_tx[s->ow_tx_pos >> 3] >> (s->ow_tx_pos & 7)) & 1;
+		if(++s->ow_tx_pos == s->ow_tx_len * 8)
+			s->ow_state = OW_IDLE;
+		return bit & tx;
+	}
+
+	if(s->ow_state != OW_IDLE)
+	{
+		s->ow_byte |= bit << s->ow_bits;
+		if(++s->ow_bits == 8)
+		{
+			uint8_t b = s->ow_byte;
+			s->ow_bits = 0;
+			s->ow_byte = 0;
+			ow_rx_byte(s, b);
+		}
+	}
+
+	return bit;
+}
+
+/*
+------------------
+I2C EEPROM (24xx64)
+------------------
+*/
+
+static void i2c_rx_byte(struct fdelay_sim *s, uint8_t b)
+{
+	switch(s->i2c_nbytes++)
+	{
+	case 0:
+		s->i2c_acked = ((b >> 1) == EEPROM_ADDR);
+		s->i2c_read = b & 1;
+		break;
+	case 1:
+		s->ee_ptr = (s->ee_ptr & 0xff) | ((uint16_t) b << 8);
+		break;
+	case 2:
+		s->ee_ptr = (s->ee_ptr & 0xff00) | b;
+		break;
+	default:
+		s->eeprom[s->ee_ptr++ % sizeof(s->eeprom)] = b;
+		break;
+	}
+}
+
+/* Loads the next EEPROM byte and drives its MSB */
+static void i2c_tx_byte(struct fdelay_sim *s)
+{
+	s->i2c_slot = 0;
+	s->i2c_shreg = s->eeprom[s->ee_ptr++ % sizeof(s->eeprom)];
+	s->i2c_sda_slave = (s->i2c_shreg >> 7) & 1;
+}
+
+/* Follows the SCL/SDA lines driven by the master. Data is sampled on the rising edge of SCL,
+   the slave changes its SDA output after the falling edge. Slots 0..7 carry the data bits,
+   slot 8 is the ACK. */
+static void sim_i2c_write(struct fdelay_sim *s, uint32_t val)
+{
+	int scl = (val & FD_I2CR_SCL_OUT) ? 1 : 0;
+	int sda = (val & FD_I2CR_SDA_OUT) ? 1 : 0;
+
+	if(s->i2c_scl && scl && s->i2c_sda != sda)
+	{
+		if(!sda) /* START (or repeated START) */
+		{
+			s->i2c_state = I2C_RX;
+			s->i2c_slot = -1;
+			s->i2c_nbytes = 0;
+			s->i2c_read = 0;
+		} else /* STOP */
+			s->i2c_state = I2C_IDLE;
+		s->i2c_sda_slave = 1;
+	} else if(!s->i2c_scl && scl) {
+		if(s->i2c_state == I2C_RX && s->i2c_slot >= 0 && s->i2c_slot < 8)
+			s->i2c_shreg = (s->i2c_shreg << 1) | sda;
+		else if(s->i2c_state == I2C_TX && s->i2c_slot == 8)
+			s->i2c_acked = !sda;
+	} else if(s->i2c_scl && !scl && s->i2c_state != I2C_IDLE) {
+		s->i2c_slot++;
+
+		if(s->i2c_state == I2C_RX)
+		{
+			if(s->i2c_slot == 8)
+			{
+				i2c_rx_byte(s, s->i2c_shreg);
+				s->i2c_sda_slave = s->i2c_acked ? 0 : 1;
+				if(!s->i2c_acked)
+					s->i2c_state = I2C_IDLE;
+			} else if(s->i2c_slot == 9) {
+				s->i2c_slot = 0;
+				s->i2c_sda_slave = 1;
+				if(s->i2c_read)
+				{
+					s->i2c_state = I2C_TX;
+					i2c_tx_byte(s);
+				}
+			}
+		} else {
+			if(s->i2c_slot < 8)
+				s->i2c_sda_slave = (s->i2c_shreg >> (7 - s->i2c_slot)) & 1;
+			else if(s->i2c_slot == 8)
+				s->i2c_sda_slave = 1; /* release SDA for the master's ACK */
+			else if(s->i2c_acked)
+				i2c_tx_byte(s);
+			else
+				s->i2c_state = I2C_IDLE;
+		}
+	}
+
+	s->i2c_scl = scl;
+	s->i2c_sda = sda;
+}
+
+static uint32_t sim_i2c_read(struct fdelay_sim *s)
+{
+	uint32_t r = (s->i2c_scl ? FD_I2CR_SCL_OUT | FD_I2CR_SCL_IN : 0) | (s->i2c_sda ? FD_I2CR_SDA_OUT : 0);
+
+	if(s->i2c_sda && s->i2c_sda_slave)
+		r |= FD_I2CR_SDA_IN;
+	return r;
+}
+
+/*
+----------------------
+Main register map
+----------------------
+*/
+
+static void sim_main_write(struct fdelay_sim *s, uint32_t reg, uint32_t val)
+{
+	uint32_t *r = s->regs;
+
+	switch(reg)
+	{
+	case FD_REG_RSTR:
+		if(FD_RSTR_LOCK_R(val) != 0xdead)
+			break;
+		/* Reset lines are active low */
+		if(!(val & FD_RSTR_RST_FMC_MASK))
+			sim_reset_fmc(s);
+		if(!(val & FD_RSTR_RST_CORE_MASK))
+			sim_reset_core(s);
+		break;
+
+	case FD_REG_SCR:
+		if(val & FD_SCR_START)
+			r[reg >> 2] = FD_SCR_DATA_W(sim_spi_txrx(s, val)) | FD_SCR_READY | (val & ~(FD_SCR_DATA_MASK | FD_SCR_START));
+		else
+			r[reg >> 2] = val | FD_SCR_READY;
+		break;
+
+	case FD_REG_TDR:
+		s->tdr_in = val & 0xfffffff;
+		break;
+
+	case FD_REG_TDCSR:
+		if(val & FD_TDCSR_WRITE)
+			sim_acam_write(s, sim_acam_addr(s), s->tdr_in);
+		if(val & FD_TDCSR_READ)
+			s->tdr_out = sim_acam_read(s, sim_acam_addr(s));
+		break;
+
+	case FD_REG_CALR:
+		if(val & FD_CALR_CAL_PULSE)
+			sim_cal_pulse(s, val);
+		r[reg >> 2] = val & ~FD_CALR_CAL_PULSE;
+		break;
+
+	case FD_REG_TCR:
+		if(val & FD_TCR_SET_TIME)
+		{
+			s->tm_utc = ((int64_t) (r[FD_REG_TM_SECH >> 2] & 0xff) << 32) | r[FD_REG_TM_SECL >> 2];
+			s->tm_coarse = r[FD_REG_TM_CYCLES >> 2];
+			s->tm_ref_ns = sim_now_ns();
+		}
+		if(val & FD_TCR_CAP_TIME)
+		{
+			int64_t c = sim_card_cycles(s);
+			r[FD_REG_TM_SECH >> 2] = (uint32_t) ((c / 125000000LL) >> 32) & 0xff;
+			r[FD_REG_TM_SECL >> 2] = (uint32_t) (c / 125000000LL);
+			r[FD_REG_TM_CYCLES >> 2] = (uint32_t) (c % 125000000LL);
+		}
+		r[reg >> 2] = val & (FD_TCR_WR_ENABLE);
+		break;
+
+	case FD_REG_TSBCR:
+		sim_tsbcr_write(s, val);
+		break;
+
+	case FD_REG_TSBR_ADVANCE:
+		if(val & FD_TSBR_ADVANCE_ADV)
+			sim_tsb_advance(s);
+		break;
+
+	case FD_REG_I2CR:
+		sim_i2c_write(s, val);
+		break;
+
+	case FD_REG_EIC_ISR:
+		r[reg >> 2] &= ~val;
+		break;
+
+	default:
+		r[reg >> 2] = val;
+		break;
+	}
+}
+
+static uint32_t sim_main_read(struct fdelay_sim *s, uint32_t reg)
+{
+	uint32_t *r = s->regs;
+
+	switch(reg)
+	{
+	case FD_REG_IDR:
+		return FDELAY_MAGIC_ID;
+
+	case FD_REG_GCR:
+		return (r[reg >> 2] & (FD_GCR_BYPASS | FD_GCR_INPUT_EN)) | FD_GCR_FMC_PRESENT
+			| (s->pll_locked ? FD_GCR_DDR_LOCKED : 0);
+
+	case FD_REG_TCR:
+	{
+		uint32_t tcr = r[reg >> 2];
+
+		if(s->wr_present)
+			tcr |= FD_TCR_WR_PRESENT | (s->wr_locked ? FD_TCR_WR_LINK | FD_TCR_WR_READY : 0);
+		if((tcr & FD_TCR_WR_ENABLE) && s->wr_present && s->wr_locked)
+			tcr |= FD_TCR_WR_LOCKED;
+		return tcr;
+	}
+
+	case FD_REG_TDR:
+		return s->tdr_out;
+
+	case FD_REG_TDER1:
+		return (uint32_t) (SIM_VCXO_HZ * (1.0 + SIM_VCXO_PPM * 1e-6 * ((double) s->dac - 32768.0) / 65536.0));
+
+	case FD_REG_TSBCR:
+		return sim_tsbcr_read(s);
+
+	case FD_REG_TSBR_SECH:
+		return s->tsb_out.sech;
+	case FD_REG_TSBR_SECL:
+		return s->tsb_out.secl;
+	case FD_REG_TSBR_CYCLES:
+		return s->tsb_out.cycles;
+	case FD_REG_TSBR_FID:
+		return s->tsb_out.fid;
+	case FD_REG_TSBR_DEBUG:
+		return 0;
+
+	case FD_REG_I2CR:
+		return sim_i2c_read(s);
+
+	default:
+		return r[reg >> 2];
+	}
+}
+
+/*
+----------------------
+Bus callbacks
+----------------------
+*/
+
+static void sim_writel(void *priv, uint32_t data, uint32_t addr)
+{
+	struct fdelay_sim *s = (struct fdelay_sim *) priv;
+	uint32_t a = addr - s->base;
+
+	sim_delay(s->write_ns);
+
+	if(a < SIM_CHAN_BASE)
+		sim_main_write(s, a, data);
+	else if(a < SIM_ONEWIRE_BASE)
+		sim_chan_write(s, (a - SIM_CHAN_BASE) / SIM_CHAN_SIZE, a % SIM_CHAN_SIZE, data);
+	else if(a == SIM_ONEWIRE_BASE)
+	{
+		/* The cycle completes immediately - CYC reads back as 0 */
+		int line = (data & OW_CSR_CYC) ? ow_cycle(s, data) : (data & OW_CSR_DAT);
+		s->ow_csr = (data & ~(OW_CSR_CYC | OW_CSR_DAT)) | (line ? OW_CSR_DAT : 0);
+	} else if(a == SIM_ONEWIRE_BASE + 4)
+		s->ow_cdr = data;
+}
+
+static uint32_t sim_readl(void *priv, uint32_t addr)
+{
+	struct fdelay_sim *s = (struct fdelay_sim *) priv;
+	uint32_t a = addr - s->base;
+
+	sim_delay(s->read_ns);
+
+	if(a < SIM_CHAN_BASE)
+		return sim_main_read(s, a);
+	else if(a < SIM_ONEWIRE_BASE)
+		return sim_chan_read(s, (a - SIM_CHAN_BASE) / SIM_CHAN_SIZE, a % SIM_CHAN_SIZE);
+	else if(a == SIM_ONEWIRE_BASE)
+		return s->ow_csr;
+	else if(a == SIM_ONEWIRE_BASE + 4)
+		return s->ow_cdr;
+
+	return 0;
+}
+
+/*
+----------------------
+Public API
+----------------------
+*/
+
+/* Fills the EEPROM with a calibration block, as written by the production test */
+static void sim_init_eeprom(struct fdelay_sim *s)
+{
+	struct fine_delay_calibration cal;
+	int i;
+
+	memset(s->eeprom, 0xff, sizeof(s->eeprom));
+	memset(&cal, 0, sizeof(cal));
+
+	cal.magic = FDELAY_MAGIC_ID;
+	for(i = 0; i < 4; i++)
+		cal.zero_offset[i] = 50000;
+	cal.adsfr_val = 84977;
+	cal.acam_start_offset = 10000;
+	cal.atmcr_val = 26 | (1500 << 8);
+	cal.tdc_zero_offset = 35600;
+	cal.frr_poly[0] = -165202LL;
+	cal.frr_poly[1] = -29825595LL;
+	cal.frr_poly[2] = 3801939743082LL;
+
+	memcpy(s->eeprom, &cal, sizeof(cal));
+}
+
+int fdelay_sim_attach(fdelay_device_t *dev, const char *params)
+{
+	struct fdelay_sim *s;
+	static const uint8_t id[7] = { 0x28, 0x5a, 0x1d, 0xf0, 0x03, 0x00, 0x00 };
+
+	s = (struct fdelay_sim *) calloc(1, sizeof(struct fdelay_sim));
+	if(!s)
+		return -1;
+
+	if(!params || !*params)
+		;
+	else if(!strcmp(params, "pcie"))
+	{
+		s->read_ns = FDELAY_SIM_PCIE_READ_NS;
+		s->write_ns = FDELAY_SIM_PCIE_WRITE_NS;
+	} else if(!strcmp(params, "vme")) {
+		s->read_ns = FDELAY_SIM_VME_READ_NS;
+		s->write_ns = FDELAY_SIM_VME_WRITE_NS;
+	} else if(!strcmp(params, "etherbone")) {
+		s->read_ns = FDELAY_SIM_EB_READ_NS;
+		s->write_ns = FDELAY_SIM_EB_WRITE_NS;
+	} else if(sscanf(params, "%d,%d", &s->read_ns, &s->write_ns) != 2) {
+		fprintf(stderr, "sim: unknown latency setting '%s'\n", params);
+		free(s);
+		return -1;
+	}
+
+	memcpy(s->ow_id, id, 7);
+	s->ow_id[7] = ow_crc8(s->ow_id, 7);
+
+	/* DS18B20 power-on state: 85 degC in the scratchpad until the first conversion */
+	s->ow_scratch[0] = 0x50;
+	s->ow_scratch[1] = 0x05;
+	s->ow_scratch[4] = 0x7f;
+	s->ow_scratch[5] = 0xff;
+	s->ow_scratch[7] = 0x10;
+	s->ow_scratch[8] = ow_crc8(s->ow_scratch, 8);
+	s->temp = 40 * 16;
+
+	s->i2c_scl = s->i2c_sda = s->i2c_sda_slave = 1;
+	sim_init_eeprom(s);
+
+	sim_reset_fmc(s);
+	sim_reset_core(s);
+	s->tm_ref_ns = sim_now_ns();
+
+	s->base = dev->base_addr;
+	dev->priv_io = s;
+	dev->writel = sim_writel;
+	dev->readl = sim_readl;
+
+	return 0;
+}
+
+void fdelay_sim_detach(fdelay_device_t *dev)
+{
+	free(dev->priv_io);
+	dev->priv_io = NULL;
+}
+
+void fdelay_sim_set_latency(fdelay_device_t *dev, int read_ns, int write_ns)
+{
+	struct fdelay_sim *s = (struct fdelay_sim *) dev->priv_io;
+
+	s->read_ns = read_ns;
+	s->write_ns = write_ns;
+}
+
+void fdelay_sim_set_temperature(fdelay_device_t *dev, double deg_c)
+{
+	struct fdelay_sim *s = (struct fdelay_sim *) dev->priv_io;
+
+	s->temp = (int) (deg_c * 16.0);
+}
+
+void fdelay_sim_set_wr(fdelay_device_t *dev, int present, int locked)
+{
+	struct fdelay_sim *s = (struct fdelay_sim *) dev->priv_io;
+
+	if(s->wr_locked != (present && locked))
+		s->regs[FD_REG_EIC_ISR >> 2] |= FD_EIC_ISR_SYNC_STATUS;
+
+	s->wr_present = present;
+	s->wr_locked = present && locked;
+}
+
+int fdelay_sim_trigger(fdelay_device_t *dev, fdelay_time_t t)
+{
+	struct fdelay_sim *s = (struct fdelay_sim *) dev->priv_io;
+	struct sim_ts *ts;
+	uint32_t tsbcr = s->regs[FD_REG_TSBCR >> 2];
+
+	if(!(s->regs[FD_REG_GCR >> 2] & FD_GCR_INPUT_EN) || !(tsbcr & FD_TSBCR_ENABLE)
+	   || !(FD_TSBCR_CHAN_MASK_R(tsbcr) & 1))
+		return -1;
+
+	if(s->tsb_count == SIM_TSB_SIZE)
+		return -1;
+
+	ts = &s->tsb[(s->tsb_head + s->tsb_count) % SIM_TSB_SIZE];
+	ts->sech = (uint32_t) (t.utc >> 32) & 0xff;
+	ts->secl = (uint32_t) t.utc;
+	ts->cycles = t.coarse & 0xfffffff;
+	ts->fid = FD_TSBR_FID_FINE_W(t.frac) | FD_TSBR_FID_SEQID_W(s->tsb_seq++);
+	s->tsb_count++;
+
+	return 0;
+}
@@ -0,0 +1,149 @@
+/*
+	FmcDelay1ns4Cha (a.k.a. The Fine Delay Card)
+	User-space driver/library
+
+	Bus access statistics: per call-site operation counters and
+	log2-bucketed access latency histograms.
+
+	(c) Copyright CERN 2012
+	Licensed under LGPL 2.1
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fdelay_lib.h"
+#include "fdelay_private.h"
+
+/* Monotonic time in nanoseconds */
+uint64_t fd_bus_stats_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns)
+{
+	int b = 0;
+
+	while(ns > 1 && b < FD_STATS_HIST_BUCKETS - 1)
+	{
+		ns >>= 1;
+		b++;
+	}
+	return b;
+}
+
+void fd_bus_stats_record(struct fd_bus_stats *st, const char *site, int is_write, uint64_t ns)
+{
+	struct fd_bus_site_stats *s;
+	int i;
+
+/* Call sites are identified by the address of their __func__ string, so a pointer comparison is enough */
+	for(i = 0; i < st->n_sites; i++)
+		if(st->sites[i].site == site)
+			break;
+
+	if(i == st->n_sites)
+	{
+		if(st->n_sites == FD_STATS_MAX_SITES)
+		{
+			st->dropped++;
+			return;
+		}
+		st->sites[st->n_sites++].site = site;
+	}
+
+	s = &st->sites[i];
+
+	if(is_write)
+		s->writes++;
+	else
+		s->reads++;
+
+	s->total_ns += ns;
+	if(ns > s->max_ns)
+		s->max_ns = ns;
+	s->hist[hist_bucket(ns)]++;
+}
+
+int fdelay_bus_stats_enable(fdelay_device_t *dev, int enable)
+{
+	fd_decl_private(dev)
+
+	if(!hw)
+		return -1;
+
+	if(enable && !hw->bus_stats)
+	{
+		hw->bus_stats = (struct fd_bus_stats *) calloc(1, sizeof(struct fd_bus_stats));
+		if(!hw->bus_stats)
+			return -1;
+	} else if(!enable && hw->bus_stats) {
+		free(hw->bus_stats);
+		hw->bus_stats = NULL;
+	}
+
+	return 0;
+}
+
+void fdelay_bus_stats_reset(fdelay_device_t *dev)
+{
+	fd_decl_private(dev)
+
+	if(hw && hw->bus_stats)
+		memset(hw->bus_stats, 0, sizeof(struct fd_bus_stats));
+}
+
+static int cmp_sites(const void *a, const void *b)
+{
+	const struct fd_bus_site_stats *sa = a, *sb = b;
+
+	if(sa->total_ns == sb->total_ns)
+		return 0;
+	return sa->total_ns < sb->total_ns ? 1 : -1;
+}
+
+int fdelay_bus_stats_dump(fdelay_device_t *dev, FILE *f)
+{
+	fd_decl_private(dev)
+	struct fd_bus_site_stats sites[FD_STATS_MAX_SITES];
+	int i, b, n;
+
+	if(!hw || !hw->bus_stats)
+		return -1;
+
+/* Sort a copy, so that the dump doesn't disturb the site lookup order */
+	n = hw->bus_stats->n_sites;
+	memcpy(sites, hw->bus_stats->sites, n * sizeof(struct fd_bus_site_stats));
+	qsort(sites, n, sizeof(struct fd_bus_site_stats), cmp_sites);
+
+	fprintf(f, "%-28s %10s %10s %12s %10s %10s\n", "site", "reads", "writes", "total [us]", "avg [ns]", "max [ns]");
+
+	for(i = 0; i < n; i++)
+	{
+		struct fd_bus_site_stats *s = &sites[i];
+		uint64_t ops = s->reads + s->writes;
+
+		fprintf(f, "%-28s %10llu %10llu %12.1f %10llu %10llu\n", s->site,
+			(unsigned long long) s->reads, (unsigned long long) s->writes,
+			(double) s->total_ns / 1000.0,
+			(unsigned long long) (ops ? s->total_ns / ops : 0),
+			(unsigned long long) s->max_ns);
+
+		fprintf(f, "%-28s", "  latency histogram:");
+		for(b = 0; b < FD_STATS_HIST_BUCKETS; b++)
+			if(s->hist[b])
+				fprintf(f, " [%llu ns]:%llu", 1ULL << b, (unsigned long long) s->hist[b]);
+		fprintf(f, "\n");
+	}
+
+	if(hw->bus_stats->dropped)
+		fprintf(f, "%llu accesses from untracked call sites\n", (unsigned long long) hw->bus_stats->dropped);
+
+	return 0;
+}
@@ -0,0 +1,190 @@
+/*
+	FmcDelay1ns4Cha (a.k.a. The Fine Delay Card)
+	User-space driver/library
+
+	Bus access trace: a ring of the most recent register accesses (address,
+	value, direction, time), saved to a binary file and decoded offline with
+	the register names.
+
+	(c) Copyright CERN 2012
+	Licensed under LGPL 2.1
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fd_channel_regs.h"
+#include "fd_main_regs.h"
+
+#include "fdelay_lib.h"
+#include "fdelay_private.h"
+
+int fdelay_bus_trace_enable(fdelay_device_t *dev, int n_entries)
+{
+	fd_decl_private(dev)
+	uint32_t size = 1;
+
+	if(!hw)
+		return -1;
+
+	free(hw->bus_trace);
+	hw->bus_trace = NULL;
+
+	if(n_entries <= 0)
+		return 0;
+
+	while(size < (uint32_t) n_entries && size < (1U << 30))
+		size <<= 1;
+
+	hw->bus_trace = (struct fd_bus_trace *) calloc(1, sizeof(struct fd_bus_trace) +
+		size * sizeof(struct fdelay_trace_record));
+	if(!hw->bus_trace)
+		return -1;
+
+	hw->bus_trace->mask = size - 1;
+	hw->bus_trace->t0_tics = fd_trace_tics();
+	hw->bus_trace->t0_ns = fd_bus_stats_now();
+	return 0;
+}
+
+void fdelay_bus_trace_reset(fdelay_device_t *dev)
+{
+	fd_decl_private(dev)
+
+	if(hw && hw->bus_trace)
+		hw->bus_trace->head = 0;
+}
+
+int fdelay_bus_trace_save(fdelay_device_t *dev, const char *filename)
+{
+	fd_decl_private(dev)
+	struct fd_bus_trace *tr;
+	struct fdelay_trace_header hdr;
+	struct fdelay_trace_record r;
+	uint64_t idx, t1_tics, t1_ns;
+	double ns_per_tic;
+	FILE *f;
+
+	if(!hw || !hw->bus_trace)
+		return -1;
+
+	tr = hw->bus_trace;
+
+/* Time stamps are recorded in CPU tics: convert them with the rate measured between enabling and now */
+	t1_tics = fd_trace_tics();
+	t1_ns = fd_bus_stats_now();
+	ns_per_tic = t1_tics > tr->t0_tics ? (double) (t1_ns - tr->t0_ns) / (double) (t1_tics - tr->t0_tics) : 1.0;
+
+	f = fopen(filename, "wb");
+	if(!f)
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FDELAY_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.base_addr = hw->base_addr;
+	hdr.n_records = tr->head > tr->mask + 1 ? tr->mask + 1 : tr->head;
+	hdr.lost = tr->head - hdr.n_records;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	for(idx = hdr.lost; idx < tr->head; idx++)
+	{
+		r = tr->e[idx & tr->mask];
+		r.ns = tr->t0_ns + (int64_t) ((double) (int64_t) (r.ns - tr->t0_tics) * ns_per_tic);
+		fwrite(&r, sizeof(r), 1, f);
+	}
+
+	if(fclose(f))
+		return -1;
+
+	return hdr.n_records;
+}
+
+struct reg_name {
+	uint32_t addr;
+	const char *name;
+};
+
+#define REG(r) { FD_REG_##r, #r }
+
+static const struct reg_name main_regs[] = {
+	REG(RSTR), REG(IDR), REG(GCR), REG(TCR), REG(TM_SECH), REG(TM_SECL), REG(TM_CYCLES),
+	REG(TDR), REG(TDCSR), REG(CALR), REG(DMTR_IN), REG(DMTR_OUT), REG(ADSFR), REG(ATMCR),
+	REG(ASOR), REG(IECRAW), REG(IECTAG), REG(IEPD), REG(SCR), REG(RCRR), REG(TSBCR),
+	REG(TSBIR), REG(TSBR_SECH), REG(TSBR_SECL), REG(TSBR_CYCLES), REG(TSBR_FID), REG(I2CR),
+	REG(TDER1), REG(TDER2), REG(TSBR_DEBUG), REG(TSBR_ADVANCE), REG(EIC_IDR), REG(EIC_IER),
+	REG(EIC_IMR), REG(EIC_ISR),
+	{ 0, NULL }
+};
+
+static const struct reg_name chan_regs[] = {
+	REG(DCR), REG(FRR), REG(U_STARTH), REG(U_STARTL), REG(C_START), REG(F_START), REG(U_ENDH),
+	REG(U_ENDL), REG(C_END), REG(F_END), REG(U_DELTA), REG(C_DELTA), REG(F_DELTA), REG(RCR),
+	{ 0, NULL }
+};
+
+static const char *lookup_reg(const struct reg_name *t, uint32_t addr)
+{
+	for(; t->name; t++)
+		if(t->addr == addr)
+			return t->name;
+	return NULL;
+}
+
+/* Names the register at (offset) from the core base: main registers, CHn.xxx for the
+   output channels and OW+0xnn for the 1-wire master */
+static void reg_name(uint32_t offset, char *buf, size_t len)
+{
+	const char *name = NULL;
+
+	if(offset < 0x100)
+		name = lookup_reg(main_regs, offset);
+	else if(offset < 0x500)
+	{
+		name = lookup_reg(chan_regs, offset & 0xff);
+		if(name)
+		{
+			snprintf(buf, len, "CH%d.%s", offset >> 8, name);
+			return;
+		}
+	} else if(offset < 0x600) {
+		snprintf(buf, len, "OW+0x%02x", offset - 0x500);
+		return;
+	}
+
+	if(name)
+		snprintf(buf, len, "%s", name);
+	else
+		snprintf(buf, len, "0x%04x", offset);
+}
+
+int fdelay_bus_trace_decode(FILE *in, FILE *out)
+{
+	struct fdelay_trace_header hdr;
+	struct fdelay_trace_record r;
+	uint64_t i, t_first = 0, t_prev = 0;
+	char name[32];
+
+	if(fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, FDELAY_TRACE_MAGIC, sizeof(hdr.magic)))
+		return -1;
+
+	fprintf(out, "# base 0x%x, %llu accesses, %llu older ones overwritten\n", hdr.base_addr,
+		(unsigned long long) hdr.n_records, (unsigned long long) hdr.lost);
+	fprintf(out, "# %12s %10s %2s %-16s %s\n", "time [us]", "delta [ns]", "", "register", "value");
+
+	for(i = 0; i < hdr.n_records; i++)
+	{
+		if(fread(&r, sizeof(r), 1, in) != 1)
+			return -1;
+
+		if(!i)
+			t_first = t_prev = r.ns;
+
+		reg_name(r.addr & ~FDELAY_TRACE_WRITE, name, sizeof(name));
+		fprintf(out, "%14.3f %10lld %2s %-16s 0x%08x\n", (double) (r.ns - t_first) / 1000.0,
+			(long long) (r.ns - t_prev), r.addr & FDELAY_TRACE_WRITE ? "W" : "R", name, r.data);
+		t_prev = r.ns;
+	}
+
+	return 0;
+}
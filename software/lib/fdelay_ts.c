@@ -0,0 +1,112 @@
+/*
+	FmcDelay1ns4Cha (a.k.a. The Fine Delay Card)
+	User-space driver/library
+
+	Timestamp arithmetic. A timestamp (or a time interval) is kept as
+	utc seconds + coarse 8 ns cycles (0..124999999) + frac (0..4095, 1/4096 of a cycle).
+	All functions take and return normalized values, unless noted otherwise.
+
+	(c) Copyright CERN 2012
+	Licensed under LGPL 2.1
+*/
+
+#include <stdint.h>
+
+#include "fdelay_lib.h"
+
+#define FRAC_MASK	((1 << FDELAY_FRAC_BITS) - 1)
+#define COARSE_RANGE	125000000
+
+/* Floor division/modulo (rounding towards minus infinity), for the carries of negative values */
+static inline int64_t floor_div(int64_t a, int64_t b)
+{
+	int64_t q = a / b;
+	return q - ((a % b) < 0);
+}
+
+/* Adds two timestamps. The fractional part carries at most 1 into the coarse part and the coarse
+   part at most 1 into the seconds, so the carries are computed without branches. */
+fdelay_time_t fdelay_ts_add(fdelay_time_t a, fdelay_time_t b)
+{
+	int32_t c;
+
+	a.frac += b.frac;
+	c = a.frac >> FDELAY_FRAC_BITS;
+	a.frac &= FRAC_MASK;
+
+	a.coarse += b.coarse + c;
+	c = (a.coarse >= COARSE_RANGE);
+	a.coarse -= c * COARSE_RANGE;
+
+	a.utc += b.utc + c;
+	return a;
+}
+
+/* Subtracts (b) from (a) */
+fdelay_time_t fdelay_ts_sub(fdelay_time_t a, fdelay_time_t b)
+{
+	int32_t c;
+
+	a.frac -= b.frac;
+	c = (a.frac < 0);
+	a.frac &= FRAC_MASK;
+
+	a.coarse -= b.coarse + c;
+	c = (a.coarse < 0);
+	a.coarse += c * COARSE_RANGE;
+
+	a.utc -= b.utc + c;
+	return a;
+}
+
+/* Compares two timestamps. Returns a negative value if a < b, 0 if a == b and a positive one if a > b. */
+int fdelay_ts_cmp(fdelay_time_t a, fdelay_time_t b)
+{
+	if(a.utc != b.utc)
+		return a.utc < b.utc ? -1 : 1;
+	if(a.coarse != b.coarse)
+		return a.coarse < b.coarse ? -1 : 1;
+	return (a.frac > b.frac) - (a.frac < b.frac);
+}
+
+/* Brings a timestamp with out-of-range (possibly negative) frac/coarse fields into the normalized
+   form, propagating any number of carries. */
+fdelay_time_t fdelay_ts_normalize(fdelay_time_t a)
+{
+	int64_t coarse;
+
+	coarse = (int64_t) a.coarse + (a.frac >> FDELAY_FRAC_BITS);
+	a.frac &= FRAC_MASK;
+
+	a.utc += floor_div(coarse, COARSE_RANGE);
+	a.coarse = (int32_t) (coarse - floor_div(coarse, COARSE_RANGE) * COARSE_RANGE);
+	return a;
+}
+
+/* Multiplies a time interval by an integer (n), e.g. to get the time of the n-th pulse of a train */
+fdelay_time_t fdelay_ts_scale(fdelay_time_t a, int64_t n)
+{
+	__int128 frac, coarse, q;
+	fdelay_time_t r = a;
+
+	frac = (__int128) a.frac * n;
+	coarse = (__int128) a.coarse * n + (frac >> FDELAY_FRAC_BITS);
+	r.frac = (int32_t) (frac & FRAC_MASK);
+
+	q = coarse / COARSE_RANGE;
+	if(coarse % COARSE_RANGE < 0)
+		q--;
+
+	r.coarse = (int32_t) (coarse - q * COARSE_RANGE);
+	r.utc = (int64_t) ((__int128) a.utc * n + q);
+	return r;
+}
+
+/* Adds a (possibly negative) number of picoseconds to a timestamp */
+fdelay_time_t fdelay_ts_add_ps(fdelay_time_t a, int64_t ps)
+{
+	if(ps < 0)
+		return fdelay_ts_sub(a, fdelay_from_picos(0ULL - (uint64_t) ps)); /* no overflow for INT64_MIN */
+	else
+		return fdelay_ts_add(a, fdelay_from_picos((uint64_t) ps));
+}
@@ -0,0 +1,918 @@
+/*
+	FmcDelay1ns4Cha (a.k.a. The Fine Delay Card)
+	User-space driver/library
+
+	Timestamp log writer. Records are appended to one of two batch buffers;
+	the writer thread swaps the buffers when the durability policy asks for
+	a flush, packs the full one in blocks and writes them out with a single
+	write() while the other one fills up. The block index is kept in memory
+	and written at the end of the file when the log is closed.
+
+	Segmented logs: the writer thread completes the segment being written
+	(index, rename from <prefix>.NNNNNN.tmp to <prefix>.NNNNNN) and updates
+	the manifest when the segment reaches its size or age limit.
+
+	(c) Copyright CERN 2012
+	Licensed under LGPL 2.1
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "fdelay_lib.h"
+#include "fdelay_private.h"
+#include "fdelay_tslog.h"
+
+struct fdelay_tslog {
+	int fd;
+	struct fdelay_tslog_policy pol;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;		/* to the writer: a batch is due or the log is closing */
+	pthread_cond_t space;		/* to the producer: the buffers have been swapped */
+	struct fdelay_tslog_record *buf[2];
+	int cur;			/* buffer being filled */
+	int fill;			/* number of records in buf[cur] */
+	uint64_t first_ns;		/* host time of the oldest record in buf[cur] */
+	int closing;
+	int error;			/* errno of the first failed write, 0 if none */
+	struct fdelay_tslog_stats stats;
+	struct fdelay_tslog_header hdr;	/* protected by (lock), as (fd) is while it's changed */
+	char *prefix;			/* segmented log: file name prefix, NULL if the log is a single file */
+	char *manifest;			/* segmented log: contents of the manifest */
+	size_t manifest_len;
+	int seq;			/* segmented log: number of the segment being written */
+
+	/* Owned by the writer thread */
+	char *out;			/* a batch packed in blocks */
+	uint64_t data_end;		/* file offset of the next block */
+	uint64_t n_records;
+	int64_t max_utc;
+	struct fdelay_tslog_index *index;
+	uint64_t n_blocks, index_size;
+	uint64_t encode_ns;
+	uint64_t seg_start_ns;		/* host time the segment was started */
+	uint64_t seg_events;		/* synchronized timestamps in the segment */
+	int64_t first_utc, last_utc;	/* range of the synchronized timestamps in the segment */
+	uint64_t segments;		/* segments completed */
+};
+
+/* 1/4096 cycle units in a second */
+#define UNITS_PER_SEC	(125000000LL * 4096LL)
+
+static void deadline(struct timespec *ts, uint64_t ns)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static int pwrite_all(int fd, const void *data, size_t len, uint64_t offset)
+{
+	const char *p = data;
+
+	while(len)
+	{
+		ssize_t n = pwrite(fd, p, len, offset);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+static int add_index(struct fdelay_tslog *l, const struct fdelay_tslog_block *b, uint64_t offset)
+{
+	struct fdelay_tslog_index *e;
+
+	if(l->n_blocks == l->index_size)
+	{
+		uint64_t size = l->index_size ? 2 * l->index_size : 1024;
+		e = realloc(l->index, size * sizeof(struct fdelay_tslog_index));
+		if(!e)
+			return -1;
+		l->index = e;
+		l->index_size = size;
+	}
+
+	e = &l->index[l->n_blocks++];
+	e->offset = offset;
+	e->first_record = b->first_record;
+	e->max_utc = b->max_utc;
+	e->n_records = b->n_records;
+	e->size = b->size;
+
+	l->n_records = b->first_record + b->n_records;
+	l->max_utc = b->max_utc;
+	return 0;
+}
+
+/* Delta-encodes (n) records of block (b) (see FDELAY_TSLOG_ENC_DELTA). Returns the end of the block. */
+static uint8_t *encode_delta(struct fdelay_tslog_block *b, const struct fdelay_tslog_record *rec, int n)
+{
+	uint8_t *p = (uint8_t *) (b + 1);
+	uint32_t groups[(n + FDELAY_TSLOG_DELTA_GROUP - 1) / FDELAY_TSLOG_DELTA_GROUP];
+	int64_t delta, prev_delta = 0;
+	int i;
+
+	for(i = 0; i < n; i++)
+	{
+		const struct fdelay_tslog_record *r = &rec[i], *pr = &rec[i-1];
+
+		if(!(i % FDELAY_TSLOG_DELTA_GROUP))
+			groups[i / FDELAY_TSLOG_DELTA_GROUP] = p - (uint8_t *) b;
+
+		/* Markers, non-normalized timestamps and big gaps are stored as they are */
+		if(!(i % FDELAY_TSLOG_DELTA_GROUP) || !FDELAY_TSLOG_IS_TIMESTAMP(r->type) || r->coarse >= 125000000 || r->frac >= 4096 ||
+			r->utc - pr->utc > (1LL << 20) || r->utc - pr->utc < -(1LL << 20))
+		{
+			*p++ = FDELAY_TSLOG_TAG_RAW;
+			memcpy(p, r, sizeof(*r));
+			p += sizeof(*r);
+			prev_delta = 0;
+			continue;
+		}
+
+		delta = (r->utc - pr->utc) * UNITS_PER_SEC + ((int64_t) r->coarse - (int64_t) pr->coarse) * 4096LL +
+			((int64_t) r->frac - (int64_t) pr->frac);
+
+		if(r->card != pr->card || r->type != pr->type || r->channel != pr->channel)
+		{
+			*p++ = FDELAY_TSLOG_TAG_META;
+			*p++ = r->card;
+			*p++ = r->type;
+			p = fd_put_varint(p, r->channel);
+		} else
+			*p++ = 0;
+
+		p = fd_put_varint(p, fd_zigzag(delta - prev_delta));
+		p = fd_put_varint(p, fd_zigzag((int16_t) (uint16_t) (r->seq_id - pr->seq_id - 1)));
+		prev_delta = delta;
+	}
+
+	while((p - (uint8_t *) b) & 3)
+		*p++ = 0;
+
+	memcpy(p, groups, sizeof(groups));
+	return p + sizeof(groups);
+}
+
+/* Packs (n) records in blocks into l->out and writes them at the end of the data.
+   Returns the number of bytes written, negative on error. If the write fails, the index and the
+   record count are left as they were, so that the next batch goes to the same offset. */
+static int64_t write_blocks(struct fdelay_tslog *l, const struct fdelay_tslog_record *rec, int n)
+{
+	char *p = l->out;
+	uint64_t offset = l->data_end, t = fd_bus_stats_now();
+	uint64_t n_blocks = l->n_blocks, n_records = l->n_records, seg_events = l->seg_events;
+	int64_t max_utc = l->max_utc, first_utc = l->first_utc, last_utc = l->last_utc;
+	int i;
+
+	while(n)
+	{
+		struct fdelay_tslog_block *b = (struct fdelay_tslog_block *) p;
+		int cnt = n < l->pol.block_records ? n : l->pol.block_records;
+
+		b->magic = FDELAY_TSLOG_BLOCK_MAGIC;
+		b->n_records = cnt;
+		b->encoding = l->pol.encoding;
+		b->flags = FDELAY_TSLOG_BLOCK_SORTED;
+		b->reserved = 0;
+		b->first_record = l->n_records;
+		b->max_utc = l->max_utc;
+		for(i = 0; i < cnt; i++)
+		{
+			if(rec[i].type != FDELAY_TSLOG_TIMESTAMP || (i && rec[i].utc < rec[i-1].utc))
+				b->flags &= ~FDELAY_TSLOG_BLOCK_SORTED;
+			if(rec[i].type == FDELAY_TSLOG_UNSYNCED)
+				continue;	/* local oscillator time: kept out of the seek and the segment ranges */
+			if(rec[i].utc > b->max_utc)
+				b->max_utc = rec[i].utc;
+			if(rec[i].type == FDELAY_TSLOG_TIMESTAMP)
+			{
+				if(!l->seg_events || rec[i].utc < l->first_utc)
+					l->first_utc = rec[i].utc;
+				if(!l->seg_events || rec[i].utc > l->last_utc)
+					l->last_utc = rec[i].utc;
+				l->seg_events++;
+			}
+		}
+
+		if(b->encoding == FDELAY_TSLOG_ENC_DELTA)
+			b->size = (char *) encode_delta(b, rec, cnt) - p;
+		else {
+			memcpy(b + 1, rec, cnt * sizeof(struct fdelay_tslog_record));
+			b->size = sizeof(struct fdelay_tslog_block) + cnt * sizeof(struct fdelay_tslog_record);
+		}
+
+		if(add_index(l, b, offset) < 0)
+			goto fail;
+
+		offset += b->size;
+		p += b->size;
+		rec += cnt;
+		n -= cnt;
+	}
+
+	l->encode_ns += fd_bus_stats_now() - t;
+
+	if(pwrite_all(l->fd, l->out, p - l->out, l->data_end) < 0)
+		goto fail;
+
+	l->data_end = offset;
+	return p - l->out;
+
+fail:
+	l->n_blocks = n_blocks;
+	l->n_records = n_records;
+	l->max_utc = max_utc;
+	l->seg_events = seg_events;
+	l->first_utc = first_utc;
+	l->last_utc = last_utc;
+	return -1;
+}
+
+/* Writes the block index at the end of the data of log file (fd), points its header (hdr) to it
+   and closes the file. */
+static int finish_file(struct fdelay_tslog *l, int fd, struct fdelay_tslog_header *hdr)
+{
+	int rv = 0;
+
+	hdr->n_blocks = l->n_blocks;
+	hdr->n_records = l->n_records;
+	hdr->index_offset = l->data_end;
+
+	if(pwrite_all(fd, l->index, l->n_blocks * sizeof(struct fdelay_tslog_index), l->data_end) < 0 ||
+		pwrite_all(fd, hdr, sizeof(*hdr), 0) < 0)
+		rv = -1;
+	if(l->pol.fsync_ms >= 0)
+		fdatasync(fd);
+	if(close(fd) < 0)
+		rv = -1;
+
+	return rv;
+}
+
+static void segment_path(char *path, const struct fdelay_tslog *l, int seq, int tmp)
+{
+	snprintf(path, PATH_MAX, "%s.%06d%s", l->prefix, seq, tmp ? ".tmp" : "");
+}
+
+/* Adds the line of segment (seq) to the manifest */
+static int manifest_add(struct fdelay_tslog *l, int seq, int64_t first_utc, int64_t last_utc, uint64_t events)
+{
+	char path[PATH_MAX], line[PATH_MAX + 80], *name, *m;
+	int len;
+
+	segment_path(path, l, seq, 0);
+	name = strrchr(path, '/');
+	len = snprintf(line, sizeof(line), "%s %lld %lld %llu\n", name ? name + 1 : path,
+		(long long) first_utc, (long long) last_utc, (unsigned long long) events);
+
+	m = realloc(l->manifest, l->manifest_len + len + 1);
+	if(!m)
+		return -1;
+	memcpy(m + l->manifest_len, line, len + 1);
+	l->manifest = m;
+	l->manifest_len += len;
+	return 0;
+}
+
+/* Replaces the manifest file with the contents of l->manifest */
+static int write_manifest(struct fdelay_tslog *l)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd, rv;
+
+	snprintf(path, sizeof(path), "%s.manifest", l->prefix);
+	snprintf(tmp, sizeof(tmp), "%s.manifest.tmp", l->prefix);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		return -1;
+
+	rv = pwrite_all(fd, l->manifest, l->manifest_len, 0);
+	if(l->pol.fsync_ms >= 0)
+		fdatasync(fd);
+	if(close(fd) < 0 || rv < 0)
+		return -1;
+
+	return rename(tmp, path);
+}
+
+/* Publishes the segment just finished: gives it its final name and lists it in the manifest */
+static int complete_segment(struct fdelay_tslog *l)
+{
+	char tmp[PATH_MAX], path[PATH_MAX];
+
+	segment_path(tmp, l, l->seq, 1);
+	segment_path(path, l, l->seq, 0);
+
+	if(rename(tmp, path) < 0)
+		return -1;
+
+	l->segments++;
+	if(manifest_add(l, l->seq, l->first_utc, l->last_utc, l->seg_events) < 0 || write_manifest(l) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Starts writing a new, empty segment or file */
+static void reset_segment(struct fdelay_tslog *l)
+{
+	l->data_end = FDELAY_TSLOG_HEADER_SIZE;
+	l->n_blocks = 0;
+	l->n_records = 0;
+	l->max_utc = 0;
+	l->seg_events = 0;
+	l->seg_start_ns = fd_bus_stats_now();
+}
+
+/* Creates the file of segment (seq) and writes the header (card table) to it */
+static int create_segment(struct fdelay_tslog *l, int seq, const struct fdelay_tslog_header *hdr)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	segment_path(path, l, seq, 1);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		return -1;
+
+	if(pwrite_all(fd, hdr, sizeof(*hdr), 0) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Completes the current segment and continues in the next one. Called by the writer thread. */
+static int rotate_segment(struct fdelay_tslog *l)
+{
+	struct fdelay_tslog_header hdr;
+	int fd, old_fd, rv = 0;
+
+	/* The cards can be added at any time: the header is copied and the file switched under the lock */
+	pthread_mutex_lock(&l->lock);
+	hdr = l->hdr;
+	fd = create_segment(l, l->seq + 1, &hdr);
+	if(fd < 0)
+	{
+		pthread_mutex_unlock(&l->lock);
+		l->seg_start_ns = fd_bus_stats_now();	/* retry later */
+		return -1;
+	}
+	old_fd = l->fd;
+	l->fd = fd;
+	pthread_mutex_unlock(&l->lock);
+
+	if(finish_file(l, old_fd, &hdr) < 0 || complete_segment(l) < 0)
+		rv = -1;
+
+	l->seq++;
+	reset_segment(l);
+	return rv;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct fdelay_tslog *l = arg;
+	uint64_t flush_ns = (uint64_t) l->pol.flush_ms * 1000000ULL;
+	uint64_t fsync_ns = (uint64_t) (l->pol.fsync_ms > 0 ? l->pol.fsync_ms : 0) * 1000000ULL;
+	uint64_t segment_ns = l->prefix ? (uint64_t) l->pol.segment_s * 1000000000ULL : 0;
+	uint64_t last_sync = fd_bus_stats_now();
+	uint64_t fsyncs = 0;
+	int64_t bytes = 0;
+	int dirty = 0, error = 0, closing;
+
+	pthread_mutex_lock(&l->lock);
+
+	for(;;)
+	{
+		struct fdelay_tslog_record *b;
+		struct timespec ts;
+		uint64_t now = fd_bus_stats_now();
+		int n;
+
+		if(!l->closing && l->fill < l->pol.flush_events && !(l->fill && now - l->first_ns >= flush_ns))
+		{
+			/* Sleep until the oldest record is due, the written data must be synced
+			   or the segment is old enough to be completed */
+			uint64_t due = 0;
+
+			if(l->fill)
+				due = l->first_ns + flush_ns;
+			else if(dirty && l->pol.fsync_ms > 0)
+				due = last_sync + fsync_ns;
+			if(segment_ns && l->n_records && (!due || l->seg_start_ns + segment_ns < due))
+				due = l->seg_start_ns + segment_ns;
+
+			if(!due)
+			{
+				pthread_cond_wait(&l->wake, &l->lock);
+				continue;
+			}
+
+			if(now < due)
+			{
+				deadline(&ts, due);
+				pthread_cond_timedwait(&l->wake, &l->lock, &ts);
+				continue;
+			}
+		}
+
+		b = l->buf[l->cur];
+		n = l->fill;
+		l->cur ^= 1;
+		l->fill = 0;
+		closing = l->closing;
+		pthread_cond_broadcast(&l->space);
+		pthread_mutex_unlock(&l->lock);
+
+		if(n)
+		{
+			bytes = write_blocks(l, b, n);
+			if(bytes < 0 && !error)
+				error = errno ? errno : EIO;
+			dirty = l->pol.fsync_ms >= 0;
+		}
+
+		now = fd_bus_stats_now();
+		if(dirty && l->pol.fsync_ms >= 0 && (closing || now - last_sync >= fsync_ns))
+		{
+			fdatasync(l->fd);
+			last_sync = now;
+			dirty = 0;
+			fsyncs++;
+		}
+
+		if(l->prefix && !closing && l->n_records && ((l->pol.segment_bytes > 0 && l->data_end >= l->pol.segment_bytes) ||
+			(segment_ns && now - l->seg_start_ns >= segment_ns)))
+		{
+			if(rotate_segment(l) < 0 && !error)
+				error = errno ? errno : EIO;
+			dirty = 0;
+		}
+
+		pthread_mutex_lock(&l->lock);
+
+		l->error = error;
+		l->stats.fsyncs = fsyncs;
+		l->stats.encode_ns = l->encode_ns;
+		l->stats.segments = l->segments;
+		if(n)
+		{
+			l->stats.writes++;
+			l->stats.records += n;
+			l->stats.bytes += bytes > 0 ? bytes : 0;
+			if(n > l->stats.max_batch)
+				l->stats.max_batch = n;
+		}
+
+		if(l->closing && !l->fill && !dirty)
+			break;
+	}
+
+	pthread_mutex_unlock(&l->lock);
+	return NULL;
+}
+
+/* Appends a record to the current buffer, waiting for the writer if it's full. Called with the lock held. */
+static void put_record(struct fdelay_tslog *l, const struct fdelay_tslog_record *r)
+{
+	if(l->fill == l->pol.buffer_events)
+	{
+		l->stats.stalls++;
+		pthread_cond_signal(&l->wake);
+		while(l->fill == l->pol.buffer_events)
+			pthread_cond_wait(&l->space, &l->lock);
+	}
+
+	if(!l->fill)
+		l->first_ns = fd_bus_stats_now();
+
+	l->buf[l->cur][l->fill++] = *r;
+
+	if(l->fill == l->pol.flush_events)
+		pthread_cond_signal(&l->wake);
+}
+
+static void put_marker(struct fdelay_tslog *l, int type)
+{
+	struct fdelay_tslog_record r;
+
+	memset(&r, 0, sizeof(r));
+	r.type = type;
+	pthread_mutex_lock(&l->lock);
+	put_record(l, &r);
+	pthread_mutex_unlock(&l->lock);
+}
+
+/* Prepares an existing log for appending: loads its block index (or rebuilds it from the blocks if the
+   file wasn't closed), drops the old index and anything after the last complete block. */
+static int load_existing(struct fdelay_tslog *l, uint64_t file_size)
+{
+	struct fdelay_tslog_header hdr;
+	struct fdelay_tslog_block b;
+	uint64_t offset, i;
+
+	if(pread(l->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr.magic, FDELAY_TSLOG_MAGIC, sizeof(hdr.magic)))
+		return -1;
+	l->hdr = hdr;
+
+	if(l->hdr.index_offset)
+	{
+		for(i = 0; i < l->hdr.n_blocks; i++)
+		{
+			struct fdelay_tslog_index e;
+
+			if(pread(l->fd, &e, sizeof(e), l->hdr.index_offset + i * sizeof(e)) != sizeof(e))
+				return -1;
+			b.first_record = e.first_record;
+			b.max_utc = e.max_utc;
+			b.n_records = e.n_records;
+			b.size = e.size;
+			if(add_index(l, &b, e.offset) < 0)
+				return -1;
+		}
+		l->data_end = l->hdr.index_offset;
+	} else {
+		offset = l->hdr.header_size;
+		while(offset + sizeof(b) <= file_size)
+		{
+			if(pread(l->fd, &b, sizeof(b), offset) != sizeof(b) || b.magic != FDELAY_TSLOG_BLOCK_MAGIC ||
+				b.size < sizeof(b) || offset + b.size > file_size)
+				break;
+			if(add_index(l, &b, offset) < 0)
+				return -1;
+			offset += b.size;
+		}
+		l->data_end = offset;
+	}
+
+	l->hdr.index_offset = 0;
+	if(pwrite_all(l->fd, &l->hdr, sizeof(l->hdr), 0) < 0 || ftruncate(l->fd, l->data_end) < 0)
+		return -1;
+
+	return 0;
+}
+
+static void free_log(struct fdelay_tslog *l)
+{
+	if(l->fd >= 0)
+		close(l->fd);
+	free(l->buf[0]);
+	free(l->buf[1]);
+	free(l->out);
+	free(l->index);
+	free(l->prefix);
+	free(l->manifest);
+	free(l);
+}
+
+/* Time range and number of timestamps of a segment, read back from the file */
+static int scan_segment(const char *path, int64_t *first_utc, int64_t *last_utc, uint64_t *events)
+{
+	struct fdelay_tslog_reader *r = fdelay_tslog_map(path);
+	struct fdelay_tslog_record rec[256];
+	uint64_t pos = 0;
+	int i, n;
+
+	if(!r)
+		return -1;
+
+	*events = 0;
+	*first_utc = *last_utc = 0;
+	while((n = fdelay_tslog_read(r, pos, rec, 256)) > 0)
+	{
+		for(i = 0; i < n; i++)
+		{
+			if(rec[i].type != FDELAY_TSLOG_TIMESTAMP)
+				continue;
+			if(!*events || rec[i].utc < *first_utc)
+				*first_utc = rec[i].utc;
+			if(!*events || rec[i].utc > *last_utc)
+				*last_utc = rec[i].utc;
+			(*events)++;
+		}
+		pos += n;
+	}
+
+	fdelay_tslog_unmap(r);
+	return 0;
+}
+
+/* Picks up a segmented log where the previous run left it: the numbering continues after the completed
+   segments, a segment left over by a crash is completed and the segments missing from the manifest
+   (the crash happened before it was updated) are added to it. */
+static int recover_segments(struct fdelay_tslog *l)
+{
+	char path[PATH_MAX], tmp[PATH_MAX], line[PATH_MAX + 2], *name;
+	int64_t first_utc, last_utc;
+	uint64_t events;
+	struct stat st;
+	int fd, i, rv, changed = 0;
+	FILE *f;
+
+	for(l->seq = 0;; l->seq++)
+	{
+		segment_path(path, l, l->seq, 0);
+		if(stat(path, &st) < 0)
+			break;
+	}
+
+	snprintf(path, sizeof(path), "%s.manifest", l->prefix);
+	f = fopen(path, "r");
+	if(f)
+	{
+		while(fgets(line, sizeof(line), f))
+		{
+			char *m = realloc(l->manifest, l->manifest_len + strlen(line) + 1);
+			if(!m)
+			{
+				fclose(f);
+				return -1;
+			}
+			strcpy(m + l->manifest_len, line);
+			l->manifest = m;
+			l->manifest_len += strlen(line);
+		}
+		fclose(f);
+	}
+
+	if(!l->manifest_len)
+	{
+		l->manifest = strdup("# segment first_utc last_utc timestamps\n");
+		if(!l->manifest)
+			return -1;
+		l->manifest_len = strlen(l->manifest);
+	}
+
+	segment_path(tmp, l, l->seq, 1);
+	fd = open(tmp, O_RDWR);
+	if(fd >= 0)
+	{
+		l->fd = fd;
+		rv = fstat(fd, &st) < 0 || st.st_size < sizeof(struct fdelay_tslog_header) ? 0 : load_existing(l, st.st_size);
+		l->fd = -1;
+		if(rv < 0)
+		{
+			close(fd);
+			return -1;
+		}
+
+		if(!l->n_blocks)
+		{
+			/* Nothing was logged to it */
+			close(fd);
+			unlink(tmp);
+		} else {
+			segment_path(path, l, l->seq, 0);
+			if(finish_file(l, fd, &l->hdr) < 0 || rename(tmp, path) < 0)
+				return -1;
+			l->seq++;
+		}
+	}
+
+	for(i = 0; i < l->seq; i++)
+	{
+		segment_path(path, l, i, 0);
+		name = strrchr(path, '/');
+		snprintf(line, sizeof(line), "\n%s ", name ? name + 1 : path);
+		if(strstr(l->manifest, line))
+			continue;
+
+		if(scan_segment(path, &first_utc, &last_utc, &events) < 0 || manifest_add(l, i, first_utc, last_utc, events) < 0)
+			return -1;
+		changed = 1;
+	}
+
+	if(changed && write_manifest(l) < 0)
+		return -1;
+
+	memset(&l->hdr, 0, sizeof(l->hdr));
+	return 0;
+}
+
+struct fdelay_tslog *fdelay_tslog_open(const char *filename, const struct fdelay_tslog_policy *policy)
+{
+	static const struct fdelay_tslog_policy default_policy = FDELAY_TSLOG_DEFAULT_POLICY;
+	struct fdelay_tslog *l;
+	pthread_condattr_t ca;
+	struct stat st;
+	int max_blocks;
+
+	l = (struct fdelay_tslog *) calloc(1, sizeof(struct fdelay_tslog));
+	if(!l)
+		return NULL;
+
+	l->pol = policy ? *policy : default_policy;
+	if(l->pol.buffer_events <= 0)
+		l->pol.buffer_events = default_policy.buffer_events;
+	if(l->pol.flush_events <= 0 || l->pol.flush_events > l->pol.buffer_events)
+		l->pol.flush_events = l->pol.buffer_events;
+	if(l->pol.flush_ms < 0)
+		l->pol.flush_ms = 0;
+	if(l->pol.block_records <= 0)
+		l->pol.block_records = default_policy.block_records;
+	if(l->pol.encoding != FDELAY_TSLOG_ENC_RAW)
+		l->pol.encoding = FDELAY_TSLOG_ENC_DELTA;
+
+	max_blocks = (l->pol.buffer_events + l->pol.block_records - 1) / l->pol.block_records;
+	l->buf[0] = malloc(l->pol.buffer_events * sizeof(struct fdelay_tslog_record));
+	l->buf[1] = malloc(l->pol.buffer_events * sizeof(struct fdelay_tslog_record));
+	/* Worst case: every record stored raw, with a tag byte (and a share of the group table) */
+	l->out = malloc(l->pol.buffer_events * (sizeof(struct fdelay_tslog_record) + 2) + max_blocks * (sizeof(struct fdelay_tslog_block) + 8));
+
+	if(l->pol.segment_bytes > 0 || l->pol.segment_s > 0)
+	{
+		l->fd = -1;
+		l->prefix = strdup(filename);
+		if(!l->buf[0] || !l->buf[1] || !l->out || !l->prefix || recover_segments(l) < 0)
+		{
+			fd_err("%s: can't recover the segmented log '%s'\n", __FUNCTION__, filename);
+			free_log(l);
+			return NULL;
+		}
+
+		memcpy(l->hdr.magic, FDELAY_TSLOG_MAGIC, sizeof(l->hdr.magic));
+		l->hdr.header_size = FDELAY_TSLOG_HEADER_SIZE;
+		reset_segment(l);
+		l->fd = create_segment(l, l->seq, &l->hdr);
+		if(l->fd < 0)
+		{
+			fd_err("%s: can't create a segment of the log '%s'\n", __FUNCTION__, filename);
+			free_log(l);
+			return NULL;
+		}
+	} else {
+		l->fd = open(filename, O_RDWR | O_CREAT, 0644);
+		if(!l->buf[0] || !l->buf[1] || !l->out || l->fd < 0 || fstat(l->fd, &st) < 0)
+		{
+			fd_err("%s: can't open the log file '%s'\n", __FUNCTION__, filename);
+			free_log(l);
+			return NULL;
+		}
+
+		if(st.st_size)
+		{
+			if(load_existing(l, st.st_size) < 0)
+			{
+				fd_err("%s: '%s' is not a valid timestamp log\n", __FUNCTION__, filename);
+				free_log(l);
+				return NULL;
+			}
+		} else {
+			memcpy(l->hdr.magic, FDELAY_TSLOG_MAGIC, sizeof(l->hdr.magic));
+			l->hdr.header_size = FDELAY_TSLOG_HEADER_SIZE;
+			l->data_end = FDELAY_TSLOG_HEADER_SIZE;
+			if(pwrite_all(l->fd, &l->hdr, sizeof(l->hdr), 0) < 0 || ftruncate(l->fd, l->data_end) < 0)
+			{
+				free_log(l);
+				return NULL;
+			}
+		}
+	}
+
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&l->wake, &ca);
+	pthread_cond_init(&l->space, NULL);
+	pthread_condattr_destroy(&ca);
+
+	put_marker(l, FDELAY_TSLOG_START);
+
+	if(pthread_create(&l->thread, NULL, writer_thread, l))
+	{
+		free_log(l);
+		return NULL;
+	}
+
+	return l;
+}
+
+/* FNV-1a hash of the location string */
+static int32_t card_id(const char *location)
+{
+	uint32_t h = 2166136261U;
+
+	while(*location)
+		h = (h ^ (uint8_t) *location++) * 16777619U;
+
+	return h & 0x7fffffff;
+}
+
+int fdelay_tslog_add_card(struct fdelay_tslog *l, const char *location)
+{
+	struct fdelay_tslog_card *c;
+	int i, rv;
+
+	pthread_mutex_lock(&l->lock);
+
+	for(i = 0; i < l->hdr.n_cards; i++)
+		if(!strncmp(l->hdr.cards[i].location, location, sizeof(c->location) - 1))
+			break;
+
+	if(i == l->hdr.n_cards)
+	{
+		if(i == FDELAY_TSLOG_MAX_CARDS)
+		{
+			pthread_mutex_unlock(&l->lock);
+			return -1;
+		}
+
+		c = &l->hdr.cards[l->hdr.n_cards++];
+		c->card_id = card_id(location);
+		strncpy(c->location, location, sizeof(c->location) - 1);
+
+		/* The header is rewritten right away, so that the card table survives a crash */
+		if(pwrite_all(l->fd, &l->hdr, sizeof(l->hdr), 0) < 0 && !l->error)
+			l->error = errno;
+	}
+
+	rv = l->error ? -1 : i;
+	pthread_mutex_unlock(&l->lock);
+	return rv;
+}
+
+int fdelay_tslog_write_record(struct fdelay_tslog *l, const struct fdelay_tslog_record *r)
+{
+	int rv;
+
+	pthread_mutex_lock(&l->lock);
+	put_record(l, r);
+	if(FDELAY_TSLOG_IS_TIMESTAMP(r->type))
+		l->stats.events++;
+	rv = l->error ? -1 : 0;
+	pthread_mutex_unlock(&l->lock);
+
+	return rv;
+}
+
+int fdelay_tslog_write(struct fdelay_tslog *l, int card, const fdelay_time_t *t)
+{
+	struct fdelay_tslog_record r;
+
+	r.utc = t->utc;
+	r.coarse = t->coarse;
+	r.frac = t->frac;
+	r.seq_id = t->seq_id;
+	r.card = card;
+	r.type = FDELAY_TSLOG_TIMESTAMP;
+	r.channel = 0;			/* the card has a single input */
+
+	return fdelay_tslog_write_record(l, &r);
+}
+
+int fdelay_tslog_close(struct fdelay_tslog *l)
+{
+	int rv;
+
+	put_marker(l, FDELAY_TSLOG_END);
+
+	pthread_mutex_lock(&l->lock);
+	l->closing = 1;
+	pthread_cond_signal(&l->wake);
+	pthread_mutex_unlock(&l->lock);
+
+	pthread_join(l->thread, NULL);
+
+	/* Append the block index and point the header to it */
+	rv = l->error ? -1 : 0;
+	if(finish_file(l, l->fd, &l->hdr) < 0)
+		rv = -1;
+	l->fd = -1;
+
+	if(l->prefix && complete_segment(l) < 0)
+		rv = -1;
+
+	pthread_mutex_destroy(&l->lock);
+	pthread_cond_destroy(&l->wake);
+	pthread_cond_destroy(&l->space);
+	free_log(l);
+	return rv;
+}
+
+void fdelay_tslog_get_stats(struct fdelay_tslog *l, struct fdelay_tslog_stats *st)
+{
+	pthread_mutex_lock(&l->lock);
+	*st = l->stats;
+	pthread_mutex_unlock(&l->lock);
+}
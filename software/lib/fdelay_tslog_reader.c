@@ -0,0 +1,395 @@
+/*
+	FmcDelay1ns4Cha (a.k.a. The Fine Delay Card)
+	User-space driver/library
+
+	Timestamp log reader. The file is mapped in memory; records are located
+	with a binary search in the block index (by record number or by time).
+	Delta-encoded blocks are decoded one group of records at a time, in a one-group cache.
+
+	(c) Copyright CERN 2012
+	Licensed under LGPL 2.1
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fdelay_lib.h"
+#include "fdelay_private.h"
+#include "fdelay_tslog.h"
+
+struct fdelay_tslog_reader {
+	const char *map;
+	size_t size;
+	const struct fdelay_tslog_header *hdr;
+	const struct fdelay_tslog_index *index;	/* in the file, or rebuilt in (own_index) */
+	struct fdelay_tslog_index *own_index;
+	uint64_t n_blocks;
+	uint64_t n_records;
+	struct fdelay_tslog_record cache[FDELAY_TSLOG_DELTA_GROUP];	/* the last decoded group */
+	uint64_t cache_blk;
+	int cache_group, cache_n;
+};
+
+/* 1/4096 cycle units in a second */
+#define UNITS_PER_SEC	(125000000LL * 4096LL)
+
+/* Rebuilds the index of a file which wasn't closed, stopping at the first incomplete block */
+static int rebuild_index(struct fdelay_tslog_reader *r)
+{
+	uint64_t offset = r->hdr->header_size, size = 0;
+
+	for(;;)
+	{
+		const struct fdelay_tslog_block *b = (const struct fdelay_tslog_block *) (r->map + offset);
+		struct fdelay_tslog_index *e;
+
+		if(offset + sizeof(*b) > r->size || b->magic != FDELAY_TSLOG_BLOCK_MAGIC ||
+			b->size < sizeof(*b) || offset + b->size > r->size)
+			break;
+
+		if(r->n_blocks == size)
+		{
+			size = size ? 2 * size : 1024;
+			e = realloc(r->own_index, size * sizeof(struct fdelay_tslog_index));
+			if(!e)
+				return -1;
+			r->own_index = e;
+		}
+
+		e = &r->own_index[r->n_blocks++];
+		e->offset = offset;
+		e->first_record = b->first_record;
+		e->max_utc = b->max_utc;
+		e->n_records = b->n_records;
+		e->size = b->size;
+		offset += b->size;
+	}
+
+	r->index = r->own_index;
+	return 0;
+}
+
+struct fdelay_tslog_reader *fdelay_tslog_map(const char *filename)
+{
+	struct fdelay_tslog_reader *r;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(struct fdelay_tslog_header))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	r = (struct fdelay_tslog_reader *) calloc(1, sizeof(struct fdelay_tslog_reader));
+	if(!r)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	r->size = st.st_size;
+	r->cache_blk = (uint64_t) -1;
+	r->map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(r->map == MAP_FAILED)
+	{
+		free(r);
+		return NULL;
+	}
+
+	r->hdr = (const struct fdelay_tslog_header *) r->map;
+
+	if(memcmp(r->hdr->magic, FDELAY_TSLOG_MAGIC, sizeof(r->hdr->magic)))
+		goto fail;
+
+	if(r->hdr->index_offset && r->hdr->index_offset + r->hdr->n_blocks * sizeof(struct fdelay_tslog_index) <= r->size)
+	{
+		r->index = (const struct fdelay_tslog_index *) (r->map + r->hdr->index_offset);
+		r->n_blocks = r->hdr->n_blocks;
+	} else if(rebuild_index(r) < 0)
+		goto fail;
+
+	if(r->n_blocks)
+		r->n_records = r->index[r->n_blocks - 1].first_record + r->index[r->n_blocks - 1].n_records;
+
+	madvise((void *) r->map, r->size, MADV_RANDOM);
+	return r;
+
+fail:
+	fdelay_tslog_unmap(r);
+	return NULL;
+}
+
+void fdelay_tslog_unmap(struct fdelay_tslog_reader *r)
+{
+	if(!r)
+		return;
+
+	munmap((void *) r->map, r->size);
+	free(r->own_index);
+	free(r);
+}
+
+const struct fdelay_tslog_header *fdelay_tslog_get_header(struct fdelay_tslog_reader *r)
+{
+	return r->hdr;
+}
+
+uint64_t fdelay_tslog_count(struct fdelay_tslog_reader *r)
+{
+	return r->n_records;
+}
+
+/* Returns the block containing record (index) */
+static uint64_t find_block(struct fdelay_tslog_reader *r, uint64_t index)
+{
+	uint64_t lo = 0, hi = r->n_blocks - 1;
+
+	while(lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo + 1) / 2;
+
+		if(r->index[mid].first_record <= index)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+static int group_count(const struct fdelay_tslog_block *b)
+{
+	if(b->encoding == FDELAY_TSLOG_ENC_RAW)
+		return 1;
+
+	return (b->n_records + FDELAY_TSLOG_DELTA_GROUP - 1) / FDELAY_TSLOG_DELTA_GROUP;
+}
+
+static const uint32_t *group_table(const struct fdelay_tslog_block *b)
+{
+	return (const uint32_t *) ((const char *) b + b->size) - group_count(b);
+}
+
+/* Decodes group (g) of a FDELAY_TSLOG_ENC_DELTA block to (out). Returns the number of records,
+   negative if the block is corrupted. */
+static int decode_group(const struct fdelay_tslog_block *b, int g, struct fdelay_tslog_record *out)
+{
+	const uint32_t *groups = group_table(b);
+	const uint8_t *p, *end = (const uint8_t *) groups;
+	int64_t delta = 0, t, carry;
+	uint64_t v;
+	int i, n;
+
+	if(groups[g] >= b->size)
+		return -1;
+
+	p = (const uint8_t *) b + groups[g];
+	n = b->n_records - g * FDELAY_TSLOG_DELTA_GROUP;
+	if(n > FDELAY_TSLOG_DELTA_GROUP)
+		n = FDELAY_TSLOG_DELTA_GROUP;
+
+	for(i = 0; i < n; i++)
+	{
+		struct fdelay_tslog_record *r = &out[i];
+		uint8_t tag;
+
+		if(p >= end)
+			return -1;
+
+		tag = *p++;
+		if(tag & FDELAY_TSLOG_TAG_RAW)
+		{
+			memcpy(r, p, sizeof(*r));
+			p += sizeof(*r);
+			delta = 0;
+			continue;
+		}
+
+		if(!i)
+			return -1;
+
+		*r = out[i-1];
+		if(tag & FDELAY_TSLOG_TAG_META)
+		{
+			r->card = *p++;
+			r->type = *p++;
+			p = fd_get_varint(p, &v);
+			r->channel = v;
+		}
+
+		p = fd_get_varint(p, &v);
+		delta += fd_unzigzag(v);
+		p = fd_get_varint(p, &v);
+		r->seq_id += 1 + (int16_t) fd_unzigzag(v);
+
+		t = (int64_t) r->coarse * 4096LL + r->frac + delta;
+		carry = t / UNITS_PER_SEC;
+		t -= carry * UNITS_PER_SEC;
+		if(t < 0)
+		{
+			t += UNITS_PER_SEC;
+			carry--;
+		}
+		r->utc += carry;
+		r->coarse = t >> 12;
+		r->frac = t & 0xfff;
+	}
+
+	return p > end ? -1 : n;
+}
+
+/* Returns the records of group (g) of block (blk) and their number in (n), NULL if they can't be decoded.
+   Raw blocks are a single group. */
+static const struct fdelay_tslog_record *group_records(struct fdelay_tslog_reader *r, uint64_t blk, int g, int *n)
+{
+	const struct fdelay_tslog_block *b = (const struct fdelay_tslog_block *) (r->map + r->index[blk].offset);
+
+	if(b->encoding == FDELAY_TSLOG_ENC_RAW)
+	{
+		*n = b->n_records;
+		return (const struct fdelay_tslog_record *) (b + 1);
+	}
+
+	if(b->encoding != FDELAY_TSLOG_ENC_DELTA || b->size < sizeof(*b) + group_count(b) * sizeof(uint32_t))
+		return NULL;
+
+	if(r->cache_blk != blk || r->cache_group != g)
+	{
+		r->cache_blk = (uint64_t) -1;
+		r->cache_n = decode_group(b, g, r->cache);
+		if(r->cache_n < 0)
+			return NULL;
+		r->cache_blk = blk;
+		r->cache_group = g;
+	}
+
+	*n = r->cache_n;
+	return r->cache;
+}
+
+uint64_t fdelay_tslog_seek(struct fdelay_tslog_reader *r, int64_t utc)
+{
+	const struct fdelay_tslog_block *blk;
+	const struct fdelay_tslog_record *rec;
+	uint64_t lo = 0, hi = r->n_blocks;
+	int g = 0, i, n;
+
+	/* First block whose running maximum reaches (utc): all the blocks before it are older */
+	while(lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if(r->index[mid].max_utc < utc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if(lo == r->n_blocks)
+		return r->n_records;
+
+	blk = (const struct fdelay_tslog_block *) (r->map + r->index[lo].offset);
+
+	/* In sorted delta blocks, start from the last group whose first (raw) record is older */
+	if(blk->encoding == FDELAY_TSLOG_ENC_DELTA && (blk->flags & FDELAY_TSLOG_BLOCK_SORTED) &&
+		blk->size >= sizeof(*blk) + group_count(blk) * sizeof(uint32_t))
+	{
+		const uint32_t *groups = group_table(blk);
+		int l = 0, h = group_count(blk);
+
+		while(l < h)
+		{
+			int mid = l + (h - l) / 2;
+			const struct fdelay_tslog_record *first = (const struct fdelay_tslog_record *) ((const char *) blk + groups[mid] + 1);
+
+			if(groups[mid] + 1 + sizeof(*first) <= blk->size && first->utc < utc)
+				l = mid + 1;
+			else
+				h = mid;
+		}
+		g = l ? l - 1 : 0;
+	}
+
+	for(; g < group_count(blk); g++)
+	{
+		rec = group_records(r, lo, g, &n);
+		if(!rec)
+			break;
+
+		if(blk->flags & FDELAY_TSLOG_BLOCK_SORTED)
+		{
+			int l = 0, h = n;
+
+			while(l < h)
+			{
+				int mid = l + (h - l) / 2;
+
+				if(rec[mid].utc < utc)
+					l = mid + 1;
+				else
+					h = mid;
+			}
+			i = l;
+		} else {
+			for(i = 0; i < n; i++)
+				if(rec[i].type == FDELAY_TSLOG_TIMESTAMP && rec[i].utc >= utc)
+					break;
+		}
+
+		if(i < n)
+			return r->index[lo].first_record + g * FDELAY_TSLOG_DELTA_GROUP + i;
+	}
+
+	/* Not in this block, or a group that can't be decoded */
+	return r->index[lo].first_record + (g < group_count(blk) ? g * FDELAY_TSLOG_DELTA_GROUP : blk->n_records);
+}
+
+int fdelay_tslog_read(struct fdelay_tslog_reader *r, uint64_t index, struct fdelay_tslog_record *rec, int n)
+{
+	uint64_t blk;
+	int done = 0;
+
+	if(index >= r->n_records || n <= 0)
+		return 0;
+
+	for(blk = find_block(r, index); blk < r->n_blocks && done < n; blk++)
+	{
+		const struct fdelay_tslog_block *b = (const struct fdelay_tslog_block *) (r->map + r->index[blk].offset);
+		uint64_t skip = index - r->index[blk].first_record;
+		int g = b->encoding == FDELAY_TSLOG_ENC_RAW ? 0 : skip / FDELAY_TSLOG_DELTA_GROUP;
+
+		skip -= g * FDELAY_TSLOG_DELTA_GROUP;
+
+		for(; g < group_count(b) && done < n; g++, skip = 0)
+		{
+			const struct fdelay_tslog_record *src;
+			int cnt, total;
+
+			src = group_records(r, blk, g, &total);
+			if(!src)
+				return done;
+
+			cnt = total - skip;
+			if(cnt > n - done)
+				cnt = n - done;
+
+			memcpy(rec + done, src + skip, cnt * sizeof(struct fdelay_tslog_record));
+			done += cnt;
+			index += cnt;
+		}
+	}
+
+	return done;
+}
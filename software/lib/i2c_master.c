@@ -3,36 +3,40 @@
 #include "fdelay_lib.h"
 #include "fdelay_private.h"
 #include "fd_main_regs.h"
+#include "i2c_master.h"
 
 
-#define M_SDA_OUT(x) {							\
-    if(x)								\
-      fd_writel(fd_readl(FD_REG_I2CR) | FD_I2CR_SDA_OUT, FD_REG_I2CR); \
-    else								\
-      fd_writel(fd_readl(FD_REG_I2CR) & (~FD_I2CR_SDA_OUT), FD_REG_I2CR); \
-      udelay(10);\
-  }
+/* The I2C lines are bit-banged through I2CR. The output bits are kept in a shadow copy
+   (hw->i2c_shadow), so toggling a line costs a single bus write instead of a read-modify-write.
+   Only the SDA input has to be read back from the hardware. */
 
-#define M_SCL_OUT(x) {							\
-    if(x)								\
-      fd_writel(fd_readl(FD_REG_I2CR) | FD_I2CR_SCL_OUT, FD_REG_I2CR); \
-    else								\
-      fd_writel(fd_readl(FD_REG_I2CR) & (~FD_I2CR_SCL_OUT), FD_REG_I2CR); \
-      udelay(10); \
-  }
+static inline void mi2c_set_lines(fdelay_device_t *dev, uint32_t mask, int x)
+{
+	fd_decl_private(dev);
+
+	if(x)
+		hw->i2c_shadow |= mask;
+	else
+		hw->i2c_shadow &= ~mask;
+
+	fd_writel(hw->i2c_shadow, FD_REG_I2CR);
+	if(hw->i2c_delay_us)
+		udelay(hw->i2c_delay_us);
+}
+
+#define M_SDA_OUT(x) mi2c_set_lines(dev, FD_I2CR_SDA_OUT, (x))
+#define M_SCL_OUT(x) mi2c_set_lines(dev, FD_I2CR_SCL_OUT, (x))
 
 #define M_SDA_IN ((fd_readl(FD_REG_I2CR) & FD_I2CR_SDA_IN) ? 1 : 0)
 
 static void mi2c_start(fdelay_device_t *dev)
 {
-	fd_decl_private(dev);
   M_SDA_OUT(0);
   M_SCL_OUT(0);
 }
 
 static void mi2c_repeat_start(fdelay_device_t *dev)
 {
-	fd_decl_private(dev);
   M_SDA_OUT(1);
   M_SCL_OUT(1);
   M_SDA_OUT(0);
@@ -41,7 +45,6 @@ static void mi2c_repeat_start(fdelay_device_t *dev)
 
 static void mi2c_stop(fdelay_device_t *dev)
 {
-	fd_decl_private(dev);
   M_SDA_OUT(0);
   M_SCL_OUT(1);
   M_SDA_OUT(1);
@@ -97,12 +100,28 @@ void mi2c_get_byte(fdelay_device_t *dev, unsigned char *data, int ack)
   *data= indata;
 }
 
+/* Sets the SCL frequency (in kHz). Each line transition is followed by a half SCL period delay.
+   Slow buses (VME, Etherbone) take longer than that to complete a single write, so
+   the delay is a lower bound on the edge spacing, not an exact clock. */
+void mi2c_set_speed(fdelay_device_t *dev, int speed_khz)
+{
+	fd_decl_private(dev);
+
+	if(speed_khz <= 0)
+		speed_khz = MI2C_DEFAULT_SPEED_KHZ;
+
+	hw->i2c_delay_us = (500 + speed_khz - 1) / speed_khz;
+}
+
 void mi2c_init(fdelay_device_t *dev)
 {
 	fd_decl_private(dev);
 
-	M_SCL_OUT(1);
-	M_SDA_OUT(1);
+	mi2c_set_speed(dev, MI2C_DEFAULT_SPEED_KHZ);
+
+	hw->i2c_shadow = FD_I2CR_SCL_OUT | FD_I2CR_SDA_OUT;
+	fd_writel(hw->i2c_shadow, FD_REG_I2CR);
+	udelay(hw->i2c_delay_us);
 }
 
 void mi2c_scan(fdelay_device_t *dev)
@@ -118,12 +137,16 @@ void mi2c_scan(fdelay_device_t *dev)
  	}
 }
 
+/* Reads (size) bytes starting at (offset) using a single sequential read burst: the address is
+   sent once and the EEPROM auto-increments it for each acknowledged byte. */
 int eeprom_read(fdelay_device_t *dev, uint8_t i2c_addr, uint32_t offset, uint8_t *buf, size_t size)
 {
 	int i;
 	unsigned char c;
-	for(i=0;i<size;i++)
-	{
+
+	if(!size)
+		return 0;
+
  	mi2c_start(dev);
 	if(mi2c_put_byte(dev, i2c_addr << 1) < 0)
  	{
@@ -133,15 +156,17 @@ int eeprom_read(fdelay_device_t *dev, uint8_t i2c_addr, uint32_t offset, uint8_t
 
 	mi2c_put_byte(dev, (offset >> 8) & 0xff);
 	mi2c_put_byte(dev, offset & 0xff);
-	offset++;
-	mi2c_stop(dev);
-	mi2c_start(dev);
+	mi2c_repeat_start(dev);
  	mi2c_put_byte(dev, (i2c_addr << 1) | 1);
-	mi2c_get_byte(dev, &c, 0);
-//	printf("readback: %x\n", c);
-	*buf++ = c;
+
+	/* ACK all bytes but the last one, which ends the burst */
+	for(i=0;i<size;i++)
+	{
+		mi2c_get_byte(dev, &c, i != size - 1);
+		*buf++ = c;
+	}
+
  	mi2c_stop(dev);
- 	}
  	return size;
 }
 
@@ -1,5 +1,7 @@
 #include  <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "fdelay_lib.h"
 #include "fdelay_private.h"
@@ -23,8 +25,8 @@
 #define   CDR_OVD_MSK  (0xFFFF<<16)
 
 
-#define ow_writel(data, addr) dev->writel(dev->priv_io, data, (hw->base_onewire + (addr)))
-#define ow_readl(addr) dev->readl(dev->priv_io, (hw->base_onewire + (addr)))
+#define ow_writel(data, addr) fd_bus_writel(dev, hw, data, (hw->base_onewire + (addr)), __func__)
+#define ow_readl(addr) fd_bus_readl(dev, hw, (hw->base_onewire + (addr)), __func__)
 
 #define CLK_DIV_NOR 624/2
 #define CLK_DIV_OVD 124/2
@@ -35,13 +37,32 @@ static void ow_init(fdelay_device_t *dev)
     ow_writel(((CLK_DIV_NOR & CDR_NOR_MSK) | (( CLK_DIV_OVD << CDR_OVD_OFS) & CDR_OVD_MSK)), R_CDR);
 }
 
+/* Minimum durations of a time slot and of a reset cycle in normal speed mode, in microseconds.
+   The master core won't finish a cycle earlier than that, so there's no point in
+   polling CSR before that time has elapsed - over a slow bus (VME, Etherbone)
+   each poll is a full round trip. */
+#define OW_SLOT_US 60
+#define OW_RESET_US 480
+
+/* Waits until the current 1-wire cycle is finished and returns the final CSR value.
+   The CSR value read in the last poll is returned directly, so a slot that has
+   already completed costs a single bus read. */
+static uint32_t ow_wait_cycle(fdelay_device_t *dev, int min_us)
+{
+	fd_decl_private(dev);
+	uint32_t reg;
+
+	udelay(min_us);
+	while((reg = ow_readl(R_CSR)) & CSR_CYC_MSK);
+	return reg;
+}
+
 static int ow_reset(fdelay_device_t *dev, int port)
 {
     fd_decl_private(dev);
     uint32_t data = ((port<<CSR_SEL_OFS) & CSR_SEL_MSK) | CSR_CYC_MSK | CSR_RST_MSK;
     ow_writel(data, R_CSR);
-    while(ow_readl(R_CSR) & CSR_CYC_MSK);
-    uint32_t reg = ow_readl(R_CSR);
+    uint32_t reg = ow_wait_cycle(dev, OW_RESET_US);
     return ~reg & CSR_DAT_MSK;
 }
 
@@ -51,8 +72,7 @@ static int slot(fdelay_device_t *dev, int port, int bit)
 	uint32_t data;
     data = ((port<<CSR_SEL_OFS) & CSR_SEL_MSK) | CSR_CYC_MSK | (bit & CSR_DAT_MSK);
     ow_writel(data, R_CSR);
-    while(ow_readl(R_CSR) & CSR_CYC_MSK);
-    uint32_t   reg = ow_readl(R_CSR);
+    uint32_t   reg = ow_wait_cycle(dev, OW_SLOT_US);
     return reg & CSR_DAT_MSK;
 }
 
@@ -79,23 +99,24 @@ int ow_write_byte(fdelay_device_t *dev, int port, int byte)
     return byte_old == data ? 0 : -1;
 }
 
-int ow_write_block(fdelay_device_t *dev, int port, uint8_t *block, int len)
+/* Writes (len) bytes from (block) to the bus. Each written bit is read back
+   during its slot, so a collision on the bus is detected without extra
+   transactions. Returns 0 on success, -1 if any of the bytes got corrupted. */
+int ow_write_block(fdelay_device_t *dev, int port, const uint8_t *block, int len)
 {
-    int i;
+    int i, rv = 0;
     for(i=0;i<len;i++)
-    {
-        *block++ = ow_write_byte(dev, port, *block);
-    }
-    return 0;
+        if(ow_write_byte(dev, port, block[i]) < 0)
+            rv = -1;
+    return rv;
 }
 
+/* Reads (len) bytes from the bus into (block). */
 int ow_read_block(fdelay_device_t *dev, int port, uint8_t *block, int len)
 {
    int i;
     for(i=0;i<len;i++)
-    {
-        *block++ = ow_read_byte(dev, port);
-    }
+        block[i] = ow_read_byte(dev, port);
     return 0;
 }
 
@@ -117,58 +138,53 @@ static uint8_t ds18x_id [8];
 
 int ds18x_read_serial(fdelay_device_t *dev, uint8_t *id)
 {
-    int i;
-
     if(!ow_reset(dev, 0))
         return -1;
 
     ow_write_byte(dev, 0, ROM_READ);
-    for(i=0;i<8;i++)
-    {
-		*id = ow_read_byte(dev, 0);
-        id++;
-    }
+    ow_read_block(dev, 0, id, 8);
 
     return 0;
 }
 
-static int ds18x_access(fdelay_device_t *dev, uint8_t *id)
+/* Addresses the sensor with a given ROM ID and issues a function command (cmd).
+   The MATCH ROM command, the ID and the function command go out as a single block. */
+static int ds18x_access(fdelay_device_t *dev, uint8_t *id, uint8_t cmd)
 {
-    int i;
+    uint8_t block[10];
+
     if(!ow_reset(dev, 0))
 		return -1;
 
-    if(ow_write_byte(dev, 0, ROM_MATCH) < 0)
-		return -1;
-    for(i=0;i<8;i++)
-		if(ow_write_byte(dev, 0, id[i]) < 0)
-			return -1;
+    block[0] = ROM_MATCH;
+    memcpy(block + 1, id, 8);
+    block[9] = cmd;
+
+    return ow_write_block(dev, 0, block, sizeof(block));
 }
 
 int ds18x_read_temp(fdelay_device_t *dev, int *temp_r)
 {
-    int i;
     uint8_t data[9];
 
 
-	if(ds18x_access(dev, ds18x_id) < 0)
+	if(ds18x_access(dev, ds18x_id, READ_SCRATCHPAD) < 0)
 		return -1;
-    ow_write_byte(dev, 0, READ_SCRATCHPAD);
 
-    for(i=0;i<9;i++) data[i] = ow_read_byte(dev, 0);
+    ow_read_block(dev, 0, data, 9);
 
     int  temp = ((int)data[1] << 8) | ((int)data[0]);
     if(temp & 0x1000)
        temp = -0x10000 + temp;
 
-    ds18x_access(dev, ds18x_id);
-    ow_write_byte(dev, 0, CONVERT_TEMP);
+    ds18x_access(dev, ds18x_id, CONVERT_TEMP);
 
 	if(temp_r) *temp_r = temp;
 	return 0;
 }
 
-int ds18x_init(fdelay_device_t *dev)
+/* Finds the sensor and reads its ID, leaving the scratchpad alone */
+int ds18x_attach(fdelay_device_t *dev)
 {
 
 	ow_init(dev);
@@ -176,11 +192,19 @@ int ds18x_init(fdelay_device_t *dev)
 	if(ds18x_read_serial(dev, ds18x_id) < 0)
 		return -1;
 
-	dbg("Found DS18xx sensor: %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
+	fd_info("Found DS18xx sensor: %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
 		ds18x_id[0], ds18x_id[1], ds18x_id[2], ds18x_id[3],
 		ds18x_id[4], ds18x_id[5], ds18x_id[6], ds18x_id[7]);
 
+	return 0;
+}
+
+int ds18x_init(fdelay_device_t *dev)
+{
+	if(ds18x_attach(dev) < 0)
+		return -1;
+
+	/* Start the first conversion - the result will be ready in ~750 ms */
 	ds18x_read_temp(dev, NULL);
-	sleep(1);
 	return 0;
 }
@@ -0,0 +1,1318 @@
+/* Microbenchmarks of the library hot paths, running against the simulated card.
+
+   Usage: fdelay_bench [-l latency] [-n iterations] [-f filter]
+
+   -l: bus latency of the simulator: pcie, vme, etherbone or <read_ns>,<write_ns> (default: none)
+   -n: base number of iterations for the pure computation benchmarks (default: 1000000)
+   -f: run only the benchmarks whose name contains (filter)
+
+   The results go to stdout, one line per benchmark:
+   <name> <iterations> <ns/op> <bus reads/op> <bus writes/op>
+   so the output of two builds can be compared with a simple script. Lines starting with '#' are comments.
+   The benchmarks also check their results: the errors go to stderr and the exit status is non-zero. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "fdelay_lib.h"
+#include "fdelay_private.h"
+#include "fdelay_sim.h"
+#include "fdelay_sched.h"
+#include "fdelay_tslog.h"
+#include "fdelay_acq.h"
+#include "onewire.h"
+
+static const char *filter = NULL;
+static fdelay_device_t *dev;
+
+/* Number of failed checks: the exit status of the program */
+static int failures = 0;
+
+/* Accumulates results of the computations, so the compiler can't optimize them away */
+static volatile int64_t sink;
+
+struct bench_mark {
+	uint64_t ns;
+	uint64_t reads, writes;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void mark(struct bench_mark *m)
+{
+	fd_decl_private(dev)
+
+	m->ns = now_ns();
+	m->reads = hw ? hw->bus_reads : 0;
+	m->writes = hw ? hw->bus_writes : 0;
+}
+
+static void report(const char *name, int64_t iters, const struct bench_mark *start)
+{
+	struct bench_mark end;
+
+	mark(&end);
+	printf("%-24s %10lld %12.2f %10.2f %10.2f\n", name, (long long) iters,
+		(double) (end.ns - start->ns) / (double) iters,
+		(double) (end.reads - start->reads) / (double) iters,
+		(double) (end.writes - start->writes) / (double) iters);
+	fflush(stdout);
+}
+
+/* Reports a failed check */
+static void fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	failures++;
+}
+
+static int enabled(const char *name)
+{
+	return !filter || strstr(name, filter);
+}
+
+/* Pseudo-random test vectors (xorshift), so every run works on the same data */
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng()
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+#define N_VECTORS 4096
+
+static uint64_t ps_vec[N_VECTORS];
+static fdelay_time_t ts_vec[N_VECTORS];
+
+static void make_vectors()
+{
+	int i;
+
+	for(i = 0; i < N_VECTORS; i++)
+	{
+		ps_vec[i] = rng() % 10000000000000ULL; /* up to 10 seconds */
+		ts_vec[i] = fdelay_from_picos(ps_vec[i]);
+	}
+}
+
+/* The original, division-based picosecond conversion, used as the reference. Not inlined,
+   so it costs the same call overhead as the library version. */
+static __attribute__((noinline)) fdelay_time_t from_picos_ref(const uint64_t ps)
+{
+	fdelay_time_t t;
+	uint64_t tmp = ps;
+
+	t.frac = (tmp % 8000ULL) * (uint64_t)(1<<FDELAY_FRAC_BITS) / 8000ULL;
+	tmp -= (tmp % 8000ULL);
+	tmp /= 8000ULL;
+	t.coarse = tmp % 125000000ULL;
+	tmp -= (tmp % 125000000ULL);
+	tmp /= 125000000ULL;
+	t.utc = tmp;
+
+	return t;
+}
+
+static int check_from_picos(uint64_t ps)
+{
+	fdelay_time_t a = fdelay_from_picos(ps), b = from_picos_ref(ps);
+
+	if(a.utc != b.utc || a.coarse != b.coarse || a.frac != b.frac)
+	{
+		fprintf(stderr, "from_picos(%llu) mismatch: %lld:%d:%d, should be %lld:%d:%d\n", (unsigned long long) ps,
+			(long long) a.utc, a.coarse, a.frac, (long long) b.utc, b.coarse, b.frac);
+		return 1;
+	}
+	return 0;
+}
+
+/* Compares fdelay_from_picos() with the reference: exhaustively over the first 250 cycles,
+   around every second boundary, around all powers of two and at the top of the range. */
+static int verify_from_picos()
+{
+	struct bench_mark m;
+	uint64_t ps, sec, n = 0;
+	int errors = 0, b, d;
+
+	mark(&m);
+
+	for(ps = 0; ps < 2000000ULL; ps++, n++)
+		errors += check_from_picos(ps);
+
+	for(sec = 1; sec <= UINT64_MAX / 1000000000000ULL && errors < 10; sec++)
+		for(d = -8001; d <= 8001; d += 4000, n++)
+			errors += check_from_picos(sec * 1000000000000ULL + d);
+
+	for(b = 1; b < 64; b++)
+		for(d = -9000; d <= 9000; d++, n++)
+			errors += check_from_picos((1ULL << b) + d);
+
+	for(ps = UINT64_MAX - 1000000ULL; ps != 0; ps++, n++)
+		errors += check_from_picos(ps);
+
+	report("verify_from_picos", n, &m);
+
+	if(errors)
+		fprintf(stderr, "from_picos verification: %d error(s)\n", errors);
+
+	return errors;
+}
+
+/* Timestamp value in units of frac (1/4096 of the 8 ns cycle) - the exact reference for the
+   timestamp arithmetic checks */
+static __int128 ts_units(fdelay_time_t t)
+{
+	return (((__int128) t.utc * 125000000 + t.coarse) << FDELAY_FRAC_BITS) + t.frac;
+}
+
+static int ts_valid(fdelay_time_t t)
+{
+	return t.coarse >= 0 && t.coarse < 125000000 && t.frac >= 0 && t.frac < (1 << FDELAY_FRAC_BITS);
+}
+
+/* A random normalized timestamp within +/- 2^40 seconds */
+static fdelay_time_t rand_ts()
+{
+	fdelay_time_t t;
+
+	t.utc = (int64_t) (rng() & 0xffffffffffULL) - (1LL << 39);
+	t.coarse = rng() % 125000000;
+	t.frac = rng() & 0xfff;
+	return t;
+}
+
+static int ts_error(const char *op, fdelay_time_t a, fdelay_time_t b, fdelay_time_t r)
+{
+	fprintf(stderr, "%s(%lld:%d:%d, %lld:%d:%d) = %lld:%d:%d is wrong\n", op, (long long) a.utc, a.coarse, a.frac,
+		(long long) b.utc, b.coarse, b.frac, (long long) r.utc, r.coarse, r.frac);
+	return 1;
+}
+
+/* Checks the timestamp arithmetic against exact integer arithmetic on random and boundary values,
+   and against plain picoseconds for values exactly representable in both (multiples of 125 ps) */
+static int verify_ts(int64_t n)
+{
+	static const int64_t ps_limits[] = { INT64_MIN, INT64_MIN + 1, -1, 0, 1, INT64_MAX };
+	struct bench_mark m;
+	int64_t i;
+	int errors = 0;
+
+	mark(&m);
+
+	/* ts_add_ps at the ends of the offset range */
+	for(i = 0; i < sizeof(ps_limits) / sizeof(ps_limits[0]); i++)
+	{
+		fdelay_time_t a = rand_ts(), r = fdelay_ts_add_ps(a, ps_limits[i]);
+		__int128 d = ts_units(fdelay_from_picos((uint64_t) (ps_limits[i] < 0 ? -(__int128) ps_limits[i] : ps_limits[i])));
+
+		if(!ts_valid(r) || ts_units(r) != ts_units(a) + (ps_limits[i] < 0 ? -d : d))
+			errors += ts_error("ts_add_ps", a, fdelay_from_picos((uint64_t) ps_limits[i]), r);
+	}
+
+	for(i = 0; i < n && errors < 10; i++)
+	{
+		fdelay_time_t a = rand_ts(), b = rand_ts(), r;
+		int64_t k = (int64_t) (rng() % 2000001) - 1000000;
+		uint64_t pa, pb;
+
+		/* boundary cases: fields at their limits */
+		if(i & 1)
+		{
+			a.coarse = (i & 2) ? 124999999 : 0;
+			b.coarse = (i & 4) ? 124999999 : 0;
+			a.frac = (i & 8) ? 4095 : 0;
+			b.frac = (i & 16) ? 4095 : 0;
+		}
+
+		r = fdelay_ts_add(a, b);
+		if(!ts_valid(r) || ts_units(r) != ts_units(a) + ts_units(b))
+			errors += ts_error("ts_add", a, b, r);
+
+		r = fdelay_ts_sub(a, b);
+		if(!ts_valid(r) || ts_units(r) != ts_units(a) - ts_units(b))
+			errors += ts_error("ts_sub", a, b, r);
+
+		if((fdelay_ts_cmp(a, b) > 0) != (ts_units(a) > ts_units(b)) || (fdelay_ts_cmp(a, b) < 0) != (ts_units(a) < ts_units(b))
+		   || fdelay_ts_cmp(a, a) != 0)
+			errors += ts_error("ts_cmp", a, b, a);
+
+		b.utc >>= 20; /* keep the product within int64 seconds */
+		r = fdelay_ts_scale(b, k);
+		if(!ts_valid(r) || ts_units(r) != ts_units(b) * k)
+			errors += ts_error("ts_scale", b, fdelay_from_picos(k), r);
+
+		r = a;
+		r.frac += (int32_t) (rng() & 0x3fffffff) - 0x20000000;
+		r.coarse += (int32_t) (rng() & 0x3fffffff) - 0x20000000;
+		b = fdelay_ts_normalize(r);
+		if(!ts_valid(b) || ts_units(b) != ts_units(r))
+			errors += ts_error("ts_normalize", r, r, b);
+
+		/* picosecond reference */
+		pa = (rng() % 100000000000000ULL) / 125 * 125;
+		pb = (rng() % 100000000000000ULL) / 125 * 125;
+		a = fdelay_from_picos(pa);
+		b = fdelay_from_picos(pb);
+
+		if(fdelay_to_picos(fdelay_ts_add(a, b)) != (int64_t) (pa + pb))
+			errors += ts_error("ts_add [ps]", a, b, fdelay_ts_add(a, b));
+		if(fdelay_to_picos(fdelay_ts_sub(a, b)) != (int64_t) pa - (int64_t) pb)
+			errors += ts_error("ts_sub [ps]", a, b, fdelay_ts_sub(a, b));
+		if(fdelay_to_picos(fdelay_ts_add_ps(a, (int64_t) pb - 50000000000000LL)) != (int64_t) pa + (int64_t) pb - 50000000000000LL)
+			errors += ts_error("ts_add_ps [ps]", a, b, fdelay_ts_add_ps(a, (int64_t) pb - 50000000000000LL));
+		k %= 10000; /* pa * k within int64 */
+		if(fdelay_to_picos(fdelay_ts_scale(a, k)) != (int64_t) pa * k)
+			errors += ts_error("ts_scale [ps]", a, fdelay_from_picos(k), fdelay_ts_scale(a, k));
+	}
+
+	report("verify_ts", i, &m);
+
+	if(errors)
+		fprintf(stderr, "timestamp arithmetic verification: %d error(s)\n", errors);
+
+	return errors;
+}
+
+static void bench_conversions(int64_t n)
+{
+	struct bench_mark m;
+	int64_t i, j, acc = 0;
+	fdelay_time_t tb[N_VECTORS];
+	int64_t pb[N_VECTORS];
+
+	if(enabled("from_picos"))
+	{
+		mark(&m);
+		for(i = 0; i < n; i++)
+			acc += from_picos_ref(ps_vec[i & (N_VECTORS - 1)]).frac;
+		report("from_picos_ref", n, &m);
+
+		mark(&m);
+		for(i = 0; i < n; i++)
+			acc += fdelay_from_picos(ps_vec[i & (N_VECTORS - 1)]).frac;
+		report("from_picos", n, &m);
+
+		mark(&m);
+		for(i = 0; i < n; i += N_VECTORS)
+		{
+			fdelay_from_picos_batch(ps_vec, tb, N_VECTORS);
+			for(j = 0; j < N_VECTORS; j += 64)
+				acc += tb[j].frac;
+		}
+		report("from_picos_batch", i, &m);
+	}
+
+	if(enabled("to_picos"))
+	{
+		mark(&m);
+		for(i = 0; i < n; i++)
+			acc += fdelay_to_picos(ts_vec[i & (N_VECTORS - 1)]);
+		report("to_picos", n, &m);
+
+		mark(&m);
+		for(i = 0; i < n; i += N_VECTORS)
+		{
+			fdelay_to_picos_batch(ts_vec, pb, N_VECTORS);
+			for(j = 0; j < N_VECTORS; j += 64)
+				acc += pb[j];
+		}
+		report("to_picos_batch", i, &m);
+	}
+
+	sink = acc;
+}
+
+static void bench_ts_arith(int64_t n)
+{
+	struct bench_mark m;
+	int64_t i, acc = 0;
+
+	if(enabled("ts_add"))
+	{
+		mark(&m);
+		for(i = 0; i < n; i++)
+			acc += fdelay_ts_add(ts_vec[i & (N_VECTORS - 1)], ts_vec[(i + 1) & (N_VECTORS - 1)]).coarse;
+		report("ts_add", n, &m);
+	}
+
+	if(enabled("ts_sub"))
+	{
+		mark(&m);
+		for(i = 0; i < n; i++)
+			acc += fdelay_ts_sub(ts_vec[i & (N_VECTORS - 1)], ts_vec[(i + 1) & (N_VECTORS - 1)]).coarse;
+		report("ts_sub", n, &m);
+	}
+
+	if(enabled("ts_add_ps"))
+	{
+		mark(&m);
+		for(i = 0; i < n; i++)
+			acc += fdelay_ts_add_ps(ts_vec[i & (N_VECTORS - 1)], (int64_t) ps_vec[(i + 1) & (N_VECTORS - 1)] - 5000000000000LL).coarse;
+		report("ts_add_ps", n, &m);
+	}
+
+	if(enabled("ts_cmp"))
+	{
+		mark(&m);
+		for(i = 0; i < n; i++)
+			acc += fdelay_ts_cmp(ts_vec[i & (N_VECTORS - 1)], ts_vec[(i + 1) & (N_VECTORS - 1)]);
+		report("ts_cmp", n, &m);
+	}
+
+	if(enabled("ts_scale"))
+	{
+		mark(&m);
+		for(i = 0; i < n; i++)
+			acc += fdelay_ts_scale(ts_vec[i & (N_VECTORS - 1)], i & 0xffff).coarse;
+		report("ts_scale", n, &m);
+	}
+
+	if(enabled("ts_normalize_multi"))
+	{
+		mark(&m);
+		for(i = 0; i < n; i++)
+		{
+			fdelay_time_t t = ts_vec[i & (N_VECTORS - 1)];
+			t.frac += (int32_t) (ps_vec[(i + 1) & (N_VECTORS - 1)] & 0xfffff) - 0x80000;
+			t.coarse += (int32_t) (ps_vec[(i + 2) & (N_VECTORS - 1)] & 0x3fffffff) - 0x20000000;
+			acc += fdelay_ts_normalize(t).coarse;
+		}
+		report("ts_normalize_multi", n, &m);
+	}
+
+	if(enabled("ts_normalize"))
+	{
+		mark(&m);
+		for(i = 0; i < n; i++)
+		{
+			fdelay_time_t t = ts_vec[i & (N_VECTORS - 1)];
+			t.coarse = (t.coarse - 62500000) & 0xfffffff; /* half of them wrapped below zero */
+			acc += ts_normalize(t).coarse;
+		}
+		report("ts_normalize", n, &m);
+	}
+
+	sink = acc;
+}
+
+static void bench_postprocess(int64_t n)
+{
+	struct bench_mark m;
+	int64_t i, acc = 0;
+
+	if(!enabled("ts_postprocess"))
+		return;
+
+	mark(&m);
+	for(i = 0; i < n; i++)
+	{
+		fdelay_time_t t = ts_vec[i & (N_VECTORS - 1)];
+		t.raw.utc = t.utc;
+		t.raw.coarse = t.coarse >> 5;
+		t.raw.start_offset = t.coarse & 0x1f;
+		t.raw.frac = (int32_t) (ps_vec[i & (N_VECTORS - 1)] & 0x1ffff);
+		t.raw.subcycle_offset = (int32_t) (ps_vec[i & (N_VECTORS - 1)] >> 20) & 0x3f;
+		ts_postprocess(dev, &t);
+		acc += t.frac;
+	}
+	report("ts_postprocess", n, &m);
+
+	sink = acc;
+}
+
+/* Reads the timestamp buffer filled with (batch) timestamps at a time, (rounds) times. Only
+   the readout is timed. */
+static void bench_read_drain(int rounds, int batch)
+{
+	struct bench_mark m;
+	uint64_t t_read = 0, reads = 0, writes = 0;
+	fdelay_time_t buf[256];
+	int r, i, n = 0;
+
+	if(!enabled("read_drain"))
+		return;
+
+	fdelay_configure_readout(dev, 1);
+	fdelay_configure_trigger(dev, 1, 0);
+
+	for(r = 0; r < rounds; r++)
+	{
+		struct bench_mark m2;
+
+		for(i = 0; i < batch; i++)
+			fdelay_sim_trigger(dev, ts_vec[i & (N_VECTORS - 1)]);
+
+		mark(&m);
+		for(i = 0; i < batch; )
+		{
+			int got = fdelay_read(dev, buf, batch - i < 256 ? batch - i : 256);
+			if(got <= 0)
+				break;
+			i += got;
+		}
+		mark(&m2);
+		n += i;
+		t_read += m2.ns - m.ns;
+		reads += m2.reads - m.reads;
+		writes += m2.writes - m.writes;
+	}
+
+	fdelay_configure_readout(dev, 0);
+
+	printf("%-24s %10d %12.2f %10.2f %10.2f\n", "read_drain", n, (double) t_read / n, (double) reads / n, (double) writes / n);
+	fflush(stdout);
+}
+
+static void bench_pulse_gen(int n)
+{
+	struct bench_mark m;
+	fdelay_time_t t;
+	int i;
+
+	if(!enabled("configure_pulse_gen"))
+		return;
+
+	fdelay_get_time(dev, &t);
+	t.utc += 100;
+
+	mark(&m);
+	for(i = 0; i < n; i++)
+	{
+		t.frac = i & 0xfff;
+		fdelay_configure_pulse_gen(dev, 1 + (i & 3), 1, t, 1000000, 2000000, 1);
+	}
+	report("configure_pulse_gen", n, &m);
+}
+
+/* configure_pulse_gen again, with every access recorded in the bus trace, which is then
+   saved and decoded to check the round trip */
+static void bench_bus_trace(int n)
+{
+	struct bench_mark m;
+	fdelay_time_t t;
+	FILE *f, *text;
+	char last[5][128];
+	int i, saved, lines = 0;
+
+	if(!enabled("bus_trace"))
+		return;
+
+	fdelay_get_time(dev, &t);
+	t.utc += 100;
+
+	fdelay_bus_trace_enable(dev, 65536);
+
+	mark(&m);
+	for(i = 0; i < n; i++)
+	{
+		t.frac = i & 0xfff;
+		fdelay_configure_pulse_gen(dev, 1 + (i & 3), 1, t, 1000000, 2000000, 1);
+	}
+	report("bus_trace_pulse_gen", n, &m);
+
+	saved = fdelay_bus_trace_save(dev, "/tmp/fdelay_bench.trace");
+	fdelay_bus_trace_enable(dev, 0);
+
+	f = fopen("/tmp/fdelay_bench.trace", "rb");
+	text = tmpfile();
+	if(saved < 0 || !f || !text || fdelay_bus_trace_decode(f, text) < 0)
+	{
+		fail("bus trace: save/decode failed\n");
+		return;
+	}
+	fclose(f);
+
+	/* Show the last pulse generator programming */
+	rewind(text);
+	while(fgets(last[lines % 5], sizeof(last[0]), text))
+		lines++;
+	fclose(text);
+
+	for(i = lines > 5 ? lines - 5 : 0; i < lines; i++)
+		printf("# %s", last[i % 5]);
+	printf("# bus trace: %d accesses saved, %d lines decoded\n", saved, lines);
+	fflush(stdout);
+}
+
+/* Stages and commits a new start time on all four outputs at once */
+static void bench_commit_pulse_gen(int n)
+{
+	struct bench_mark m;
+	fdelay_time_t t;
+	int i;
+
+	if(!enabled("commit_pulse_gen"))
+		return;
+
+	fdelay_get_time(dev, &t);
+	t.utc += 100;
+
+	mark(&m);
+	for(i = 0; i < n; i++)
+	{
+		t.frac = i & 0xfff;
+		fdelay_stage_pulse_gen(dev, 0xf, 1, t, 1000000, 2000000, 1);
+		fdelay_commit_pulse_gen(dev, 0xf);
+	}
+	report("commit_pulse_gen", n, &m);
+}
+
+/* fdelay_configure_output() used to print its parameters on every call */
+static void bench_configure_output(int n)
+{
+	struct bench_mark m;
+	int i;
+
+	if(!enabled("configure_output"))
+		return;
+
+	mark(&m);
+	for(i = 0; i < n; i++)
+		fdelay_configure_output(dev, 1 + (i & 3), 1, 500000 + (i & 0xfff), 1000000, 2000000, 1);
+	report("configure_output", n, &m);
+}
+
+/* Cost of a message below the log levels and of one going to the trace buffer only */
+/* Reads the board temperature from the DS18x sensor: a reset and 80 slots to address it and
+   send READ SCRATCHPAD, 72 slots to read the scratchpad, then another reset and 80 slots to start
+   the next conversion. Each slot is a bus write and a CSR poll, so the time depends on the latency. */
+static void bench_ds18x(int n)
+{
+	struct bench_mark m;
+	int i, temp = 0, errors = 0;
+
+	if(!enabled("ds18x_read_temp"))
+		return;
+
+	fdelay_sim_set_temperature(dev, 42.5);
+	ds18x_read_temp(dev, NULL);		/* latches the new temperature */
+
+	mark(&m);
+	for(i = 0; i < n; i++)
+		if(ds18x_read_temp(dev, &temp) < 0 || temp != 42.5 * 16)
+			errors++;
+	report("ds18x_read_temp", n, &m);
+
+	if(errors)
+		fail("ds18x_read_temp: %d wrong reads (last %d/16 degC, expected %d)\n", errors, temp, (int) (42.5 * 16));
+
+	fdelay_sim_set_temperature(dev, 40.0);
+}
+
+static void bench_log(int64_t n)
+{
+	struct bench_mark m;
+	int64_t i;
+
+	if(enabled("log_disabled"))
+	{
+		mark(&m);
+		for(i = 0; i < n; i++)
+			dbg("%s: CH%d: value %lld\n", __FUNCTION__, (int) (i & 3), (long long) i);
+		report("log_disabled", n, &m);
+	}
+
+	if(enabled("log_trace"))
+	{
+		mark(&m);
+		for(i = 0; i < n; i++)
+			fd_info("%s: CH%d: value %lld\n", __FUNCTION__, (int) (i & 3), (long long) i);
+		report("log_trace", n, &m);
+	}
+}
+
+/* Timestamp (i) of the tslog benchmarks: 1 kHz, with up to +-64 ns of jitter */
+static void tslog_bench_time(int i, fdelay_time_t *t)
+{
+	int64_t units = (int64_t) i * 125000LL * 4096LL + (int64_t) (((uint32_t) i * 2654435761U) >> 16) - 32768;
+	int64_t sec = 125000000LL * 4096LL, carry = units < 0 ? -1 : units / sec;
+
+	units -= carry * sec;
+	memset(t, 0, sizeof(*t));
+	t->utc = 1000000 + carry;
+	t->coarse = units >> 12;
+	t->frac = units & 0xfff;
+	t->seq_id = i;
+}
+
+/* Logs (n) timestamps with (encoding), checks what's read back and looks up random seconds
+   in the resulting file. */
+static void bench_tslog_encoding(int n, int encoding, const char *suffix)
+{
+	const char *name = "/tmp/fdelay_bench.log";
+	struct fdelay_tslog_policy pol = FDELAY_TSLOG_DEFAULT_POLICY;
+	struct fdelay_tslog_record first, last, prev, *rec;
+	struct fdelay_tslog_stats st;
+	struct fdelay_tslog_reader *rd;
+	struct fdelay_tslog *l;
+	struct bench_mark m, m_total;
+	fdelay_time_t t;
+	char bname[64];
+	uint64_t pos;
+	int i, j, got, card, errors = 0;
+
+	unlink(name);
+	pol.encoding = encoding;
+	l = fdelay_tslog_open(name, &pol);
+	card = fdelay_tslog_add_card(l, "sim");
+
+	mark(&m_total);
+	mark(&m);
+	for(i = 0; i < n; i++)
+	{
+		tslog_bench_time(i, &t);
+		fdelay_tslog_write(l, card, &t);
+	}
+	snprintf(bname, sizeof(bname), "tslog_write%s", suffix);
+	report(bname, n, &m);
+
+	fdelay_tslog_get_stats(l, &st);
+	fdelay_tslog_close(l);
+	snprintf(bname, sizeof(bname), "tslog_sustained%s", suffix);
+	report(bname, n, &m_total);
+
+	printf("# tslog%s: %.2f bytes/event, encoding %.1f ns/event, %llu batches written while logging (largest %d events), %llu fsyncs, %llu stalls\n",
+		suffix, (double) st.bytes / st.records, (double) st.encode_ns / st.records, (unsigned long long) st.writes, st.max_batch,
+		(unsigned long long) st.fsyncs, (unsigned long long) st.stalls);
+
+	/* Check the START/END framing and that nothing got lost or changed */
+	rd = fdelay_tslog_map(name);
+	if(!rd || fdelay_tslog_count(rd) != n + 2)
+	{
+		fail("tslog%s: %lld records read back, expected %d\n", suffix, rd ? (long long) fdelay_tslog_count(rd) : -1LL, n + 2);
+		return;
+	}
+	fdelay_tslog_read(rd, 0, &first, 1);
+	fdelay_tslog_read(rd, n + 1, &last, 1);
+	if(first.type != FDELAY_TSLOG_START || last.type != FDELAY_TSLOG_END)
+		fail("tslog%s: bad framing (first type %d, last type %d)\n", suffix, first.type, last.type);
+
+	rec = malloc(1024 * sizeof(struct fdelay_tslog_record));
+	mark(&m);
+	for(i = 0; i < n; i += got)
+	{
+		got = fdelay_tslog_read(rd, i + 1, rec, n - i < 1024 ? n - i : 1024);
+		if(got <= 0)
+			break;
+
+		for(j = 0; j < got; j++)
+		{
+			tslog_bench_time(i + j, &t);
+			if(rec[j].utc != t.utc || rec[j].coarse != t.coarse || rec[j].frac != t.frac ||
+				rec[j].seq_id != (uint16_t) t.seq_id || rec[j].card != card || rec[j].type != FDELAY_TSLOG_TIMESTAMP)
+				errors++;
+		}
+	}
+	snprintf(bname, sizeof(bname), "tslog_read%s", suffix);
+	report(bname, n, &m);
+	free(rec);
+	if(errors || i != n)
+		fail("tslog%s: %d records read back wrong, %d read\n", suffix, errors, i);
+
+	errors = 0;
+	mark(&m);
+	for(i = 0; i < 100000; i++)
+	{
+		int64_t utc = 1000000 + rng() % (n / 1000);
+
+		pos = fdelay_tslog_seek(rd, utc);
+		fdelay_tslog_read(rd, pos, &first, 1);
+		fdelay_tslog_read(rd, pos - 1, &prev, 1);
+		if(first.utc != utc || (prev.type == FDELAY_TSLOG_TIMESTAMP && prev.utc >= utc))
+			errors++;
+	}
+	snprintf(bname, sizeof(bname), "tslog_seek%s", suffix);
+	report(bname, 100000, &m);
+	if(errors)
+		fail("tslog%s: %d wrong seek results\n", suffix, errors);
+
+	fdelay_tslog_unmap(rd);
+}
+
+/* Segmented log: the cost of the rollovers, and a check that the segments listed in the manifest
+   hold all the timestamps, in consecutive time ranges */
+static void bench_tslog_segments(int n)
+{
+	const char *prefix = "/tmp/fdelay_bench_seg";
+	struct fdelay_tslog_policy pol = FDELAY_TSLOG_DEFAULT_POLICY;
+	struct fdelay_tslog_stats st;
+	struct fdelay_tslog *l;
+	struct bench_mark m;
+	fdelay_time_t t;
+	char path[256], name[64];
+	long long first, last, prev_last = -1;
+	unsigned long long events, total = 0;
+	int i, card, segments = 0, errors = 0;
+	FILE *f;
+
+	for(i = 0;; i++)
+	{
+		snprintf(path, sizeof(path), "%s.%06d", prefix, i);
+		if(unlink(path) < 0)
+			break;
+	}
+	snprintf(path, sizeof(path), "%s.manifest", prefix);
+	unlink(path);
+
+	pol.segment_bytes = 256 * 1024;
+	l = fdelay_tslog_open(prefix, &pol);
+	card = fdelay_tslog_add_card(l, "sim");
+
+	mark(&m);
+	for(i = 0; i < n; i++)
+	{
+		tslog_bench_time(i, &t);
+		fdelay_tslog_write(l, card, &t);
+	}
+	fdelay_tslog_get_stats(l, &st);
+	fdelay_tslog_close(l);
+	report("tslog_segmented", n, &m);
+
+	f = fopen(path, "r");
+	if(!f)
+	{
+		fail("tslog_segmented: no manifest\n");
+		return;
+	}
+
+	fgets(path, sizeof(path), f);		/* header */
+	while(fscanf(f, "%63s %lld %lld %llu", name, &first, &last, &events) == 4)
+	{
+		struct fdelay_tslog_reader *rd;
+
+		snprintf(path, sizeof(path), "/tmp/%s", name);
+		rd = fdelay_tslog_map(path);
+		if(!rd || first > last || first < prev_last)
+			errors++;
+		if(rd)
+			fdelay_tslog_unmap(rd);
+		prev_last = last;
+		total += events;
+		segments++;
+	}
+	fclose(f);
+
+	printf("# tslog_segmented: %d segments (%llu completed while logging), %llu timestamps listed\n",
+		segments, (unsigned long long) st.segments, total);
+	if(errors || total != n)
+		fail("tslog_segmented: %d bad segments, %llu timestamps instead of %d\n", errors, total, n);
+}
+
+/* Timestamp logging: one fwrite() + fflush() per event (the old gs_logger) vs the batched log writer,
+   with raw and delta-encoded blocks. tslog_write is the cost on the readout thread, tslog_sustained
+   includes writing everything out, tslog_read decodes the whole file sequentially and tslog_seek
+   looks up random seconds in it (1000 events per second). tslog_segmented splits the log in 256 kB segments. */
+static void bench_tslog(int n)
+{
+	struct fdelay_tslog_v1_record old;
+	struct bench_mark m;
+	FILE *f;
+	int i;
+
+	if(enabled("log_fflush"))
+	{
+		memset(&old, 0, sizeof(old));
+		f = fopen("/tmp/fdelay_bench.log", "w");
+		mark(&m);
+		for(i = 0; i < n; i++)
+		{
+			old.utc = i;
+			fwrite(&old, sizeof(old), 1, f);
+			fflush(f);
+		}
+		report("log_fflush", n, &m);
+		fclose(f);
+	}
+
+	if(enabled("tslog_raw"))
+		bench_tslog_encoding(n, FDELAY_TSLOG_ENC_RAW, "_raw");
+
+	if(enabled("tslog"))
+		bench_tslog_encoding(n, FDELAY_TSLOG_ENC_DELTA, "");
+
+	if(enabled("tslog_segmented"))
+		bench_tslog_segments(n);
+
+	fflush(stdout);
+}
+
+static uint64_t cpu_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+struct acq_consumer {
+	struct fdelay_acq_queue *q;
+	int n, errors;
+};
+
+static void *acq_consumer_thread(void *arg)
+{
+	struct acq_consumer *c = arg;
+	struct fdelay_acq_entry e[256];
+	int i, got, done = 0;
+
+	while(done < c->n)
+	{
+		got = fdelay_acq_pop(c->q, e, 256);
+		if(!got)
+			sched_yield();
+
+		for(i = 0; i < got; i++, done++)
+			if(e[i].t.utc != done)
+				c->errors++;
+	}
+
+	return NULL;
+}
+
+/* Readout -> logger queue (gs_logger): one card's timestamps passed to a consumer thread,
+   which checks that none are lost or reordered */
+static void bench_acq(int n)
+{
+	struct acq_consumer c;
+	struct fdelay_acq_stats st;
+	struct bench_mark m;
+	pthread_t thread;
+	fdelay_time_t t;
+	int i;
+
+	if(!enabled("acq_queue"))
+		return;
+
+	memset(&t, 0, sizeof(t));
+	c.q = fdelay_acq_queue_create(4096);
+	c.n = n;
+	c.errors = 0;
+	pthread_create(&thread, NULL, acq_consumer_thread, &c);
+
+	mark(&m);
+	for(i = 0; i < n; i++)
+	{
+		t.utc = i;
+		while(fdelay_acq_push(c.q, &t, 0) < 0)
+			sched_yield();
+	}
+	pthread_join(thread, NULL);
+	report("acq_queue", n, &m);
+
+	fdelay_acq_get_stats(c.q, &st);
+	printf("# acq_queue: max backlog %llu, drain latency avg %.1f us max %.1f us, queue full %llu times\n",
+		(unsigned long long) st.max_backlog, (double) st.latency_sum_ns / st.events / 1000.0,
+		(double) st.latency_max_ns / 1000.0, (unsigned long long) st.full);
+	if(c.errors || st.events != n)
+		fail("acq_queue: %d timestamps out of order, %llu received\n", c.errors, (unsigned long long) st.events);
+
+	fdelay_acq_queue_free(c.q);
+}
+
+static void acq_bench_time(int64_t ps, fdelay_time_t *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->utc = 1000000 + ps / 1000000000000LL;
+	t->coarse = (ps % 1000000000000LL) / 8000;
+	t->frac = ((ps % 8000) << 12) / 8000;
+}
+
+/* Time-ordered merge of 4 cards (4 kHz each, with some jitter) in steps of 64 events per card.
+   ACQ_BENCH_LAG: card 3 delivers its events 40 events (10 ms of card time) behind the others all along,
+   beyond the 1 ms watermark. Its events older than the last event emitted when they're read out have to
+   come out as late, and only those.
+   ACQ_BENCH_UNSYNCED: card 3 loses the WR sync for the middle half of the run; its time jumps 2 s ahead
+   and drifts. Its unsynchronized events have to come out in its order and nothing may be late. */
+#define ACQ_BENCH_SYNCED	0
+#define ACQ_BENCH_LAG		1
+#define ACQ_BENCH_UNSYNCED	2
+
+#define ACQ_BENCH_LAG_EVENTS	40
+
+static void bench_acq_merge(const char *name, int n, int mode)
+{
+	struct fdelay_acq_merge_config cfg = FDELAY_ACQ_MERGE_DEFAULT_CONFIG;
+	struct fdelay_acq_queue *q[4];
+	struct fdelay_acq_merge *merge;
+	struct fdelay_acq_merge_stats st;
+	struct fdelay_acq_event ev[512];
+	struct bench_mark m;
+	fdelay_time_t t, last;
+	int64_t ps;
+	int i, c, k, got, end, unsynced, errors = 0, pushed[4] = { 0 }, total = 0, late = 0, behind = 0;
+	int pushed_unsynced = 0, n_unsynced = 0, next_seq = 0;
+
+	if(!enabled(name))
+		return;
+
+	for(c = 0; c < 4; c++)
+		q[c] = fdelay_acq_queue_create(4096);
+	merge = fdelay_acq_merge_create(q, 4, &cfg);
+	memset(&last, 0, sizeof(last));
+
+	mark(&m);
+	for(i = 0; i <= n / 4; i += 64)
+	{
+		for(c = 0; c < 4; c++)
+		{
+			/* The last step is the lagging card catching up */
+			end = i + 64;
+			if(mode == ACQ_BENCH_LAG && c == 3 && i + 64 <= n / 4)
+				end -= ACQ_BENCH_LAG_EVENTS;
+
+			while(pushed[c] < end)
+			{
+				unsynced = mode == ACQ_BENCH_UNSYNCED && c == 3 && pushed[c] >= n / 16 && pushed[c] < 3 * n / 16;
+
+				ps = (int64_t) pushed[c] * 250000000LL + c * 60000000LL + (int64_t) (rng() % 1000000);
+				if(unsynced)
+					ps += 2000000000000LL + (int64_t) pushed[c] * 1000000LL;
+				acq_bench_time(ps, &t);
+				t.seq_id = pushed[c]++;
+
+				if(unsynced)
+					pushed_unsynced++;
+				else if(fdelay_ts_cmp(t, last) < 0)
+					behind++;
+				fdelay_acq_push(q[c], &t, unsynced ? FDELAY_ACQ_UNSYNCED : 0);
+			}
+		}
+
+		do {
+			got = i + 64 <= n / 4 ? fdelay_acq_merge_poll(merge, ev, 512) : fdelay_acq_merge_flush(merge, ev, 512);
+			for(k = 0; k < got; k++)
+			{
+				/* Card 3's events, unsynchronized or not, come out in its order */
+				if(ev[k].card == 3 && ev[k].t.seq_id != (uint16_t) next_seq++)
+					errors++;
+
+				if(ev[k].flags & FDELAY_ACQ_UNSYNCED)
+					n_unsynced++;
+				else if(ev[k].flags & FDELAY_ACQ_LATE)
+				{
+					if(fdelay_ts_cmp(ev[k].t, last) >= 0)
+						errors++;
+					late++;
+				} else if(fdelay_ts_cmp(ev[k].t, last) < 0)
+					errors++;
+				else
+					last = ev[k].t;
+			}
+			total += got;
+		} while(got);
+	}
+	report(name, total, &m);
+
+	fdelay_acq_merge_get_stats(merge, &st);
+	printf("# %s: %d events, %d late, %d unsynced, %llu emitted after max_delay_ms\n", name,
+		total, late, n_unsynced, (unsigned long long) st.forced);
+	if(errors || total != pushed[0] + pushed[1] + pushed[2] + pushed[3] || late != behind || n_unsynced != pushed_unsynced ||
+		(mode == ACQ_BENCH_LAG && !late) || (mode == ACQ_BENCH_UNSYNCED && (late || !n_unsynced)))
+		fail("%s: %d events out of order, %d of %d emitted, %d late, %d behind the merge when read out, %d of %d unsynced\n",
+			name, errors, total, pushed[0] + pushed[1] + pushed[2] + pushed[3], late, behind, n_unsynced, pushed_unsynced);
+
+	fdelay_acq_merge_free(merge);
+	for(c = 0; c < 4; c++)
+		fdelay_acq_queue_free(q[c]);
+}
+
+#define WAIT_MAX_ITERS 1000
+
+/* Arms output 1 (lead_us) ahead and waits for the pulse, either spinning on fdelay_channel_triggered()
+   or with fdelay_wait_outputs(). The reported time per op is the median detection latency: from
+   the pulse start to the return of the wait (the mean would be dominated by host scheduling hiccups). */
+static void bench_wait(const char *name, int n, int lead_us, int use_wait)
+{
+	struct bench_mark m, m2;
+	uint64_t host, cpu, cpu_total = 0, wall_total = 0, lat[WAIT_MAX_ITERS];
+	fdelay_wait_t w;
+	fdelay_time_t t;
+	int i;
+
+	if(!enabled(name))
+		return;
+
+	if(n > WAIT_MAX_ITERS)
+		n = WAIT_MAX_ITERS;
+
+	w.dev = dev;
+	w.channel_mask = 1;
+
+	for(i = 0; i < n; i++)
+	{
+		host = now_ns();
+		fdelay_get_time(dev, &t);
+		host = (host + now_ns()) / 2;
+
+		t = fdelay_ts_add_ps(t, (int64_t) lead_us * 1000000LL);
+		fdelay_configure_pulse_gen(dev, 1, 1, t, 1000000, 0, 1);
+
+		mark(&m);
+		cpu = cpu_ns();
+		if(use_wait)
+			fdelay_wait_outputs(&w, 1, FDELAY_WAIT_ALL, -1);
+		else
+			while(!fdelay_channel_triggered(dev, 1));
+		mark(&m2);
+
+		cpu_total += cpu_ns() - cpu;
+		wall_total += m2.ns - m.ns;
+		lat[i] = m2.ns - (host + (uint64_t) lead_us * 1000ULL);
+		m.reads = m2.reads - m.reads;
+		m.writes = m2.writes - m.writes;
+	}
+
+	qsort(lat, n, sizeof(uint64_t), cmp_u64);
+
+	printf("%-24s %10d %12.2f %10.2f %10.2f\n", name, n, (double) lat[n / 2], (double) m.reads, (double) m.writes);
+	printf("# %s: CPU use %.1f%% of the wait time, max. detection latency %llu ns\n", name,
+		100.0 * (double) cpu_total / (double) wall_total, (unsigned long long) lat[n - 1]);
+	fflush(stdout);
+}
+
+/* Plays back (n) pulses spaced by (spacing_ps) on each output through the scheduler. The reported
+   time per pulse is the host time spent on it (completion check + re-arming), not the spacing.
+   A channel holds one armed pulse at a time, so the arming setup time (half the spacing) must cover
+   the detection of the previous pulse and the host's scheduling hiccups: a missed pulse is a failure. */
+static void bench_sched(int n, int64_t spacing_ps)
+{
+	struct fdelay_sched *s;
+	struct fdelay_sched_stats st;
+	struct bench_mark m, m2;
+	fdelay_pulse_t p;
+	uint64_t service = 0, done = 0, missed = 0, detect = 0;
+	double max_rate = 0;
+	int64_t min_lead = INT64_MAX;
+	fdelay_time_t t;
+	int ch, i;
+
+	if(!enabled("sched"))
+		return;
+
+	s = fdelay_sched_create(dev, n, spacing_ps / 2);
+
+	fdelay_get_time(dev, &t);
+	t = fdelay_ts_add_ps(t, 10 * FDELAY_SCHED_DEFAULT_SETUP_PS);
+
+	for(i = 0; i < n; i++)
+	{
+		t = fdelay_ts_add_ps(t, spacing_ps);
+		for(ch = 1; ch <= 4; ch++)
+		{
+			p.start = fdelay_ts_add_ps(t, ch * 1000000);
+			p.width_ps = 1000000;
+			fdelay_sched_push(s, ch, &p, 1);
+		}
+	}
+
+	mark(&m);
+	fdelay_sched_run(s);
+	mark(&m2);
+
+	for(ch = 1; ch <= 4; ch++)
+	{
+		fdelay_sched_get_stats(s, ch, &st);
+		service += st.service_ns * st.armed;
+		detect += st.detect_ns * st.done;
+		done += st.done;
+		missed += st.missed;
+		if(st.armed && st.min_lead_ps < min_lead)
+			min_lead = st.min_lead_ps;
+		if(ch == 1 || st.max_rate_hz < max_rate)
+			max_rate = st.max_rate_hz;
+	}
+
+	fdelay_sched_destroy(s);
+
+	if(missed || !done)
+	{
+		fail("sched: %lld of %lld pulses missed at a %lld ns spacing\n", (long long) missed, (long long) (4 * n),
+			(long long) (spacing_ps / 1000));
+		return;
+	}
+
+	printf("%-24s %10lld %12.2f %10.2f %10.2f\n", "sched_pulse", (long long) done, (double) service / done,
+		(double) (m2.reads - m.reads) / done, (double) (m2.writes - m.writes) / done);
+	printf("# sched: max sustainable rate %.0f Hz/channel (detection %lld ns), min arming lead %lld ns\n",
+		max_rate, (long long) (detect / done), (long long) (min_lead / 1000));
+	fflush(stdout);
+}
+
+/* Loses and regains the WR lock (n) times, handled as gs_logger does it: fdelay_wr_resync(), then the
+   lock is polled while the readout goes on. Reported per cycle: the resync and the polls. Checks that
+   the timestamps taken while unsynced are read out. */
+static void bench_wr_resync(int n)
+{
+	struct bench_mark m, m2;
+	uint64_t t = 0, reads = 0, writes = 0;
+	fdelay_time_t ts;
+	int i, lost = 0, read = 0, relocked = 0;
+
+	if(!enabled("wr_resync"))
+		return;
+
+	fdelay_sim_set_wr(dev, 1, 1);
+	fdelay_configure_sync(dev, FDELAY_SYNC_WR);
+	fdelay_configure_readout(dev, 1);
+	fdelay_configure_trigger(dev, 1, 0);
+
+	for(i = 0; i < n; i++)
+	{
+		fdelay_sim_set_wr(dev, 1, 0);
+
+		mark(&m);
+		if(fdelay_dbg_sync_lost(dev) && fdelay_check_sync(dev) <= 0)
+		{
+			lost++;
+			fdelay_wr_resync(dev);
+		}
+		fdelay_check_sync(dev);
+		mark(&m2);
+		t += m2.ns - m.ns;
+		reads += m2.reads - m.reads;
+		writes += m2.writes - m.writes;
+
+		fdelay_sim_trigger(dev, ts_vec[i & (N_VECTORS - 1)]);
+		read += fdelay_read(dev, &ts, 1) == 1;
+
+		fdelay_sim_set_wr(dev, 1, 1);
+
+		mark(&m);
+		relocked += fdelay_check_sync(dev) > 0;
+		mark(&m2);
+		t += m2.ns - m.ns;
+		reads += m2.reads - m.reads;
+		writes += m2.writes - m.writes;
+	}
+
+	fdelay_configure_readout(dev, 0);
+	fdelay_configure_sync(dev, FDELAY_SYNC_LOCAL);
+	fdelay_sim_set_wr(dev, 0, 0);
+
+	printf("%-24s %10d %12.2f %10.2f %10.2f\n", "wr_resync", n, (double) t / n, (double) reads / n, (double) writes / n);
+	if(lost != n || read != n || relocked != n)
+		fail("wr_resync: %d losses detected, %d timestamps read while unsynced, %d relocks, of %d\n",
+			lost, read, relocked, n);
+	fflush(stdout);
+}
+
+/* Reports the phases of fdelay_init() (in particular the output calibration loops) */
+static void report_init(void)
+{
+	struct fdelay_init_profile prof;
+	char name[64];
+	int i;
+
+	if(fdelay_get_init_profile(dev, &prof) < 0)
+		return;
+
+	for(i = 0; i < FDELAY_NUM_PHASES; i++)
+	{
+		struct fdelay_phase_stats *ph = &prof.phases[i];
+
+		snprintf(name, sizeof(name), "init_%s", ph->name);
+		if(!ph->count || !enabled(name))
+			continue;
+
+		printf("%-24s %10d %12.2f %10.2f %10.2f\n", name, ph->count,
+			(double) ph->time_us * 1000.0 / ph->count,
+			(double) ph->bus_reads / ph->count, (double) ph->bus_writes / ph->count);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *latency = "";
+	int64_t n = 1000000;
+	int opt;
+
+	while((opt = getopt(argc, argv, "l:n:f:h")) != -1)
+	{
+		switch(opt)
+		{
+		case 'l': latency = optarg; break;
+		case 'n': n = atoll(optarg); break;
+		case 'f': filter = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-l pcie|vme|etherbone|<read_ns>,<write_ns>] [-n iterations] [-f filter]\n", argv[0]);
+			return opt == 'h' ? 0 : -1;
+		}
+	}
+
+	make_vectors();
+
+	dev = (fdelay_device_t *) calloc(1, sizeof(fdelay_device_t));
+
+	printf("# fdelay_bench: latency '%s', %lld iterations\n", latency, (long long) n);
+	printf("# %-22s %10s %12s %10s %10s\n", "name", "iters", "ns/op", "reads/op", "writes/op");
+
+	if(enabled("verify_from_picos") && verify_from_picos())
+		return -1;
+
+	if(enabled("verify_ts") && verify_ts(n))
+		return -1;
+
+	bench_conversions(n);
+	bench_ts_arith(n);
+
+	if(fdelay_sim_attach(dev, latency) < 0 || fdelay_init(dev, 0) < 0)
+	{
+		fprintf(stderr, "Simulated card initialization failed.\n");
+		return -1;
+	}
+
+	report_init();
+
+	bench_postprocess(n);
+	bench_read_drain(*latency ? 10 : 100, 1000);
+	bench_pulse_gen(*latency ? 1000 : 100000);
+	bench_commit_pulse_gen(*latency ? 1000 : 100000);
+	bench_bus_trace(*latency ? 1000 : 100000);
+	bench_configure_output(*latency ? 1000 : 100000);
+	bench_ds18x(*latency ? 10 : 50);
+	bench_log(n);
+	bench_tslog(*latency ? 100000 : 1000000);
+	bench_acq(n);
+	bench_acq_merge("acq_merge", n, ACQ_BENCH_SYNCED);
+	bench_acq_merge("acq_merge_lag", n / 10 > 4096 ? n / 10 : 4096, ACQ_BENCH_LAG);
+	bench_acq_merge("acq_merge_unsynced", n / 10 > 4096 ? n / 10 : 4096, ACQ_BENCH_UNSYNCED);
+	bench_wait("wait_spin", 100, 2000, 0);
+	bench_wait("wait_deadline", 100, 2000, 1);
+	bench_sched(50, 40000000000LL);
+	bench_wr_resync(*latency ? 1000 : 100000);
+
+	if(failures)
+	{
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,38 @@
+/* Prints a bus access trace saved by fdelay_bus_trace_save() (or by fdelay_init() with
+   FDELAY_BUS_TRACE=<file>) with the register names.
+
+   Usage: fdelay_trace_decode <trace file> */
+
+#include <stdio.h>
+
+#include "fdelay_lib.h"
+
+int main(int argc, char *argv[])
+{
+	FILE *f;
+	int rv;
+
+	if(argc < 2)
+	{
+		fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+		return -1;
+	}
+
+	f = fopen(argv[1], "rb");
+	if(!f)
+	{
+		perror(argv[1]);
+		return -1;
+	}
+
+	rv = fdelay_bus_trace_decode(f, stdout);
+	fclose(f);
+
+	if(rv < 0)
+	{
+		fprintf(stderr, "%s: not a valid bus trace file\n", argv[1]);
+		return -1;
+	}
+
+	return 0;
+}
@@ -11,30 +11,14 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/select.h>
 
 #define FDELAY_INTERNAL // for sysfs_get/set
 #include "fdelay_lib.h"
-
-#define PACKED __attribute__((packed))
-
-#define TYPE_START_LOGGING 1
-#define TYPE_END_LOGGING 2
-#define TYPE_TIMESTAMP 3
-
-struct fdelay_time {
-	uint64_t utc;
-	uint32_t coarse;
-	uint32_t frac;
-	uint32_t seq_id;
-	uint32_t channel;
-};
-
-PACKED struct binary_timestamp {
-	int32_t card_id;
-	uint8_t type;
-	PACKED struct fdelay_time ts;
-};
+#include "fdelay_tslog.h"
+#include "fdelay_acq.h"
 
 
 #define MAX_BOARDS 64
@@ -48,6 +32,12 @@ struct board_def {
 	int in_use;
 	int fd;
 	int prev_seq;
+	int log_card;		/* index of the card in the log's card table */
+	pthread_t thread;	/* readout worker */
+	struct fdelay_acq_queue *queue;	/* timestamps read out, waiting to be logged */
+	int unsynced;		/* WR sync lost, relocking */
+	time_t unsynced_since;
+	uint64_t resyncs, unsynced_events;
 	
 	struct {
 		int64_t offset_pps, width, period;
@@ -58,51 +48,79 @@ struct board_def {
 
 struct board_def boards[MAX_BOARDS];
 
-static FILE *log_file = NULL;
+/* The timestamps are written out by the log writer thread, in batches (see log_* in the config file) */
+static struct fdelay_tslog *ts_log = NULL;
+static char *log_file_name = NULL;
+static struct fdelay_tslog_policy log_policy = FDELAY_TSLOG_DEFAULT_POLICY;
+
+/* Each card is read out by its own thread; the main thread merges the timestamps from their queues
+   in time order and logs them */
+static int queue_size = 65536;
+static int stats_interval = 0;
+static int resync_timeout = 50;		/* s before a card that can't relock is reinitialized, 0 = never */
+static struct fdelay_acq_merge_config merge_cfg = FDELAY_ACQ_MERGE_DEFAULT_CONFIG;
+static struct fdelay_acq_merge *merge;
+static struct board_def *merge_boards[MAX_BOARDS];	/* boards, by index in the merge */
 
-void log_write(fdelay_time_t *t, const char *location)
+static volatile sig_atomic_t stop = 0;
+
+void log_write(fdelay_time_t *t, struct board_def *bdef, int flags)
 {
-	struct binary_timestamp bt;
-	if(!log_file)
+	struct fdelay_tslog_record r;
+	int rv;
+
+	if(!ts_log)
 		return;
-	bt.ts.utc = t->utc;
-	bt.ts.coarse = t->coarse;
-	bt.ts.frac = t->frac;
-	bt.ts.seq_id = t->seq_id;
-	bt.ts.channel = 0;
-	bt.type = TYPE_TIMESTAMP;
-	bt.card_id = 0; //card_id; // fixme: hash location string?
-	fwrite(&bt, sizeof(struct binary_timestamp), 1, log_file);
-	fflush(log_file);
+
+	if(flags & FDELAY_ACQ_UNSYNCED)
+	{
+		r.utc = t->utc;
+		r.coarse = t->coarse;
+		r.frac = t->frac;
+		r.seq_id = t->seq_id;
+		r.card = bdef->log_card;
+		r.type = FDELAY_TSLOG_UNSYNCED;
+		r.channel = 0;
+		rv = fdelay_tslog_write_record(ts_log, &r);
+	} else
+		rv = fdelay_tslog_write(ts_log, bdef->log_card, t);
+
+	if(rv < 0)
+		fprintf(stderr, "Error writing the log file\n");
 }
 
 void log_start(char *log_file_name)
 {
-		struct binary_timestamp bt;
-		log_file = fopen(log_file_name, "a+");
+		int i;
 
-		if(!log_file)
+		ts_log = fdelay_tslog_open(log_file_name, &log_policy);
+
+		if(!ts_log)
 		{
 			fprintf(stderr, "Can't open the log file: %s\n", log_file_name);
 			exit(-1);
 		}
 
-		bt.card_id = 0;
-		bt.type = TYPE_START_LOGGING;
-		fwrite(&bt, sizeof(struct binary_timestamp), 1, log_file);
-		fflush(log_file);
+		for(i=0;i<MAX_BOARDS;i++)
+			if(boards[i].in_use)
+				boards[i].log_card = fdelay_tslog_add_card(ts_log, boards[i].location ? boards[i].location : "");
 }
 
 void log_stop()
 {
-		struct binary_timestamp bt;
-		if(!log_file)
+		struct fdelay_tslog_stats st;
+
+		if(!ts_log)
 			return;
-		bt.card_id = 0;
-		bt.type = TYPE_END_LOGGING;
-		fwrite(&bt, sizeof(struct binary_timestamp), 1, log_file);
-		fflush(log_file);
-		fclose(log_file);
+
+		fdelay_tslog_get_stats(ts_log, &st);
+		if(fdelay_tslog_close(ts_log) < 0)
+			fprintf(stderr, "Error writing the log file\n");
+		ts_log = NULL;
+
+		fprintf(stderr, "Logged %llu timestamps in %llu writes (largest %d), %llu fsyncs, %llu stalls\n",
+			(unsigned long long) st.events, (unsigned long long) st.writes, st.max_batch,
+			(unsigned long long) st.fsyncs, (unsigned long long) st.stalls);
 }
 
 int64_t parse_num(const char *n_str)
@@ -251,11 +269,53 @@ void load_config(const char *config_file)
 		}	
 		
 		if(!strcmp(cmd, "log_file"))
-			log_start(args[0]);
+			log_file_name = strdup(args[0]);
+
+		if(!strcmp(cmd, "log_buffer"))
+			log_policy.buffer_events = parse_num(args[0]);
+
+		if(!strcmp(cmd, "log_flush_events"))
+			log_policy.flush_events = parse_num(args[0]);
+
+		if(!strcmp(cmd, "log_flush_ms"))
+			log_policy.flush_ms = parse_num(args[0]);
+
+		if(!strcmp(cmd, "log_fsync_ms"))
+			log_policy.fsync_ms = parse_num(args[0]);
+
+		if(!strcmp(cmd, "readout_queue"))
+			queue_size = parse_num(args[0]);
+
+		if(!strcmp(cmd, "stats_interval"))
+			stats_interval = parse_num(args[0]);
+
+		if(!strcmp(cmd, "resync_timeout"))
+			resync_timeout = parse_num(args[0]);
+
+		if(!strcmp(cmd, "merge_lateness"))
+			merge_cfg.lateness_ps = parse_num(args[0]);
+
+		if(!strcmp(cmd, "merge_max_delay_ms"))
+			merge_cfg.max_delay_ms = parse_num(args[0]);
+
+		if(!strcmp(cmd, "merge_late"))
+			merge_cfg.drop_late = !strcmp(args[0], "drop");
+
+		if(!strcmp(cmd, "log_segment_size"))
+			log_policy.segment_bytes = parse_num(args[0]);
+
+		if(!strcmp(cmd, "log_segment_time"))
+			log_policy.segment_s = parse_num(args[0]);
+
+		if(!strcmp(cmd, "log_encoding"))
+			log_policy.encoding = !strcmp(args[0], "raw") ? FDELAY_TSLOG_ENC_RAW : FDELAY_TSLOG_ENC_DELTA;
 	
 	}
 	
 	fclose(f_config);
+
+	if(log_file_name)
+		log_start(log_file_name);
 }
 
 #undef CUR
@@ -285,30 +345,13 @@ void enable_wr(fdelay_device_t *b)
 	fflush(stdout);
 }
 
-/* Add two timestamps */
-static fdelay_time_t ts_add(fdelay_time_t a, fdelay_time_t b)
-{
-    a.frac += b.frac;
-    if(a.frac >= 4096)
-    {
-        a.frac -= 4096;
-	a.coarse++;
-    }
-    a.coarse += b.coarse;
-    if(a.coarse >= 125000000)
-    {
-        a.coarse -= 125000000;
-	a.utc ++;
-    }
-    a.utc += b.utc;
-    return a;
-}
                                                                     
 
 int configure_board(struct board_def *bdef)
 {
-	fdelay_device_t *b = malloc(sizeof(fdelay_device_t));
-	int i;
+	fdelay_device_t *b = calloc(1, sizeof(fdelay_device_t));
+	fdelay_time_t t_now;
+	int i, out_mask = 0;
 	
 
 	
@@ -344,14 +387,15 @@ int configure_board(struct board_def *bdef)
 //	    fdelay_sysfs_set((struct __fdelay_board *)b, path,(uint32_t *) &val);
 	}
 
+	fdelay_get_time(bdef->b, &t_now);
+
 	for(i=0;i<4;i++)
 	{
 	    if(bdef->outs[i].enabled)
 	    {
-		fdelay_time_t t_cur, pps_offset, width;
+		fdelay_time_t t_cur = t_now, pps_offset, width;
 //		struct fdelay_pulse p;
 		
-		fdelay_get_time(bdef->b, &t_cur);
 
 //		printf("Configure output %d [t_cur %d:%d]\n", i+1,t_cur.utc, t_cur.coarse);
 
@@ -363,12 +407,13 @@ int configure_board(struct board_def *bdef)
 		t_cur.utc += 2;
 		t_cur.coarse = 0;
 		t_cur.frac = 0;
-		t_cur = ts_add(t_cur, fdelay_from_picos(bdef->outs[i].offset_pps));
+		t_cur = fdelay_ts_add(t_cur, fdelay_from_picos(bdef->outs[i].offset_pps));
 
 
 		//printf("Configure output %d [t_start %d:%d width %lld period %lld]\n", i+1,t_cur.utc, t_cur.coarse, bdef->outs[i].width, bdef->outs[i].period);
 
-		fdelay_configure_pulse_gen(bdef->b, i+1, 1, t_cur, bdef->outs[i].width, bdef->outs[i].period, -1);
+		fdelay_stage_pulse_gen(bdef->b, 1 << i, 1, t_cur, bdef->outs[i].width, bdef->outs[i].period, -1);
+		out_mask |= 1 << i;
 
   
 //		fdelay_configure_output_pulse()
@@ -376,7 +421,7 @@ int configure_board(struct board_def *bdef)
 /*		p.rep = -1;
 		p.mode = FD_OUT_MODE_PULSE;
 		p.start = t_cur;
-		p.end = ts_add(t_cur, width);*/
+		p.end = fdelay_ts_add(t_cur, width);*/
 //		fdelay_pico_to_time(&bdef->outs[i].period, &p.loop);
 //		fdelay_config_pulse(bdef->b, i, &p);
 	    }
@@ -385,9 +430,11 @@ int configure_board(struct board_def *bdef)
 /*enable input */
 
 
-	for(i=0;i<4;i++)
-	    if(bdef->outs[i].enabled)
-		  	while(!fdelay_channel_triggered(bdef->b, i+1)) usleep(100000);
+	if(out_mask)
+	{
+		fdelay_commit_pulse_gen(bdef->b, out_mask);
+		fdelay_outputs_triggered(bdef->b, out_mask, 1);
+	}
 
 
 	
@@ -397,73 +444,153 @@ int configure_board(struct board_def *bdef)
     return 0;
 }
 
-/* Substract two timestamps */
-static fdelay_time_t ts_sub(fdelay_time_t a, fdelay_time_t b)
-{
- 	a.frac -= b.frac;
- 	if(a.frac < 0)
- 	{
- 	 	a.frac += 4096;
- 	 	a.coarse--;
- 	}
- 	a.coarse -= b.coarse;
- 	if(a.coarse < 0)
- 	{
- 	 	a.coarse += 125000000;
- 	 	a.utc --;
- 	}
- 	a.utc -= b.utc;
- 	return a;
-}
 
 
-void handle_readout(struct board_def *bdef)
+/* Reads out the timestamps of a card, as long as there's room for them in its queue
+   (otherwise they wait in the card's buffer). Returns 0 if the queue filled up before
+   the card's buffer was emptied. */
+int handle_readout(struct board_def *bdef)
 {
     int64_t t_ps;
     fdelay_time_t t;
-   static fdelay_time_t t_prev;
-    static time_t start;
-   
-    int done;
 
-    while(fdelay_read(bdef->b, &t, 1) == 1)
-    {	    
+    for(;;)
+    {
+		if(!fdelay_acq_space(bdef->queue))
+			return 0;
+		if(fdelay_read(bdef->b, &t, 1) != 1)
+			return 1;
+	    
 
 		t_ps = (t.coarse * 8000LL) + ((t.frac * 8000LL) >> 12);
-		printf("card %s, seq %5i: time %lli s, %lli.%03lli ns [count %d] ", bdef->location, t.seq_id, t.utc, t_ps / 1000LL, t_ps % 1000LL, (t.raw.tsbcr >> 10) & 0x3ff);
+		/* One printf() per line: the cards are read out by different threads */
+		printf("card %s, seq %5i: time %lli s, %lli.%03lli ns [count %d] %s%s\n", bdef->location, t.seq_id, t.utc, t_ps / 1000LL, t_ps % 1000LL, (t.raw.tsbcr >> 10) & 0x3ff,
+			((bdef->prev_seq + 1) & 0xffff) != (t.seq_id & 0xffff) ? "MISMATCH" : "", bdef->unsynced ? " UNSYNCED" : "");
 	//	printf("raw utc=%lld coarse=%d startoffs=%d suboffs=%d frac=%d [%x]\n", t.raw.utc, t.raw.coarse, t.raw.start_offset, t.raw.subcycle_offset, t.raw.frac- 30000, t.raw.frac);
-		log_write(&t, bdef->location);
-	
-		if(((bdef->prev_seq + 1) & 0xffff) != (t.seq_id & 0xffff))
-		{
-			printf("MISMATCH\n");
-		} else printf("\n");
+		fdelay_acq_push(bdef->queue, &t, bdef->unsynced ? FDELAY_ACQ_UNSYNCED : 0);
+		if(bdef->unsynced)
+			bdef->unsynced_events++;
 		
 //		printf("raw %d %d\n", t.raw.start_offset, t.raw.frac-30000);
-//		printf("delta %lld\n", fdelay_to_picos(ts_sub(t,t_prev)));
+//		printf("delta %lld\n", fdelay_to_picos(fdelay_ts_sub(t,t_prev)));
 		bdef->prev_seq = t.seq_id;
-		t_prev = t;
     }
 }
 
+/* Follows the WR sync of a card. When the lock is lost, WR is restarted without reinitializing the card
+   and the lock is polled from the readout loop: the card keeps time tagging on its local oscillator and
+   its timestamps are logged as unsynced meanwhile. A relocked card is marked synced only once the
+   timestamps left in its buffer have been read out. Only a card that doesn't relock within resync_timeout
+   seconds is reinitialized (which blocks its readout until it locks). */
+void check_sync(struct board_def *bdef)
+{
+	if(!bdef->unsynced)
+	{
+		/* The sync status changed: a lock that was lost and found again between two polls needs nothing */
+		if(!fdelay_dbg_sync_lost(bdef->b) || fdelay_check_sync(bdef->b) > 0)
+			return;
+
+		printf("Sync lost @ board %s, relocking...\n", bdef->location);
+		fdelay_wr_resync(bdef->b);
+		bdef->unsynced = 1;
+		bdef->unsynced_since = time(NULL);
+		return;
+	}
+
+	if(fdelay_check_sync(bdef->b) > 0)
+	{
+		/* The timestamps taken before the lock are read out as unsynced; with the queue full,
+		   try again on the next poll */
+		if(!handle_readout(bdef))
+			return;
+
+		printf("Board %s relocked after %d s\n", bdef->location, (int) (time(NULL) - bdef->unsynced_since));
+		bdef->unsynced = 0;
+		bdef->resyncs++;
+	} else if(resync_timeout > 0 && time(NULL) - bdef->unsynced_since >= resync_timeout) {
+		printf("Board %s not relocked after %d s. Reconfiguring...\n", bdef->location, resync_timeout);
+		configure_board(bdef);
+		fdelay_configure_readout(bdef->b, 1);
+		fdelay_configure_trigger(bdef->b, 1, bdef->term_on);
+		bdef->unsynced = 0;
+		bdef->resyncs++;
+	}
+}
+
+/* Readout worker of a card: a slow card or a card being reconfigured only delays its own timestamps */
+void *readout_thread(void *arg)
+{
+	struct board_def *bdef = arg;
+
+	while(!stop)
+	{
+		check_sync(bdef);
+		handle_readout(bdef);
+		usleep(100);
+	}
+
+	return NULL;
+}
+
+/* Logs the timestamps the merge can emit (all the pending ones if (flush) is set). Returns their number. */
+int drain_queues(int flush)
+{
+	struct fdelay_acq_event ev[256];
+	int i, n, total = 0;
+
+	while((n = flush ? fdelay_acq_merge_flush(merge, ev, 256) : fdelay_acq_merge_poll(merge, ev, 256)) > 0)
+	{
+		for(i = 0; i < n; i++)
+			log_write(&ev[i].t, merge_boards[ev[i].card], ev[i].flags);
+		total += n;
+	}
+
+	return total;
+}
+
+void print_stats()
+{
+	struct fdelay_acq_stats st;
+	struct fdelay_acq_merge_stats ms;
+	int i;
+
+	fdelay_acq_merge_get_stats(merge, &ms);
+	fprintf(stderr, "merge: %llu timestamps, %llu late (%llu dropped), %llu emitted after merge_max_delay_ms, latency avg %.1f us max %.1f us\n",
+		(unsigned long long) ms.events, (unsigned long long) ms.late, (unsigned long long) ms.dropped,
+		(unsigned long long) ms.forced, ms.events ? (double) ms.latency_sum_ns / ms.events / 1000.0 : 0.0,
+		(double) ms.latency_max_ns / 1000.0);
+
+	for(i=0;i<MAX_BOARDS;i++)
+	{
+		if(!boards[i].in_use)
+			continue;
+
+		fdelay_acq_get_stats(boards[i].queue, &st);
+		fprintf(stderr, "card %s: %llu timestamps, backlog %llu (max %llu), drain latency avg %.1f us max %.1f us, queue full %llu times, "
+			"%llu resyncs, %llu unsynced timestamps%s\n",
+			boards[i].location, (unsigned long long) st.events, (unsigned long long) st.backlog,
+			(unsigned long long) st.max_backlog, st.events ? (double) st.latency_sum_ns / st.events / 1000.0 : 0.0,
+			(double) st.latency_max_ns / 1000.0, (unsigned long long) st.full,
+			(unsigned long long) boards[i].resyncs, (unsigned long long) boards[i].unsynced_events,
+			boards[i].unsynced ? " (relocking)" : "");
+	}
+}
+
 
+/* The log is closed by the main loop: the writer thread can't be stopped from a signal handler */
 void sighandler(int sig)
 {
     if(sig == SIGINT || sig== SIGTERM || sig==SIGKILL)
-    {
-	fprintf(stderr,"Cleaniung up...\n");
-	log_stop();
-	exit(0);
-    }
+	stop = 1;
 }
 
 
-int fdelay_dbg_sync_lost(fdelay_device_t *dev);
 
 int main(int argc, char *argv[])
 {
-	int i, maxfd = -1;
-	fd_set allset, curset;
+	struct fdelay_acq_queue *queues[MAX_BOARDS];
+	int i, n_queues = 0;
+	time_t next_stats;
 	
 	signal(SIGINT, sighandler);
 	signal(SIGTERM, sighandler);
@@ -494,31 +621,46 @@ int main(int argc, char *argv[])
 			fdelay_configure_trigger(boards[i].b, 1, boards[i].term_on);	
 			boards[i].prev_seq = -1;
 
+			boards[i].queue = fdelay_acq_queue_create(queue_size);
+			if(!boards[i].queue || pthread_create(&boards[i].thread, NULL, readout_thread, &boards[i]))
+			{
+				fprintf(stderr, "Can't start the readout of board @ %s\n", boards[i].location);
+				exit(-1);
+			}
 
+			merge_boards[n_queues] = &boards[i];
+			queues[n_queues++] = boards[i].queue;
 		}
 
+	merge = fdelay_acq_merge_create(queues, n_queues, &merge_cfg);
+	if(!merge)
+	{
+		fprintf(stderr, "Can't create the merge of the timestamp streams\n");
+		exit(-1);
+	}
 
+	next_stats = time(NULL) + stats_interval;
 
-	for(;;)
+	while(!stop)
 	{
-		for(i=0;i<MAX_BOARDS;i++) {
-			if(!boards[i].in_use)
-				continue;
-//			printf(".");
-			handle_readout(&boards[i]);
-		
-			if(fdelay_dbg_sync_lost(boards[i].b))
-			{
-			 	printf("Weird, sync lost @ board %p. Reconfiguring...\n", boards[i].b);
-			 	configure_board(&boards[i]);
-
-			}
+		if(!drain_queues(0))
+			usleep(100);
 
+		if(stats_interval > 0 && time(NULL) >= next_stats)
+		{
+			print_stats();
+			next_stats += stats_interval;
 		}
-		usleep(100);
-
-		
 	}
 	
-	
+	fprintf(stderr,"Cleaning up...\n");
+
+	for(i=0;i<MAX_BOARDS;i++)
+		if(boards[i].in_use)
+			pthread_join(boards[i].thread, NULL);
+
+	drain_queues(1);
+	log_stop();
+	print_stats();
+	return 0;
 }
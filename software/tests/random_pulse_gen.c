@@ -12,44 +12,8 @@
 
 #define FDELAY_INTERNAL // for sysfs_get/set
 #include "fdelay_lib.h"
+#include "fdelay_sched.h"
 
-/* Add two timestamps */
-static fdelay_time_t ts_add(fdelay_time_t a, fdelay_time_t b)
-{
-    a.frac += b.frac;
-    if(a.frac >= 4096)
-    {
-        a.frac -= 4096;
-		a.coarse++;
-    }
-    a.coarse += b.coarse;
-    if(a.coarse >= 125000000)
-    {
-        a.coarse -= 125000000;
-	a.utc ++;
-    }
-    a.utc += b.utc;
-    return a;
-}
-
-fdelay_time_t ts_sub(fdelay_time_t a, fdelay_time_t b)
-{
-	a.frac -= b.frac;
-  	if(a.frac < 0)
-   	{
-  		a.frac += 4096;
-     	a.coarse--;
-    }
-    a.coarse -= b.coarse;
-    if(a.coarse < 0)
-    {
-    	a.coarse += 125000000;
-        a.utc --;
-    }
-    a.utc-=b.utc;
-    return a;
-}
-             
 int64_t rrand64(int64_t min, int64_t max)
 {
 	int i;
@@ -61,30 +25,26 @@ int64_t rrand64(int64_t min, int64_t max)
 	return min+tmp;
 }
 
-int armed = 0;
-
 static int64_t min_gap, max_gap;
-static fdelay_time_t t;
 
-void produce_pulses(fdelay_device_t *b)
+/* Queues as many pulses as fit in the scheduler, each one a random gap after the previous one */
+int produce_pulses(struct fdelay_sched *s, fdelay_time_t *t, int count, int produced)
 {
-	int64_t delta;
-	fdelay_time_t  td;
+	fdelay_pulse_t p;
 
-	if(armed && !fdelay_channel_triggered(b, 1))
-		return ;
+	while(count < 0 || produced < count)
+	{
+		p.start = fdelay_ts_add_ps(*t, rrand64(min_gap, max_gap));
+		p.width_ps = min_gap/3;
 
-	delta = rrand64(min_gap, max_gap);
-	fdelay_get_time(b, &t);
+		if(fdelay_sched_push(s, 1, &p, 1) != 1)
+			break;
 
-	td = fdelay_from_picos(delta);
-	
-	t = ts_add(t, td);
-	
+		*t = p.start;
+		produced++;
+	}
 
-	fdelay_configure_pulse_gen(b, 1, 1, t, min_gap/3, 0, 1);
-	
-	armed = 1;
+	return produced;
 }
 
 
@@ -113,16 +73,25 @@ int main(int argc, char *argv[])
 	min_gap =(int64_t) (atof(argv[2]) * 1000000.0);
 	max_gap =(int64_t) (atof(argv[3]) * 1000000.0);
 	
+	struct fdelay_sched *s = fdelay_sched_create(b, 256, 0);
+	struct fdelay_sched_stats st;
+	fdelay_time_t t;
 	int i = 0;
 
+	/* leave the scheduler some time to arm the first pulse */
+	fdelay_get_time(b, &t);
+	t = fdelay_ts_add_ps(t, 10 * FDELAY_SCHED_DEFAULT_SETUP_PS);
 
-	while(count < 0 || (i < count))
-	{
-    	    produce_pulses(b);
-	    i++;
-	}
+	do {
+	    i = produce_pulses(s, &t, count, i);
+	} while(fdelay_sched_poll(s) > 0);
+
+	fdelay_sched_get_stats(s, 1, &st);
+	printf("generated %lld pulses, %lld missed\n", (long long) st.done, (long long) st.missed);
+	printf("rate: %.1f Hz, max sustainable: %.1f Hz (%lld ns service, %lld ns detection per pulse), min. arming lead: %lld ps\n",
+	    st.rate_hz, st.max_rate_hz, (long long) st.service_ns, (long long) st.detect_ns, (long long) st.min_lead_ps);
 
-	printf("generated %d pulses\n", i);
+	fdelay_sched_destroy(s);
 
 	return 0;
 }
@@ -65,46 +65,6 @@ int pqueue_pop(struct pulse_queue *p, fdelay_time_t *t)
 
 struct pulse_queue outgoing, incoming;
 
-/* Add two timestamps */
-static fdelay_time_t ts_add(fdelay_time_t a, fdelay_time_t b)
-{
-    a.frac += b.frac;
-    if(a.frac >= 4096)
-    {
-        a.frac -= 4096;
-		a.coarse++;
-    }
-    a.coarse += b.coarse;
-    if(a.coarse >= 125000000)
-    {
-        a.coarse -= 125000000;
-	a.utc ++;
-    }
-    a.utc += b.utc;
-    return a;
-}
-
-fdelay_time_t ts_sub(fdelay_time_t a, fdelay_time_t b)
-{
-	a.frac -= b.frac;
-  	if(a.frac < 0)
-   	{
-  		a.frac += 4096;
-     	a.coarse--;
-    }
-    a.coarse -= b.coarse;
-    if(a.coarse < 0)
-    {
-    	a.coarse += 125000000;
-        a.utc --;
-    }
-    a.utc-=b.utc;
-    return a;
-}
-             
-             
-                                                                    
-
 #define MIN_SPACING_US 5000LL
 #define MAX_SPACING_US 10000LL
 
@@ -135,7 +95,7 @@ void produce_pulses(fdelay_device_t *b)
 	td = fdelay_from_picos(delta);
 	
 //	printf("TD %lld:%d:%d\n", t.utc, t.coarse, t.frac);
-	t = ts_add(t, td);
+	t = fdelay_ts_add(t, td);
 
 	fdelay_configure_pulse_gen(b, 1, 1, t, 1*1000000, 0, 1);
 	pqueue_push(&outgoing, &t);
@@ -245,7 +205,7 @@ void verify()
  	 	pqueue_pop(&outgoing, &to);
  	 	pqueue_pop(&incoming, &ti);
  	 	
- 	 	delta = ts_sub(to, ti);
+ 	 	delta = fdelay_ts_sub(to, ti);
  	 	delta_ps = fdelay_to_picos(delta);
  	 	
  	 	if(delta_ps < delta_min)
@@ -64,6 +64,9 @@ main(int argc, char *argv[])
 {
 	fdelay_device_t dev;
 
+	/* The temperature regulator messages are the point of this program */
+	fdelay_set_log_level(FDELAY_LOG_DEBUG, FDELAY_LOG_DEBUG);
+
 	if(spec_fdelay_create(&dev, argc, argv) < 0)
 	{
 		fprintf(stderr,"Card probe failed.\n");
@@ -0,0 +1,90 @@
+/* Converts a log written by the original gs_logger (a stream of packed 29-byte records)
+   to the indexed timestamp log format.
+
+   Usage: tslog_convert <old log> <new log> */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fdelay_lib.h"
+#include "fdelay_tslog.h"
+
+int main(int argc, char *argv[])
+{
+	struct fdelay_tslog_v1_record old;
+	struct fdelay_tslog_record r;
+	struct fdelay_tslog *l;
+	int32_t old_ids[FDELAY_TSLOG_MAX_CARDS];
+	int n_ids = 0, i;
+	uint64_t n = 0;
+	FILE *f;
+
+	if(argc < 3)
+	{
+		fprintf(stderr, "usage: %s <old log> <new log>\n", argv[0]);
+		return -1;
+	}
+
+	f = fopen(argv[1], "rb");
+	if(!f)
+	{
+		perror(argv[1]);
+		return -1;
+	}
+
+	l = fdelay_tslog_open(argv[2], NULL);
+	if(!l)
+	{
+		fprintf(stderr, "Can't open the log file: %s\n", argv[2]);
+		return -1;
+	}
+
+	while(fread(&old, sizeof(old), 1, f) == 1)
+	{
+		/* The old logs don't know the card locations: name the cards after their IDs */
+		for(i = 0; i < n_ids; i++)
+			if(old_ids[i] == old.card_id)
+				break;
+
+		if(i == n_ids)
+		{
+			char name[32];
+
+			snprintf(name, sizeof(name), "card%d", old.card_id);
+			if(fdelay_tslog_add_card(l, name) < 0)
+			{
+				fprintf(stderr, "Too many cards\n");
+				return -1;
+			}
+			old_ids[n_ids++] = old.card_id;
+		}
+
+		/* The START/END records of the old sessions are kept as they are, inside the ones
+		   framing the conversion */
+		r.utc = old.utc;
+		r.coarse = old.coarse;
+		r.frac = old.frac;
+		r.seq_id = old.seq_id;
+		r.card = i;
+		r.type = old.type;
+		r.channel = old.channel;
+
+		if(fdelay_tslog_write_record(l, &r) < 0)
+		{
+			fprintf(stderr, "Error writing %s\n", argv[2]);
+			return -1;
+		}
+		n++;
+	}
+
+	fclose(f);
+
+	if(fdelay_tslog_close(l) < 0)
+	{
+		fprintf(stderr, "Error writing %s\n", argv[2]);
+		return -1;
+	}
+
+	printf("%llu records converted\n", (unsigned long long) n);
+	return 0;
+}
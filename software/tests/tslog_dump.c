@@ -0,0 +1,72 @@
+/* Prints the records of a timestamp log, optionally only the ones between two UTC seconds
+   (found with a binary search in the block index, not by scanning the file).
+
+   Usage: tslog_dump <log> [from_utc [to_utc]] */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fdelay_lib.h"
+#include "fdelay_tslog.h"
+
+int main(int argc, char *argv[])
+{
+	struct fdelay_tslog_reader *r;
+	const struct fdelay_tslog_header *hdr;
+	struct fdelay_tslog_record rec[1024];
+	int64_t from = 0, to = INT64_MAX;
+	uint64_t pos;
+	int i, n;
+
+	if(argc < 2)
+	{
+		fprintf(stderr, "usage: %s <log> [from_utc [to_utc]]\n", argv[0]);
+		return -1;
+	}
+
+	if(argc > 2)
+		from = atoll(argv[2]);
+	if(argc > 3)
+		to = atoll(argv[3]);
+
+	r = fdelay_tslog_map(argv[1]);
+	if(!r)
+	{
+		fprintf(stderr, "Can't read the log file: %s\n", argv[1]);
+		return -1;
+	}
+
+	hdr = fdelay_tslog_get_header(r);
+	printf("# %llu records%s\n", (unsigned long long) fdelay_tslog_count(r),
+		hdr->index_offset ? "" : " (log not closed, index rebuilt)");
+	for(i = 0; i < hdr->n_cards; i++)
+		printf("# card %d: id %08x, location %s\n", i, hdr->cards[i].card_id, hdr->cards[i].location);
+
+	pos = argc > 2 ? fdelay_tslog_seek(r, from) : 0;
+
+	while((n = fdelay_tslog_read(r, pos, rec, 1024)) > 0)
+	{
+		for(i = 0; i < n; i++)
+		{
+			if(!FDELAY_TSLOG_IS_TIMESTAMP(rec[i].type))
+			{
+				printf("%s\n", rec[i].type == FDELAY_TSLOG_START ? "START" : "END");
+				continue;
+			}
+
+			/* The time of the unsynchronized timestamps doesn't follow the others' */
+			if(rec[i].type == FDELAY_TSLOG_TIMESTAMP && rec[i].utc > to)
+				goto done;
+
+			if(rec[i].utc >= from && rec[i].utc <= to)
+				printf("card %d seq %5d: %lld s %d cycles %d frac%s\n", rec[i].card, rec[i].seq_id,
+					(long long) rec[i].utc, rec[i].coarse, rec[i].frac,
+					rec[i].type == FDELAY_TSLOG_UNSYNCED ? " (unsynced)" : "");
+		}
+		pos += n;
+	}
+
+done:
+	fdelay_tslog_unmap(r);
+	return 0;
+}